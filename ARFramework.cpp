@@ -1,34 +1,36 @@
 #include "ARFramework.hpp"
 #include <chrono>
+#include <iterator>
+#include <algorithm>
 
-ARFramework::ARFramework(
+ARFrameworkBase::ARFrameworkBase(
         GraphManager& graph_manager,
         grid::region dr,
         grid::point ip,
         grid::point gran,
-        grid::region orig_r,
-        std::function<bool(grid::point const&)> const& safety_pred,
-        grid::verification_engine_type_t const& verif_engine, 
-        grid::region_abstraction_strategy_t const& abs_strat, 
-        grid::region_refinement_strategy_t const& ref_strat)
+        grid::region orig_r)
     : 
         potentiallyUnsafeRegions(),
-        pur_mutex(),
-        safeRegions(),
+        frontier_cap(0u),
+        frontier_spill(),
+        safeRegions(ip, gran),
         sr_mutex(),
-        unsafeRegionsWithAdvExamples(),
-        ur_mutex(),
-        adversarialExamples(),
-        ae_mutex(),
+        lattice_hash(ip, gran),
+        unsafeRegionsWithAdvExamples(1u << 12),
+        adversarialExamples(1u << 16),
+        known_safe_points(),
+        skipped_safe_points(0u),
         keep_working(true),
+        work_mutex(),
+        work_available(),
+        regions_in_flight(0u),
+        search_exhausted(false),
         gm(graph_manager),
         domain_range(dr),
         init_point(ip),
         granularity(gran),
-        abstraction_strategy(abs_strat),
-        refinement_strategy(ref_strat),
-        verification_engine(verif_engine),
-        safety_predicate(safety_pred),
+        batch_safety_predicate(),
+        abstraction_feedback(),
         logging_thread_id(),
         log_thread_set(ATOMIC_FLAG_INIT),
         orig_region()
@@ -40,287 +42,458 @@ ARFramework::ARFramework(
         LOG(ERROR) << "Invalid original region";
         exit(1);
     }
-    potentiallyUnsafeRegions.insert(orig_region);
+    potentiallyUnsafeRegions.emplace_back(new frontier_partition());
+    potentiallyUnsafeRegions.front()->regions.insert(orig_region);
 }
 
-void ARFramework::log_status()
+void ARFrameworkBase::set_frontier_partitions(std::size_t count)
 {
-    std::cout << "Unverified Regions: " 
-        << potentiallyUnsafeRegions.size() << "\n";
+    count = std::max<std::size_t>(1u, count);
+    std::vector<grid::region> regions;
+    for(auto&& part : potentiallyUnsafeRegions)
+        std::copy(part->regions.begin(), part->regions.end(),
+                std::back_inserter(regions));
+    potentiallyUnsafeRegions.clear();
+    for(auto i = 0u; i < count; ++i)
+        potentiallyUnsafeRegions.emplace_back(new frontier_partition());
+    for(auto i = 0u; i < regions.size(); ++i)
+        potentiallyUnsafeRegions[i % count]->regions.insert(regions[i]);
+}
+
+void ARFrameworkBase::set_safe_point_filter(std::size_t bytes)
+{
+    if(bytes == 0u)
+        known_safe_points.reset();
+    else
+        known_safe_points.reset(
+                new thread_tool::ConcurrentBloomFilter(bytes * 8u));
+}
+
+bool ARFrameworkBase::frontier_empty() const
+{
+    for(auto&& part : potentiallyUnsafeRegions)
+    {
+        std::lock_guard<std::mutex> lock(part->mutex);
+        if(!part->regions.empty()) return false;
+    }
+    return true;
+}
+
+std::size_t ARFrameworkBase::frontier_size() const
+{
+    std::size_t retVal = 0u;
+    for(auto&& part : potentiallyUnsafeRegions)
+    {
+        std::lock_guard<std::mutex> lock(part->mutex);
+        retVal += part->regions.size();
+    }
+    return retVal;
+}
+
+bool ARFrameworkBase::pop_region(std::size_t partition, grid::region& out)
+{
+    auto count = potentiallyUnsafeRegions.size();
+    for(auto i = 0u; i < count; ++i)
+    {
+        auto& part = *potentiallyUnsafeRegions[(partition + i) % count];
+        bool should_prefetch = false;
+        {
+            std::lock_guard<std::mutex> lock(part.mutex);
+            if(part.regions.empty()) continue;
+            // stack
+            /*
+            out = part.regions.back();
+            part.regions.pop_back();
+            */
+
+            // queue
+            /*
+            out = part.regions.front();
+            part.regions.pop_front();
+            */
+
+            out = std::move(
+                    part.regions.extract(part.regions.begin()).value());
+            should_prefetch = frontier_spill && i == 0u &&
+                part.regions.size() < frontier_cap / count / 4u;
+        }
+        if(should_prefetch) frontier_spill->prefetch();
+        return true;
+    }
+    return false;
+}
+
+bool ARFrameworkBase::take_region_containing(
+        grid::point const& pt, 
+        grid::region& out)
+{
+    for(auto&& part : potentiallyUnsafeRegions)
+    {
+        std::lock_guard<std::mutex> lock(part->mutex);
+        auto found_region = part->regions.find(pt);
+        if(part->regions.end() != found_region)
+        {
+            out = std::move(part->regions.extract(found_region).value());
+            return true;
+        }
+    }
+    return false;
+}
+
+void ARFrameworkBase::set_frontier_memory_cap(
+        std::size_t bytes,
+        std::string const& spill_path)
+{
+    if(bytes == 0u)
+    {
+        frontier_cap = 0u;
+        frontier_spill.reset();
+        return;
+    }
+    auto bytes_per_region = 
+        sizeof(grid::region) + orig_region.size()*sizeof(grid::region_element);
+    frontier_cap = std::max<std::size_t>(1u, bytes / bytes_per_region);
+    frontier_spill.reset(new FrontierSpill(spill_path));
+    if(!frontier_spill->ok())
+    {
+        LOG(ERROR) << "Frontier memory cap disabled";
+        frontier_cap = 0u;
+        frontier_spill.reset();
+    }
+}
+
+void ARFrameworkBase::enforce_frontier_cap(frontier_partition& part)
+{
+    if(!frontier_spill) return;
+    auto cap = std::max<std::size_t>(1u, 
+            frontier_cap / potentiallyUnsafeRegions.size());
+    if(part.regions.size() <= cap) return;
+    // spill down to 3/4 of the cap so spilling happens in batches
+    auto keep = cap - cap / 4u;
+    std::vector<FrontierSpill::entry> batch;
+    batch.reserve(part.regions.size() - keep);
+    // the safe region store entries go to disk with the regions
+    std::lock_guard<std::mutex> lock(sr_mutex);
+    while(part.regions.size() > keep)
+    {
+        auto node = part.regions.extract(std::prev(part.regions.end()));
+        auto tag = safeRegions.detach(node.value());
+        batch.emplace_back(std::move(node.value()), tag);
+    }
+    frontier_spill->spill(std::move(batch));
+}
+
+void ARFrameworkBase::seed_adversarial_examples(
+        std::vector<grid::point> const& pts)
+{
+    for(auto&& pt : pts)
+    {
+        if(!grid::isInDomainRange(pt, orig_region)) continue;
+        adversarialExamples.insert(lattice_hash(pt), pt);
+        grid::region found_region;
+        if(take_region_containing(pt, found_region))
+            record_unsafe_region(found_region, pt);
+    }
+}
+
+void ARFrameworkBase::log_status()
+{
+    std::cout << "Unverified Regions: " << frontier_size();
+    if(potentiallyUnsafeRegions.size() > 1u)
+    {
+        std::cout << " (";
+        for(auto i = 0u; i < potentiallyUnsafeRegions.size(); ++i)
+        {
+            auto& part = *potentiallyUnsafeRegions[i];
+            std::size_t part_size;
+            {
+                std::lock_guard<std::mutex> lock(part.mutex);
+                part_size = part.regions.size();
+            }
+            std::cout << (i > 0u ? " " : "") << part_size;
+        }
+        std::cout << ")";
+    }
+    std::cout << "\n";
+    if(frontier_spill)
+    {
+        std::cout << "Spilled Regions: " << frontier_spill->size() << "\n";
+        if(frontier_spill->lost() > 0u)
+            std::cout << "Lost Regions: " << frontier_spill->lost() << "\n";
+    }
     std::cout << "Unsafe Regions: " 
         << unsafeRegionsWithAdvExamples.size() << "\n";
     std::cout << "Adversarial Examples: "
         << adversarialExamples.size() << "\n";
+    if(known_safe_points)
+        std::cout << "Known Safe Points: " << known_safe_points->size()
+            << " (" << skipped_safe_points << " queries skipped)\n";
+    std::lock_guard<std::mutex> lock(sr_mutex);
     std::cout << "Safe Regions: " << safeRegions.size() << "\n";
+    auto total_points = safeRegions.latticePoints(orig_region);
+    std::cout << "Safe Points: " << safeRegions.safePoints() 
+        << " / " << total_points << "\n";
+    std::cout << "Safe Coverage: " 
+        << (total_points > 0 ? safeRegions.safePoints() / total_points : 0)
+        << "\n";
 }
 
-void ARFramework::worker_routine()
+bool ARFrameworkBase::select_region(
+        std::size_t partition, 
+        grid::region& selected_region)
 {
-    auto counter = 0u;
-    while(keep_working)
+    if(!pop_region(partition, selected_region))
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        while(
-                (!potentiallyUnsafeRegions.empty() || 
-                 !unsafeRegionsWithAdvExamples.empty()) 
-                && keep_working)
+        if(has_spilled_regions())
         {
-            if(counter >= 100 && std::this_thread::get_id() == logging_thread_id)
+            auto reloaded = frontier_spill->reload();
             {
-                log_status();
-                counter = 0u;
+                std::lock_guard<std::mutex> lock(sr_mutex);
+                for(auto&& e : reloaded)
+                    safeRegions.attach(e.first, e.second);
             }
-            ++counter;
-            if(!potentiallyUnsafeRegions.empty())
-            {
-                grid::region selected_region;
-                bool got_valid_region = false;
-                {
-                    std::lock_guard<std::mutex> lock(pur_mutex);
-                    if(!potentiallyUnsafeRegions.empty())
-                    {
-                        // stack
-                        /*
-                        selected_region = potentiallyUnsafeRegions.back();
-                        potentiallyUnsafeRegions.pop_back();
-                        */
+            auto& part = *potentiallyUnsafeRegions[partition];
+            std::lock_guard<std::mutex> lock(part.mutex);
+            for(auto&& e : reloaded)
+                part.regions.insert(std::move(e.first));
+        }
+        return false;
+    }
+    grid::snapToDomainRangeInPlace(selected_region, domain_range);
+    unsigned long long numValidPoints = 
+        grid::AllValidDiscretizedPointsAbstraction
+        ::getNumberValidPoints(
+                selected_region,
+                init_point,
+                granularity);
+    if(numValidPoints == 0u)
+    {
+        // dropped without a verdict
+        std::lock_guard<std::mutex> lock(sr_mutex);
+        safeRegions.remove(selected_region);
+        return false;
+    }
+    return true;
+}
+
+void ARFrameworkBase::integrate_safe_region(grid::region const& r)
+{
+    std::lock_guard<std::mutex> lock(sr_mutex);
+    safeRegions.insert(r);
+}
 
-                        // queue
-                        /*
-                        selected_region = potentiallyUnsafeRegions.front();
-                        potentiallyUnsafeRegions.pop_front();
-                        */
+void ARFrameworkBase::record_unsafe_region(
+        grid::region const& r,
+        grid::point const& adv_exp)
+{
+    {
+        std::lock_guard<std::mutex> lock(sr_mutex);
+        safeRegions.remove(r);
+    }
+    unsafeRegionsWithAdvExamples.insert(lattice_hash(r), r, adv_exp);
+}
 
-                        selected_region = 
-                            *potentiallyUnsafeRegions.begin();
-                        potentiallyUnsafeRegions.erase(
-                            potentiallyUnsafeRegions.begin());
-                        got_valid_region = true;
-                    }
-                }
-                if(!got_valid_region)
-                {
-                    continue;
-                }
-                selected_region = grid::snapToDomainRange(
-                        selected_region,
-                        domain_range);
-                unsigned long long numValidPoints = 
-                    grid::AllValidDiscretizedPointsAbstraction
-                    ::getNumberValidPoints(
-                            selected_region,
-                            init_point,
-                            granularity);
-                if(numValidPoints <= 0u) 
-                {
-                    continue;
-                }
-                auto verification_result = 
-                    verification_engine(selected_region);
-                if(verification_result.first ==
-                        grid::VERIFICATION_RETURN::SAFE)
-                {
-                    std::lock_guard<std::mutex> lock(sr_mutex);
-                    safeRegions.push_back(selected_region);
-                }
-                else if(verification_result.first ==
-                        grid::VERIFICATION_RETURN::UNSAFE)
-                {
-                    auto subregions = 
-                        refinement_strategy(selected_region);
-                    auto subregion_with_adv_exp =
-                        subregions.find(verification_result.second);
-                    if(subregions.end() == subregion_with_adv_exp)
-                    {
-                        LOG(ERROR) 
-                            << "Adversarial example was found that did not belong to any subregions";
-                    }
-                    else
-                    {
-                        {
-                            std::lock_guard<std::mutex> lock(ur_mutex);
-                            unsafeRegionsWithAdvExamples.insert({
-                                    *subregion_with_adv_exp,
-                                    verification_result.second
-                                    });
-                        }
-                        subregions.erase(subregion_with_adv_exp);
-                    }
-                    {
-                        std::lock_guard<std::mutex> lock(pur_mutex);
-                        /*
-                        std::copy(subregions.begin(), subregions.end(),
-                                std::back_inserter(potentiallyUnsafeRegions)
-                                );
-                        */
-                        std::copy(subregions.begin(), subregions.end(),
-                                std::inserter(potentiallyUnsafeRegions,
-                                    potentiallyUnsafeRegions.begin())
-                                );
-                    }
-                }
-                else if(verification_result.first ==
-                        grid::VERIFICATION_RETURN::UNKNOWN)
-                {
-                    auto subregions = refinement_strategy(selected_region);
-                    std::map<grid::region, grid::point, grid::region_less_compare> unsafeRegionsTmp;
-                    std::set<grid::point> all_abstracted_points;
-                    auto first_iter = true;
-                    for(auto&& subregion : subregions)
-                    {
-                        auto abstracted_points = 
-                            abstraction_strategy(subregion);
-                        if(first_iter)
-                        {
-                            auto abstraction_orig = 
-                                abstraction_strategy(selected_region);
-                            std::copy(abstraction_orig.begin(),
-                                    abstraction_orig.end(),
-                                    std::back_inserter(
-                                        abstracted_points));
-                            first_iter = false;
-                        }
-                        for(auto&& pt : abstracted_points)
-                        {
-                            auto discrete_pt = grid::enforceSnapDiscreteGrid(
-                                    pt, init_point, granularity);
-                            auto snapped_pt = grid::snapToDomainRange(
-                                    discrete_pt,
-                                    domain_range);
-                            if(grid::isInDomainRange(
-                                        snapped_pt, orig_region))
-                            {
-                                all_abstracted_points.insert(
-                                        snapped_pt);
-                            }
-                        }
-                    }
+void ARFrameworkBase::integrate_unsafe_refinement(
+        std::set<grid::region, grid::region_less_compare>& subregions,
+        grid::point const& adv_exp,
+        std::size_t partition)
+{
+    auto subregion_with_adv_exp = subregions.find(adv_exp);
+    if(subregions.end() == subregion_with_adv_exp)
+    {
+        LOG(ERROR) 
+            << "Adversarial example was found that did not belong to any subregions";
+    }
+    else
+    {
+        record_unsafe_region(*subregion_with_adv_exp, adv_exp);
+        subregions.erase(subregion_with_adv_exp);
+    }
+    push_regions(partition, subregions);
+}
 
-                    std::set<grid::region, grid::region_less_compare> 
-                        deleted_regions;
-                    for(auto&& pt : all_abstracted_points)
-                    {
-                        if(safety_predicate(pt)) continue;
-                        {
-                            std::lock_guard<std::mutex> lock(ae_mutex);
-                            adversarialExamples.insert(pt);
-                        }
-                        auto found_subregion = subregions.find(pt);
-                        if(subregions.end() != found_subregion)
-                        {
-                            unsafeRegionsTmp.insert(
-                                    {*found_subregion, pt});
-                            deleted_regions.insert(*found_subregion);
-                            subregions.erase(found_subregion);
-                        }
-                        else
-                        {
-                            std::lock_guard<std::mutex> lock(pur_mutex);
-                            auto found_region = 
-                                potentiallyUnsafeRegions.find(pt);
-                            if(potentiallyUnsafeRegions.end() 
-                                    != found_region)
-                            {
-                                unsafeRegionsTmp.insert(
-                                        {*found_region, pt});
-                                potentiallyUnsafeRegions.erase(
-                                        found_region);
-                            }
-                        }
-                    }
-                    {
-                        std::lock_guard<std::mutex> lock(ur_mutex);
-                        std::copy(unsafeRegionsTmp.begin(),
-                                unsafeRegionsTmp.end(),
-                                std::inserter(
-                                    unsafeRegionsWithAdvExamples,
-                                    unsafeRegionsWithAdvExamples.begin())
-                                );
-                    }
-                    {
-                        std::lock_guard<std::mutex> lock(pur_mutex);
-                        std::copy(subregions.begin(),
-                                subregions.end(),
-                                std::inserter(potentiallyUnsafeRegions,
-                                    potentiallyUnsafeRegions.begin()));
-                    }
-                }
-            }
-            else
+void ARFrameworkBase::record_refinement(
+        grid::region const& parent,
+        std::set<grid::region, grid::region_less_compare> const& subregions)
+{
+    std::lock_guard<std::mutex> lock(sr_mutex);
+    safeRegions.addRefinement(parent, subregions);
+}
+
+void ARFrameworkBase::add_abstracted_points(
+        std::vector<grid::point>& abstracted_points,
+        std::vector<grid::point>& all_abstracted_points)
+{
+    for(auto&& pt : abstracted_points)
+    {
+        grid::enforceSnapDiscreteGridInPlace(
+                pt, init_point, granularity);
+        grid::snapToDomainRangeInPlace(pt, domain_range);
+        if(grid::isInDomainRange(pt, orig_region))
+        {
+            all_abstracted_points.push_back(std::move(pt));
+        }
+    }
+}
+
+void ARFrameworkBase::finish_abstraction(
+        std::vector<grid::point>& all_abstracted_points)
+{
+    std::sort(all_abstracted_points.begin(), all_abstracted_points.end());
+    all_abstracted_points.erase(
+            std::unique(
+                all_abstracted_points.begin(), 
+                all_abstracted_points.end()),
+            all_abstracted_points.end());
+    if(!known_safe_points) return;
+    auto known_safe = std::remove_if(
+            all_abstracted_points.begin(),
+            all_abstracted_points.end(),
+            [&](grid::point const& pt)
+            { return known_safe_points->mayContain(lattice_hash(pt)); });
+    skipped_safe_points += 
+        std::distance(known_safe, all_abstracted_points.end());
+    all_abstracted_points.erase(known_safe, all_abstracted_points.end());
+}
+
+void ARFrameworkBase::integrate_abstraction(
+        grid::region const& refined_region,
+        std::set<grid::region, grid::region_less_compare>& subregions,
+        std::vector<grid::point> const& points,
+        std::vector<bool> const& safe,
+        std::size_t partition)
+{
+    for(auto i = 0u; i < points.size(); ++i)
+    {
+        auto& pt = points[i];
+        if(i < safe.size() && safe[i])
+        {
+            if(known_safe_points)
+                known_safe_points->insert(lattice_hash(pt));
+            continue;
+        }
+        adversarialExamples.insert(lattice_hash(pt), pt);
+        // each region is removed from the subregions or the frontier
+        // before it is recorded, so a region is recorded once
+        auto found_subregion = subregions.find(pt);
+        if(subregions.end() != found_subregion)
+        {
+            record_unsafe_region(*found_subregion, pt);
+            subregions.erase(found_subregion);
+        }
+        else
+        {
+            grid::region found_region;
+            if(take_region_containing(pt, found_region))
             {
-                grid::region selected_region;
-                grid::point adv_exp;
-                {
-                    std::lock_guard<std::mutex> lock(ur_mutex);
-                    if(!unsafeRegionsWithAdvExamples.empty())
-                    {
-                        auto tmp_iter = 
-                            unsafeRegionsWithAdvExamples.begin();
-                        selected_region = tmp_iter->first;
-                        adv_exp = tmp_iter->second;
-                        unsafeRegionsWithAdvExamples.erase(tmp_iter);
-                    }
-                }
-                if(selected_region.empty() ||
-                        grid::AllValidDiscretizedPointsAbstraction
-                        ::getNumberValidPoints(
-                            selected_region, 
-                            init_point, 
-                            granularity) 
-                        <= 1ull)
-                {
-                    continue;
-                }
-                auto subregions = refinement_strategy(selected_region);
-                std::set<grid::region, grid::region_less_compare>
-                    nonempty_subregions;
-                for(auto&& subregion : subregions)
-                {
-                    if(grid::AllValidDiscretizedPointsAbstraction
-                            ::getNumberValidPoints(
-                                subregion,
-                                init_point,
-                                granularity) > 0ull)
-                    {
-                        nonempty_subregions.insert(subregion);
-                    }
-                }
-                if(nonempty_subregions.empty()) continue;
-                auto unsafeRegionIter = nonempty_subregions.find(adv_exp);
-                if(unsafeRegionIter != nonempty_subregions.end())
-                {
-                    {
-                        std::lock_guard<std::mutex> lock(ur_mutex);
-                        unsafeRegionsWithAdvExamples.insert(
-                                {*unsafeRegionIter, adv_exp});
-                    }
-                    nonempty_subregions.erase(unsafeRegionIter);
-                }
-                else
-                {
-                    LOG(ERROR) << "Adv exp was found not belonging to region after refined";
-                }
-                {
-                    std::lock_guard<std::mutex> lock(pur_mutex);
-                    /*
-                    std::copy(nonempty_subregions.begin(), 
-                            nonempty_subregions.end(), 
-                            std::back_inserter(potentiallyUnsafeRegions)
-                            );
-                    */
-                    std::copy(nonempty_subregions.begin(), 
-                            nonempty_subregions.end(), 
-                            std::inserter(potentiallyUnsafeRegions, 
-                                potentiallyUnsafeRegions.begin()));
-                }
+                record_unsafe_region(found_region, pt);
             }
         }
     }
+    if(abstraction_feedback)
+        abstraction_feedback(refined_region, points, safe, subregions);
+    push_regions(partition, subregions);
 }
 
-void ARFramework::run()
+bool ARFrameworkBase::take_unsafe_region(
+        grid::region& selected_region,
+        grid::point& adv_exp)
 {
-    if(!log_thread_set.test_and_set(std::memory_order_acquire))
-        logging_thread_id = std::this_thread::get_id();
-    worker_routine();
+    return unsafeRegionsWithAdvExamples.pop(selected_region, adv_exp) &&
+        !selected_region.empty() &&
+        grid::AllValidDiscretizedPointsAbstraction
+        ::getNumberValidPoints(
+                selected_region, 
+                init_point, 
+                granularity) 
+        > 1ull;
 }
+
+void ARFrameworkBase::integrate_unsafe_region_refinement(
+        std::set<grid::region, grid::region_less_compare>& 
+            nonempty_subregions,
+        grid::point const& adv_exp,
+        std::size_t partition)
+{
+    for(auto iter = nonempty_subregions.begin(); 
+            iter != nonempty_subregions.end();)
+    {
+        if(grid::AllValidDiscretizedPointsAbstraction
+                ::getNumberValidPoints(
+                    *iter,
+                    init_point,
+                    granularity) > 0ull)
+            ++iter;
+        else
+            iter = nonempty_subregions.erase(iter);
+    }
+    if(nonempty_subregions.empty()) return;
+    auto unsafeRegionIter = nonempty_subregions.find(adv_exp);
+    if(unsafeRegionIter != nonempty_subregions.end())
+    {
+        record_unsafe_region(*unsafeRegionIter, adv_exp);
+        nonempty_subregions.erase(unsafeRegionIter);
+    }
+    else
+    {
+        LOG(ERROR) << "Adv exp was found not belonging to region after refined";
+    }
+    push_regions(partition, nonempty_subregions);
+}
+
+bool ARFrameworkBase::has_work() const
+{
+    return !frontier_empty() || 
+        !unsafeRegionsWithAdvExamples.empty() ||
+        has_spilled_regions();
+}
+
+bool ARFrameworkBase::begin_work()
+{
+    std::unique_lock<std::mutex> lock(work_mutex);
+    while(keep_working && !search_exhausted)
+    {
+        if(has_work())
+        {
+            ++regions_in_flight;
+            return true;
+        }
+        if(regions_in_flight == 0u)
+        {
+            // nothing queued and nobody left to queue anything
+            search_exhausted = true;
+            work_available.notify_all();
+            break;
+        }
+        // the timeout only bounds how long join() goes unnoticed
+        work_available.wait_for(lock, std::chrono::milliseconds(100));
+    }
+    return false;
+}
+
+void ARFrameworkBase::end_work()
+{
+    std::lock_guard<std::mutex> lock(work_mutex);
+    --regions_in_flight;
+    work_available.notify_all();
+}
+
+void ARFrameworkBase::signal_work()
+{
+    // a waiter checks has_work() under work_mutex, taking it here
+    // orders the push before that check so the wakeup is not lost
+    { std::lock_guard<std::mutex> lock(work_mutex); }
+    work_available.notify_all();
+}
+
+void ARFrameworkBase::log_if_logging_thread(unsigned& counter)
+{
+    if(counter >= 100 && std::this_thread::get_id() == logging_thread_id)
+    {
+        log_status();
+        counter = 0u;
+    }
+    ++counter;
+}
+
+template class BasicARFramework<>;
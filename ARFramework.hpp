@@ -5,7 +5,12 @@
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
 #include <deque>
+#include <memory>
+#include <iterator>
+#include <chrono>
+#include <algorithm>
 
 #include "tensorflow/core/lib/io/path.h"
 #include "tensorflow/core/lib/strings/str_util.h"
@@ -17,51 +22,296 @@
 #include "tensorflow_graph_tools.hpp"
 #include "GraphManager.hpp"
 #include "grid_tools.hpp"
+#include "FrontierSpill.hpp"
+#include "thread_tools.hpp"
 
-class ARFramework
+// state shared by every strategy combination: the frontier of
+// unverified regions, the verified and unsafe results and the steps of
+// a worker iteration that do not call a strategy
+// BasicARFramework adds the strategies and the worker loops
+class ARFrameworkBase
 {
-private:
+public:
+    // the refined region, the classified points of it and of its
+    // subregions, whether each one is safe, and the subregions
+    // returned to the frontier
+    using abstraction_feedback_t = std::function<void(
+            grid::region const&,
+            std::vector<grid::point> const&,
+            std::vector<bool> const&,
+            std::set<grid::region, grid::region_less_compare> const&)>;
+protected:
     //std::deque<grid::region> potentiallyUnsafeRegions;
-    std::set<grid::region, grid::region_less_compare> 
+    // unverified regions are partitioned between groups of workers
+    // (e.g. one partition per NUMA node), a worker takes regions from
+    // its own partition first and steals from the others when it is empty
+    struct frontier_partition
+    {
+        std::set<grid::region, grid::region_less_compare> regions;
+        std::mutex mutex;
+    };
+    std::vector<std::unique_ptr<frontier_partition>> 
         potentiallyUnsafeRegions;
-    std::mutex pur_mutex;
-    std::vector<grid::region> safeRegions;
+    // regions held in memory before low priority regions
+    // (the end of a partition) are spilled to disk, split evenly
+    // between the partitions
+    std::size_t frontier_cap;
+    std::unique_ptr<FrontierSpill> frontier_spill;
+    grid::SafeRegionStore safeRegions;
     std::mutex sr_mutex;
-    std::map<grid::region, grid::point, grid::region_less_compare> 
+    // results are recorded without locks, keyed by the hash of their
+    // grid coordinates
+    grid::LatticeHash lattice_hash;
+    thread_tool::ConcurrentHashMap<grid::region, grid::point>
         unsafeRegionsWithAdvExamples;
-    std::mutex ur_mutex;
-    std::set<grid::point> adversarialExamples;
-    std::mutex ae_mutex;
-    bool keep_working;
+    thread_tool::ConcurrentHashSet<grid::point> adversarialExamples;
+    // lattice hashes of abstracted points classified safe, points that
+    // may be in it are dropped before they are classified again
+    std::unique_ptr<thread_tool::ConcurrentBloomFilter> known_safe_points;
+    std::atomic<std::size_t> skipped_safe_points;
+    // cleared by join(), only stored to so it can be called from a
+    // signal handler
+    std::atomic<bool> keep_working;
+    // quiescence tracking: regions taken from the frontier (or the
+    // unsafe regions) whose results have not been recorded yet. once
+    // nothing is queued and nothing is in flight no new work can appear
+    // and the run is over
+    std::mutex work_mutex;
+    std::condition_variable work_available;
+    std::size_t regions_in_flight;
+    std::atomic<bool> search_exhausted;
     GraphManager& gm;
     grid::region domain_range;
     grid::point init_point;
     grid::point granularity;
 
-    grid::region_abstraction_strategy_t abstraction_strategy;
-    grid::region_refinement_strategy_t refinement_strategy;
-    grid::verification_engine_type_t verification_engine;
-
-    std::function<bool(grid::point const&)> safety_predicate;
+    std::function<std::vector<bool>(std::vector<grid::point> const&)>
+        batch_safety_predicate;
+    abstraction_feedback_t abstraction_feedback;
     std::thread::id logging_thread_id;
     std::atomic_flag log_thread_set;
     grid::region orig_region;
 
-    void worker_routine();
+    // abstracted points of a region waiting for (or holding) their
+    // classification in the pipeline
+    struct pipeline_item
+    {
+        std::size_t partition;
+        grid::region region;
+        std::set<grid::region, grid::region_less_compare> subregions;
+        std::vector<grid::point> points;
+        std::vector<bool> safe;
+    };
+
+    bool has_work() const;
+    // blocks until there is work and counts the caller as in flight,
+    // false once the search is exhausted or join() was called
+    bool begin_work();
+    // the work taken by begin_work is recorded (or was dropped)
+    void end_work();
+    // wakes workers blocked in begin_work after regions were queued,
+    // must not be called with a partition mutex held
+    void signal_work();
+    bool running() const
+    { return keep_working.load() && !search_exhausted.load(); }
+    // ends the work of the iteration it was created in
+    struct work_guard
+    {
+        explicit work_guard(ARFrameworkBase& f) : framework(f) {}
+        ~work_guard() { framework.end_work(); }
+        ARFrameworkBase& framework;
+    };
+    void log_if_logging_thread(unsigned&);
+    // steps of a worker iteration, shared by the workers and the
+    // pipeline stages
+    // pops a region and snaps it, false if there is none with points
+    bool select_region(std::size_t /* partition */, grid::region&);
+    void integrate_safe_region(grid::region const&);
+    // records a region holding an adversarial example, it leaves the
+    // partitions the safe region store is waiting on
+    void record_unsafe_region(grid::region const&, grid::point const&);
+    // records the subregion holding the adversarial example found by
+    // the verification engine and returns the others to the frontier
+    void integrate_unsafe_refinement(
+            std::set<grid::region, grid::region_less_compare>&,
+            grid::point const& /* adversarial example */,
+            std::size_t /* partition */);
+    void record_refinement(
+            grid::region const& /* parent */,
+            std::set<grid::region, grid::region_less_compare> const&);
+    // snaps abstracted points to the grid and moves the ones inside the
+    // original region to the output
+    void add_abstracted_points(
+            std::vector<grid::point>& /* abstracted */,
+            std::vector<grid::point>& /* output */);
+    // sorts the output and removes duplicates
+    void finish_abstraction(std::vector<grid::point>&);
+    // records the unsafe points and returns the remaining subregions
+    // to the frontier
+    void integrate_abstraction(
+            grid::region const& /* refined region */,
+            std::set<grid::region, grid::region_less_compare>&,
+            std::vector<grid::point> const&,
+            std::vector<bool> const& /* safe */,
+            std::size_t /* partition */);
+    // pops a region known to contain an adversarial example, false if
+    // there is none that can be refined further
+    bool take_unsafe_region(grid::region&, grid::point&);
+    // drops the empty children, records the one holding the
+    // adversarial example and returns the others to the frontier
+    void integrate_unsafe_region_refinement(
+            std::set<grid::region, grid::region_less_compare>&,
+            grid::point const& /* adversarial example */,
+            std::size_t /* partition */);
     void log_status();
+    // must be called with the partition mutex held
+    void enforce_frontier_cap(frontier_partition&);
+    bool has_spilled_regions() const
+    { return frontier_spill && frontier_spill->size() > 0u; }
+    bool frontier_empty() const;
+    std::size_t frontier_size() const;
+    // takes the first region of the partition, or of any other
+    // partition if it is empty
+    bool pop_region(std::size_t /* partition */, grid::region&);
+    // removes the unverified region containing the point
+    bool take_region_containing(grid::point const&, grid::region&);
+    // splices the set nodes into the partition without copying or
+    // allocating, regions already in the partition stay in the argument
+    void push_regions(
+            std::size_t partition, 
+            std::set<grid::region, grid::region_less_compare>& regions)
+    {
+        {
+            auto& part = *potentiallyUnsafeRegions[partition];
+            std::lock_guard<std::mutex> lock(part.mutex);
+            /*
+            std::copy(regions.begin(), regions.end(),
+                    std::back_inserter(part.regions));
+            */
+            part.regions.merge(regions);
+            enforce_frontier_cap(part);
+        }
+        signal_work();
+    }
+
+    ARFrameworkBase(
+            GraphManager&,
+            grid::region,
+            grid::point,
+            grid::point,
+            grid::region);
+
+public:
+    // limit the memory used by unverified regions, 0 means unlimited
+    void set_frontier_memory_cap(
+            std::size_t /* bytes */,
+            std::string const& /* spill file path */);
+
+    // known adversarial examples (e.g. from previous runs), each one
+    // moves the unverified region containing it to the unsafe regions
+    // must be called before run()
+    void seed_adversarial_examples(std::vector<grid::point> const&);
+
+    // splits the unverified regions into the given number of partitions
+    // must be called before run()
+    void set_frontier_partitions(std::size_t);
 
+    // remembers the abstracted points found safe in a filter of the
+    // given size so other regions do not classify them again, a false
+    // positive only skips a sample point (0 disables the filter)
+    // must be called before run()
+    void set_safe_point_filter(std::size_t /* bytes */);
+    std::size_t frontier_partitions() const
+    { return potentiallyUnsafeRegions.size(); }
+
+    // thread counts of the pipeline stages
+    struct PipelineConfig
+    {
+        PipelineConfig()
+            : selection_threads(1u), preparation_threads(1u),
+            inference_threads(1u), integration_threads(1u),
+            batch_size(64u), queue_capacity(64u) {}
+        // pop and snap regions, refine regions with adversarial examples
+        unsigned selection_threads;
+        // verification engine, refinement and abstraction
+        unsigned preparation_threads;
+        // classification of the abstracted points of several regions
+        // at once
+        unsigned inference_threads;
+        // recording results and returning subregions to the frontier
+        unsigned integration_threads;
+        // points classified together when enough are prepared
+        std::size_t batch_size;
+        // capacity of each queue between stages
+        std::size_t queue_capacity;
+    };
+    // classifies a batch of points, used by the pipeline inference
+    // stage (defaults to the safety predicate applied to each point),
+    // a result of another size than the batch marks a failed run and
+    // the regions of the batch are returned to the frontier
+    void set_batch_safety_predicate(
+            std::function<std::vector<bool>(
+                std::vector<grid::point> const&)> const& p)
+    { batch_safety_predicate = p; }
+    // called with the classified abstracted points of a region and its
+    // subregions that go back to the frontier (e.g. to adapt the
+    // abstraction strategy), must be set before run()
+    void set_abstraction_feedback(abstraction_feedback_t const& f)
+    { abstraction_feedback = f; }
+    // safe to call from a signal handler, blocked workers notice within
+    // their wait timeout
+    void join() { keep_working.store(false); }
+    // unverified regions that were spilled to disk and could not be
+    // read back, the result of a run that lost regions is incomplete
+    std::size_t lost_regions() const
+    { return frontier_spill ? frontier_spill->lost() : 0u; }
+    // true if the run ended because every region was processed
+    bool exhausted() const 
+    { return search_exhausted.load() && lost_regions() == 0u; }
+
+    template <class CallbackFunc>
+    inline void report(CallbackFunc&& cb)
+    {
+        log_status();
+        std::set<grid::point> all_adv_examples;
+        unsafeRegionsWithAdvExamples.forEach(
+                [&](grid::region const&, grid::point const& adv_example)
+                {
+                    all_adv_examples.insert(adv_example);
+                });
+        adversarialExamples.forEach([&](grid::point const& adv_example)
+                {
+                    all_adv_examples.insert(adv_example);
+                });
+        for(auto&& adv_example : all_adv_examples)
+        {
+            cb(adv_example);
+        }
+    }
+};
+
+// the strategies are template parameters so the worker loop calls them
+// directly (and can inline them) when main instantiates the framework
+// with their concrete types, the defaults are the type erased strategies
+template <
+    class Abstraction = grid::region_abstraction_strategy_t,
+    class Refinement = grid::region_refinement_strategy_t,
+    class Engine = grid::verification_engine_type_t,
+    class Predicate = std::function<bool(grid::point const&)>>
+class BasicARFramework : public ARFrameworkBase
+{
 public:
-    ARFramework(
+    BasicARFramework(
             GraphManager&,
             grid::region,
             grid::point,
             grid::point,
             grid::region,
-            std::function<bool(grid::point const&)> const&,
-            grid::verification_engine_type_t const&,
-            grid::region_abstraction_strategy_t const& 
+            Predicate const&,
+            Engine const&,
+            Abstraction const& 
                 = grid::centralPointRegionAbstraction,
-            grid::region_refinement_strategy_t const&
+            Refinement const&
                 = grid::HierarchicalDimensionRefinementStrategy(
                         grid::randomDimSelection,
                         2u,
@@ -69,33 +319,349 @@ public:
                     )
             );
 
-    void set_verification_engine(
-            grid::verification_engine_type_t const& v)
+    void set_verification_engine(Engine const& v)
     { verification_engine = v; }
-    void set_refinement_strategy(
-            grid::region_refinement_strategy_t const& r)
+    void set_refinement_strategy(Refinement const& r)
     { refinement_strategy = r; }
-    void set_abstraction_strategy(
-            grid::region_abstraction_strategy_t const& a)
+    void set_abstraction_strategy(Abstraction const& a)
     { abstraction_strategy = a; }
 
-    void run();
-    void join() { keep_working = false; }
+    // the calling thread works mainly on the given frontier partition
+    void run(std::size_t /* partition */ = 0u);
+    // runs the stages in their own threads connected by bounded queues
+    // so classification overlaps with preparing the next regions,
+    // returns after join()
+    void run_pipeline(PipelineConfig const&);
 
-    template <class CallbackFunc>
-    inline void report(CallbackFunc&& cb)
+private:
+    Abstraction abstraction_strategy;
+    Refinement refinement_strategy;
+    Engine verification_engine;
+    Predicate safety_predicate;
+
+    void worker_routine(std::size_t /* partition */);
+    // handles SAFE and UNSAFE verification results
+    void integrate_verification(
+            grid::region const&,
+            grid::verification_engine_return_t const&,
+            std::size_t /* partition */);
+    std::set<grid::region, grid::region_less_compare> 
+        refine_region(grid::region const&);
+    // abstracted points of the region and its subregions, on the grid
+    // and inside the original region, sorted and unique (the vector is
+    // reused so its capacity is kept between iterations)
+    void abstract_region(
+            grid::region const&,
+            std::set<grid::region, grid::region_less_compare> const&,
+            std::vector<grid::point>&);
+    // refines a region known to contain an adversarial example
+    void refine_unsafe_region(std::size_t /* partition */);
+};
+
+using ARFramework = BasicARFramework<>;
+
+template <class Abstraction, class Refinement, class Engine, class Predicate>
+BasicARFramework<Abstraction, Refinement, Engine, Predicate>::BasicARFramework(
+        GraphManager& graph_manager,
+        grid::region dr,
+        grid::point ip,
+        grid::point gran,
+        grid::region orig_r,
+        Predicate const& safety_pred,
+        Engine const& verif_engine, 
+        Abstraction const& abs_strat, 
+        Refinement const& ref_strat)
+    : 
+        ARFrameworkBase(graph_manager, dr, ip, gran, orig_r),
+        abstraction_strategy(abs_strat),
+        refinement_strategy(ref_strat),
+        verification_engine(verif_engine),
+        safety_predicate(safety_pred)
+{
+    batch_safety_predicate = [this](std::vector<grid::point> const& pts)
     {
-        log_status();
-        for(auto&& adv_exp_pair : unsafeRegionsWithAdvExamples)
+        std::vector<bool> retVal(pts.size());
+        for(auto i = 0u; i < pts.size(); ++i)
+            retVal[i] = safety_predicate(pts[i]);
+        return retVal;
+    };
+}
+
+template <class Abstraction, class Refinement, class Engine, class Predicate>
+void BasicARFramework<Abstraction, Refinement, Engine, Predicate>::integrate_verification(
+        grid::region const& selected_region,
+        grid::verification_engine_return_t const& verification_result,
+        std::size_t partition)
+{
+    if(verification_result.first ==
+            grid::VERIFICATION_RETURN::SAFE)
+    {
+        integrate_safe_region(selected_region);
+    }
+    else if(verification_result.first ==
+            grid::VERIFICATION_RETURN::UNSAFE)
+    {
+        auto subregions = refine_region(selected_region);
+        integrate_unsafe_refinement(
+                subregions, verification_result.second, partition);
+    }
+}
+
+template <class Abstraction, class Refinement, class Engine, class Predicate>
+std::set<grid::region, grid::region_less_compare> 
+BasicARFramework<Abstraction, Refinement, Engine, Predicate>::refine_region(
+        grid::region const& selected_region)
+{
+    auto subregions = refinement_strategy(selected_region);
+    record_refinement(selected_region, subregions);
+    return subregions;
+}
+
+template <class Abstraction, class Refinement, class Engine, class Predicate>
+void BasicARFramework<Abstraction, Refinement, Engine, Predicate>::abstract_region(
+        grid::region const& selected_region,
+        std::set<grid::region, grid::region_less_compare> const& subregions,
+        std::vector<grid::point>& all_abstracted_points)
+{
+    all_abstracted_points.clear();
+    auto first_iter = true;
+    for(auto&& subregion : subregions)
+    {
+        auto abstracted_points = 
+            abstraction_strategy(subregion);
+        if(first_iter)
         {
-            adversarialExamples.insert(adv_exp_pair.second);
+            auto abstraction_orig = 
+                abstraction_strategy(selected_region);
+            std::move(abstraction_orig.begin(),
+                    abstraction_orig.end(),
+                    std::back_inserter(
+                        abstracted_points));
+            first_iter = false;
         }
-        for(auto&& adv_example : adversarialExamples)
+        add_abstracted_points(abstracted_points, all_abstracted_points);
+    }
+    finish_abstraction(all_abstracted_points);
+}
+
+template <class Abstraction, class Refinement, class Engine, class Predicate>
+void BasicARFramework<Abstraction, Refinement, Engine, Predicate>::refine_unsafe_region(std::size_t partition)
+{
+    grid::region selected_region;
+    grid::point adv_exp;
+    if(!take_unsafe_region(selected_region, adv_exp))
+        return;
+    auto nonempty_subregions = refine_region(selected_region);
+    integrate_unsafe_region_refinement(
+            nonempty_subregions, adv_exp, partition);
+}
+
+template <class Abstraction, class Refinement, class Engine, class Predicate>
+void BasicARFramework<Abstraction, Refinement, Engine, Predicate>::worker_routine(std::size_t partition)
+{
+    auto counter = 0u;
+    // kept across iterations so their capacity is reused
+    grid::region selected_region;
+    std::vector<grid::point> points;
+    std::vector<bool> safe;
+    while(begin_work())
+    {
+        work_guard guard(*this);
+        log_if_logging_thread(counter);
+        if(!frontier_empty() || has_spilled_regions())
         {
-            cb(adv_example);
+            if(!select_region(partition, selected_region))
+                continue;
+            auto verification_result = 
+                verification_engine(selected_region);
+            if(verification_result.first !=
+                    grid::VERIFICATION_RETURN::UNKNOWN)
+            {
+                integrate_verification(
+                        selected_region, 
+                        verification_result, 
+                        partition);
+                continue;
+            }
+            auto subregions = refine_region(selected_region);
+            abstract_region(selected_region, subregions, points);
+            safe.resize(points.size());
+            for(auto i = 0u; i < points.size(); ++i)
+                safe[i] = safety_predicate(points[i]);
+            integrate_abstraction(
+                    selected_region, subregions, points, safe, partition);
+        }
+        else
+        {
+            refine_unsafe_region(partition);
         }
     }
-};
+}
+
+template <class Abstraction, class Refinement, class Engine, class Predicate>
+void BasicARFramework<Abstraction, Refinement, Engine, Predicate>::run(std::size_t partition)
+{
+    if(!log_thread_set.test_and_set(std::memory_order_acquire))
+        logging_thread_id = std::this_thread::get_id();
+    worker_routine(partition % potentiallyUnsafeRegions.size());
+}
+
+template <class Abstraction, class Refinement, class Engine, class Predicate>
+void BasicARFramework<Abstraction, Refinement, Engine, Predicate>::run_pipeline(PipelineConfig const& config)
+{
+    const auto wait = std::chrono::milliseconds(10);
+    thread_tool::BoundedQueue<std::pair<std::size_t, grid::region>>
+        selected(config.queue_capacity);
+    thread_tool::BoundedQueue<pipeline_item> prepared(config.queue_capacity);
+    thread_tool::BoundedQueue<pipeline_item> inferred(config.queue_capacity);
+    auto partitions = potentiallyUnsafeRegions.size();
+    auto sessions = gm.numSessions();
+    std::vector<std::thread> stages;
+
+    for(auto i = 0u; i < std::max(1u, config.selection_threads); ++i)
+    {
+        stages.emplace_back([&, i]()
+                {
+                    if(!log_thread_set.test_and_set(std::memory_order_acquire))
+                        logging_thread_id = std::this_thread::get_id();
+                    auto partition = i % partitions;
+                    auto counter = 0u;
+                    // a selected region stays in flight until its
+                    // verification or abstraction is integrated
+                    while(begin_work())
+                    {
+                        log_if_logging_thread(counter);
+                        if(!frontier_empty() || has_spilled_regions())
+                        {
+                            std::pair<std::size_t, grid::region> job;
+                            job.first = partition;
+                            if(!select_region(partition, job.second))
+                            {
+                                end_work();
+                                continue;
+                            }
+                            while(running() && !selected.push(job, wait));
+                        }
+                        else
+                        {
+                            work_guard guard(*this);
+                            refine_unsafe_region(partition);
+                        }
+                    }
+                });
+    }
+
+    for(auto i = 0u; i < std::max(1u, config.preparation_threads); ++i)
+    {
+        stages.emplace_back([&, i]()
+                {
+                    GraphManager::setThreadSession(i % sessions);
+                    std::pair<std::size_t, grid::region> job;
+                    while(running())
+                    {
+                        if(!selected.pop(job, wait)) continue;
+                        auto verification_result = 
+                            verification_engine(job.second);
+                        if(verification_result.first !=
+                                grid::VERIFICATION_RETURN::UNKNOWN)
+                        {
+                            integrate_verification(
+                                    job.second, 
+                                    verification_result, 
+                                    job.first);
+                            end_work();
+                            continue;
+                        }
+                        pipeline_item item;
+                        item.partition = job.first;
+                        item.subregions = refine_region(job.second);
+                        abstract_region(
+                                job.second, item.subregions, item.points);
+                        item.region = std::move(job.second);
+                        while(running() && !prepared.push(item, wait));
+                    }
+                });
+    }
+
+    for(auto i = 0u; i < std::max(1u, config.inference_threads); ++i)
+    {
+        stages.emplace_back([&, i]()
+                {
+                    GraphManager::setThreadSession(i % sessions);
+                    std::vector<pipeline_item> items;
+                    std::vector<grid::point> batch;
+                    pipeline_item item;
+                    while(running())
+                    {
+                        if(!prepared.pop(item, wait)) continue;
+                        // fill the batch with what is already prepared
+                        items.clear();
+                        batch.clear();
+                        do
+                        {
+                            std::copy(item.points.begin(), item.points.end(),
+                                    std::back_inserter(batch));
+                            items.push_back(std::move(item));
+                        } while(batch.size() < config.batch_size &&
+                                prepared.pop(item, std::chrono::milliseconds(0)));
+                        auto safe = batch.empty() 
+                            ? std::vector<bool>() 
+                            : batch_safety_predicate(batch);
+                        if(safe.size() != batch.size())
+                        {
+                            // an error is not an unsafe verdict, the
+                            // subregions go back to the frontier
+                            // unclassified
+                            LOG(ERROR) << "Batch safety predicate returned "
+                                << safe.size() << " results for "
+                                << batch.size() << " points, returning "
+                                << items.size() << " refined regions "
+                                << "to the frontier";
+                            for(auto&& failed : items)
+                            {
+                                push_regions(
+                                        failed.partition, failed.subregions);
+                                end_work();
+                            }
+                            continue;
+                        }
+                        auto offset = 0u;
+                        for(auto&& done : items)
+                        {
+                            done.safe.assign(
+                                    safe.begin() + offset, 
+                                    safe.begin() + offset + done.points.size());
+                            offset += done.points.size();
+                            while(running() && !inferred.push(done, wait));
+                        }
+                    }
+                });
+    }
+
+    for(auto i = 0u; i < std::max(1u, config.integration_threads); ++i)
+    {
+        stages.emplace_back([&]()
+                {
+                    pipeline_item item;
+                    while(running())
+                    {
+                        if(!inferred.pop(item, wait)) continue;
+                        integrate_abstraction(
+                                item.region,
+                                item.subregions, 
+                                item.points, 
+                                item.safe, 
+                                item.partition);
+                        end_work();
+                    }
+                });
+    }
+
+    for(auto&& t : stages)
+        t.join();
+}
+
+extern template class BasicARFramework<>;
 
 #endif
 
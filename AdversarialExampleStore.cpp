@@ -0,0 +1,157 @@
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/platform/logging.h"
+
+#include "AdversarialExampleStore.hpp"
+
+namespace
+{
+    const char store_magic[8] = {'A','R','F','A','D','V','0','2'};
+    const std::uint64_t fnv_offset = 14695981039346656037ull;
+    const std::uint64_t fnv_prime = 1099511628211ull;
+
+    std::uint64_t fnv1a(
+            std::uint64_t hash, char const* data, std::size_t size)
+    {
+        for(auto i = 0u; i < size; ++i)
+        {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= fnv_prime;
+        }
+        return hash;
+    }
+}
+
+AdversarialExampleStore::AdversarialExampleStore(
+        std::string const& dir,
+        std::uint64_t model_hash,
+        std::uint64_t input_hash,
+        std::size_t input_dims)
+    : file_path(),
+    dims(input_dims)
+{
+    std::stringstream file_name;
+    file_name << std::hex << std::setfill('0') 
+        << std::setw(16) << model_hash << "_" 
+        << std::setw(16) << input_hash << ".adv";
+    file_path = tensorflow::io::JoinPath(dir, file_name.str());
+}
+
+std::uint64_t AdversarialExampleStore::hashFile(std::string const& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if(!in)
+    {
+        LOG(ERROR) << "Could not hash file: " << path;
+        return 0u;
+    }
+    auto hash = fnv_offset;
+    std::vector<char> buffer(1 << 16);
+    while(in)
+    {
+        in.read(buffer.data(), buffer.size());
+        hash = fnv1a(hash, buffer.data(), in.gcount());
+    }
+    return hash;
+}
+
+std::uint64_t AdversarialExampleStore::hashPoint(grid::point const& p)
+{
+    // hash the values the model sees so the hash does not depend
+    // on how the point was parsed
+    auto hash = fnv_offset;
+    for(auto&& elem : p)
+    {
+        auto value = static_cast<float>(elem);
+        char bytes[sizeof(float)];
+        std::memcpy(bytes, &value, sizeof(float));
+        hash = fnv1a(hash, bytes, sizeof(float));
+    }
+    return hash;
+}
+
+std::vector<grid::point> AdversarialExampleStore::load() const
+{
+    std::ifstream in(file_path, std::ios::binary);
+    if(!in) return {};
+    char magic[sizeof(store_magic)];
+    std::uint64_t stored_dims = 0u;
+    std::uint64_t count = 0u;
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char*>(&stored_dims), sizeof(stored_dims));
+    in.read(reinterpret_cast<char*>(&count), sizeof(count));
+    if(!in || std::memcmp(magic, store_magic, sizeof(magic)) != 0)
+    {
+        LOG(ERROR) << "Invalid adversarial example store: " << file_path;
+        return {};
+    }
+    if(stored_dims != dims)
+    {
+        LOG(ERROR) << "Adversarial example store has " << stored_dims
+            << " dimensions, expected " << dims << ": " << file_path;
+        return {};
+    }
+    std::vector<grid::point> retVal;
+    std::vector<double> values(dims);
+    for(auto i = 0ull; i < count; ++i)
+    {
+        in.read(reinterpret_cast<char*>(values.data()), 
+                dims*sizeof(double));
+        if(!in)
+        {
+            LOG(ERROR) << "Truncated adversarial example store: " 
+                << file_path;
+            break;
+        }
+        retVal.emplace_back(values.begin(), values.end());
+    }
+    return retVal;
+}
+
+bool AdversarialExampleStore::save(std::vector<grid::point> const& pts) const
+{
+    auto existing = load();
+    std::set<grid::point> merged(existing.begin(), existing.end());
+    merged.insert(pts.begin(), pts.end());
+    if(merged.empty()) return true;
+    std::uint64_t count = 0u;
+    for(auto&& p : merged)
+        if(p.size() == dims) ++count;
+
+    // write to a temporary file first so an interrupted run
+    // never leaves a truncated store behind
+    auto tmp_path = file_path + ".tmp";
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        out.write(store_magic, sizeof(store_magic));
+        out.write(reinterpret_cast<char const*>(&dims), sizeof(dims));
+        out.write(reinterpret_cast<char const*>(&count), sizeof(count));
+        std::vector<double> values(dims);
+        for(auto&& p : merged)
+        {
+            if(p.size() != dims) continue;
+            std::copy(p.begin(), p.end(), values.begin());
+            out.write(reinterpret_cast<char const*>(values.data()), 
+                    dims*sizeof(double));
+        }
+        if(!out)
+        {
+            LOG(ERROR) << "Could not write adversarial example store: " 
+                << tmp_path;
+            return false;
+        }
+    }
+    if(std::rename(tmp_path.c_str(), file_path.c_str()) != 0)
+    {
+        LOG(ERROR) << "Could not replace adversarial example store: " 
+            << file_path;
+        return false;
+    }
+    return true;
+}
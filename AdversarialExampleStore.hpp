@@ -0,0 +1,39 @@
+#ifndef ADVERSARIAL_EXAMPLE_STORE_HPP_INCLUDED
+#define ADVERSARIAL_EXAMPLE_STORE_HPP_INCLUDED
+
+#include <string>
+#include <vector>
+#include <set>
+#include <cstdint>
+
+#include "grid_tools.hpp"
+
+// on-disk store of adversarial examples found by previous runs
+// examples are kept in one file per (model, input) pair so re-verifying
+// the same input with another radius or strategy can start from the
+// counterexamples that are already known
+// values are stored as IEEE doubles so the file does not depend on the
+// platform's long double layout
+class AdversarialExampleStore
+{
+public:
+    AdversarialExampleStore(
+            std::string const& /* store directory */,
+            std::uint64_t /* model hash */,
+            std::uint64_t /* input hash */,
+            std::size_t /* input dimensions */);
+
+    // 64 bit FNV-1a hashes
+    static std::uint64_t hashFile(std::string const&);
+    static std::uint64_t hashPoint(grid::point const&);
+
+    std::vector<grid::point> load() const;
+    // merges the examples with the ones already stored
+    bool save(std::vector<grid::point> const&) const;
+    std::string const& path() const { return file_path; }
+private:
+    std::string file_path;
+    std::uint64_t dims;
+};
+
+#endif
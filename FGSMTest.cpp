@@ -1,5 +1,14 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <set>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <iomanip>
 
 #include "tensorflow_graph_tools.hpp"
 #include "GraphManager.hpp"
@@ -13,6 +22,132 @@
 #include "tensorflow/core/util/command_line_flags.h"
 #include "tensorflow/core/framework/tensor_util.h"
 
+// one row of the benchmark output
+struct FGSMTestResult
+{
+    std::string initial_activation;
+    std::string dim_selection;
+    unsigned num_abstractions;
+    double fgsm_balance_factor;
+    unsigned orig_class;
+    std::size_t unique_abstractions;
+    std::size_t adversarial_examples;
+    // batches the model could not classify, the counts and rates
+    // only cover the classified points if any failed
+    std::size_t failed_batches;
+    double success_rate;
+    double generation_seconds;
+    double evaluation_seconds;
+    double points_per_second;
+    double latency_p50_ms;
+    double latency_p90_ms;
+    double latency_p99_ms;
+};
+
+std::vector<std::string> splitList(std::string const& s)
+{
+    std::vector<std::string> retVal;
+    std::stringstream ss(s);
+    std::string item;
+    while(std::getline(ss, item, ','))
+    {
+        if(!item.empty()) retVal.push_back(item);
+    }
+    return retVal;
+}
+
+double percentile(std::vector<double> sorted, double pct)
+{
+    if(sorted.empty()) return 0.0;
+    std::sort(sorted.begin(), sorted.end());
+    auto index = static_cast<std::size_t>(
+            pct / 100.0 * static_cast<double>(sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+// string contents of a JSON string literal
+std::string escapeJSON(std::string const& s)
+{
+    std::ostringstream os;
+    for(auto&& c : s)
+    {
+        switch(c)
+        {
+            case '"': os << "\\\""; break;
+            case '\\': os << "\\\\"; break;
+            case '\n': os << "\\n"; break;
+            case '\r': os << "\\r"; break;
+            case '\t': os << "\\t"; break;
+            default:
+                if(static_cast<unsigned char>(c) < 0x20)
+                    os << "\\u" << std::hex << std::setw(4)
+                        << std::setfill('0') << (int)c << std::dec;
+                else
+                    os << c;
+        }
+    }
+    return os.str();
+}
+
+void writeCSV(std::ostream& os, std::vector<FGSMTestResult> const& results)
+{
+    os << "initial_activation,dim_selection,num_abstractions,"
+        << "fgsm_balance_factor,orig_class,unique_abstractions,"
+        << "adversarial_examples,failed,failed_batches,"
+        << "success_rate,generation_seconds,"
+        << "evaluation_seconds,points_per_second,latency_p50_ms,"
+        << "latency_p90_ms,latency_p99_ms\n";
+    for(auto&& r : results)
+    {
+        os << r.initial_activation << ","
+            << r.dim_selection << ","
+            << r.num_abstractions << ","
+            << r.fgsm_balance_factor << ","
+            << r.orig_class << ","
+            << r.unique_abstractions << ","
+            << r.adversarial_examples << ","
+            << (r.failed_batches > 0 ? "true" : "false") << ","
+            << r.failed_batches << ","
+            << r.success_rate << ","
+            << r.generation_seconds << ","
+            << r.evaluation_seconds << ","
+            << r.points_per_second << ","
+            << r.latency_p50_ms << ","
+            << r.latency_p90_ms << ","
+            << r.latency_p99_ms << "\n";
+    }
+}
+
+void writeJSON(std::ostream& os, std::vector<FGSMTestResult> const& results)
+{
+    os << "[\n";
+    for(auto i = 0u; i < results.size(); ++i)
+    {
+        auto&& r = results[i];
+        os << "  {\"initial_activation\": \""
+            << escapeJSON(r.initial_activation) << "\", "
+            << "\"dim_selection\": \""
+            << escapeJSON(r.dim_selection) << "\", "
+            << "\"num_abstractions\": " << r.num_abstractions << ", "
+            << "\"fgsm_balance_factor\": " << r.fgsm_balance_factor << ", "
+            << "\"orig_class\": " << r.orig_class << ", "
+            << "\"unique_abstractions\": " << r.unique_abstractions << ", "
+            << "\"adversarial_examples\": " << r.adversarial_examples << ", "
+            << "\"failed\": " << (r.failed_batches > 0 ? "true" : "false")
+            << ", "
+            << "\"failed_batches\": " << r.failed_batches << ", "
+            << "\"success_rate\": " << r.success_rate << ", "
+            << "\"generation_seconds\": " << r.generation_seconds << ", "
+            << "\"evaluation_seconds\": " << r.evaluation_seconds << ", "
+            << "\"points_per_second\": " << r.points_per_second << ", "
+            << "\"latency_p50_ms\": " << r.latency_p50_ms << ", "
+            << "\"latency_p90_ms\": " << r.latency_p90_ms << ", "
+            << "\"latency_p99_ms\": " << r.latency_p99_ms << "}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    os << "]\n";
+}
+
 int main(int argc, char* argv[])
 {
     std::string graph = "graph.pb";
@@ -32,6 +167,9 @@ int main(int argc, char* argv[])
     std::string domain_range_max_str = "1.0";
     std::string modified_fgsm_dim_selection = "largest_first";
     std::string num_abstractions_str = "1000";
+    std::string batch_size_str = "64";
+    std::string num_threads_str = "4";
+    std::string output_file = "";
 
     std::vector<tensorflow::Flag> flag_list = {
         tensorflow::Flag("graph", &graph, "path to protobuf graph to be executed"),
@@ -40,22 +178,25 @@ int main(int argc, char* argv[])
         tensorflow::Flag("gradient_layer", &gradient_layer, "name of the gradient layer (optional - used for FGSM)"),
         tensorflow::Flag("granularity", &granularity_str, "use this option is all dimensions share a discrete range"),
         tensorflow::Flag("verification_radius", &verification_radius, "'radius' of hyperrectangle within which safety is to be verified"),
-        tensorflow::Flag("initial_activation", &initial_activation, "initial tested activation"),
+        tensorflow::Flag("initial_activation", &initial_activation, "initial tested activation (comma separated list to sweep over inputs)"),
         tensorflow::Flag("root_dir", &root_dir, "root_dir"),
         tensorflow::Flag("class_averages", &class_averages, "the class averages of the training data (optional - used for FGSM)"),
-        tensorflow::Flag("label_proto", &label_proto, "protocol buffer of label image corresponding with initial activation"),
+        tensorflow::Flag("label_proto", &label_proto, "protocol buffer of label image corresponding with initial activation (comma separated list, one per initial activation)"),
         tensorflow::Flag("label_layer", &label_layer, "name of label layer"),
         tensorflow::Flag("enforce_domain", &enforce_domain_str, "enforce the domain range (true, false)"),
         tensorflow::Flag("domain_range_min", &domain_range_min_str, "lower bound on domain range (default = 0.0)"),
         tensorflow::Flag("domain_range_max", &domain_range_max_str, "upper bound on domain range (default = 1.0)"),
-        tensorflow::Flag("modified_fgsm_dim_selection", &modified_fgsm_dim_selection, "dimension selection strategy to use (gradient_based, intellifeature, largest_first - default)"),
-        tensorflow::Flag("num_abstractions", &num_abstractions_str, "number of abstractions to generate (adversarial examples)"),
-        tensorflow::Flag("fgsm_balance_factor", &fgsm_balance_factor_opt, "Balance factor for modified FGSM algorithm (ratio dimensions fgsm/random)")
+        tensorflow::Flag("modified_fgsm_dim_selection", &modified_fgsm_dim_selection, "dimension selection strategy to use (gradient_based, intellifeature, random, largest_first - default), comma separated list to sweep"),
+        tensorflow::Flag("num_abstractions", &num_abstractions_str, "number of abstractions to generate (adversarial examples), comma separated list to sweep"),
+        tensorflow::Flag("fgsm_balance_factor", &fgsm_balance_factor_opt, "Balance factor for modified FGSM algorithm (ratio dimensions fgsm/random), comma separated list to sweep"),
+        tensorflow::Flag("batch_size", &batch_size_str, "number of points classified per model run"),
+        tensorflow::Flag("num_threads", &num_threads_str, "number of threads issuing model runs"),
+        tensorflow::Flag("output_file", &output_file, "file to write results to (.json for JSON, CSV otherwise)")
     };
 
     std::string usage = tensorflow::Flags::Usage(argv[0], flag_list);
     const bool parse_result = tensorflow::Flags::Parse(&argc, argv, flag_list);
-    if (!parse_result) 
+    if (!parse_result)
     {
         LOG(ERROR) << usage;
         return -1;
@@ -85,75 +226,20 @@ int main(int argc, char* argv[])
     }
     auto granularity_val = std::atof(granularity_str.c_str());
     auto radius = std::atof(verification_radius.c_str());
-    auto fgsm_balance_factor = std::atof(fgsm_balance_factor_opt.c_str());
     auto domain_range_min = std::atof(domain_range_min_str.c_str());
     auto domain_range_max = std::atof(domain_range_max_str.c_str());
-    auto num_abstractions = std::atoi(num_abstractions_str.c_str());
-    auto graph_path = tensorflow::io::JoinPath(root_dir, graph);
-    GraphManager gm(graph_path);
-    if(!gm.ok())
-    {
-        LOG(ERROR) << "Could not initialize graph manager at: "
-            << graph_path;
-        return -1;
-    }
-
-    auto initial_activation_path = 
-        tensorflow::io::JoinPath(root_dir, initial_activation);
-    auto init_act_tensor_status_pair = 
-        GraphManager::ReadBinaryTensorProto(initial_activation_path);
-    if(!init_act_tensor_status_pair.first)
-    {
-        LOG(ERROR) 
-            << "Could not read initial activation protobuf: " 
-            << initial_activation_path;
-        return -1;
-    }
-
-    auto init_act_tensor = init_act_tensor_status_pair.second;
-    auto init_act_point = graph_tool::tensorToPoint(
-            init_act_tensor);
-
-    std::vector<tensorflow::int64> batch_input_shape(init_act_tensor.dims());
-
-    for(auto i = 0u; i < batch_input_shape.size(); ++i)
-        batch_input_shape[i] = init_act_tensor.dim_size(i);
-
-    auto logits_init_activation = 
-        gm.feedThroughModel(
-                std::bind(graph_tool::makeFeedDict,
-                    input_layer,
-                    init_act_point,
-                    batch_input_shape),
-                &graph_tool::parseGraphOutToVector,
-                {output_layer});
-    if(!gm.ok())
-    {
-        LOG(ERROR) << "Error while feeding through model";
-        exit(1);
-    }
-
-    unsigned orig_class = 
-        graph_tool::getClassOfClassificationVector(logits_init_activation);
-
-    std::cout << "Original class: " << orig_class << "\n";
-
-    std::vector<long double> granularity(init_act_point.size(), 
-            granularity_val);
-
-    std::cout << "Granularity: " << granularity_val << "\n";
-    std::cout << "Input shape: (";
-    for(auto&& elem : batch_input_shape)
-        std::cout << elem << " ";
-    std::cout << ")\n";
-    std::cout << "Verification radius: " << radius << "\n";
-    std::cout << "Root Directory: " << root_dir << "\n";
-
-    grid::dimension_selection_strategy_t dimension_selection_strategy = 
-        grid::largestDimFirst;
-    if(modified_fgsm_dim_selection == "largest_first")
-        std::cout << "Using largest first dimension selection strategy\n";
-
+    auto batch_size = std::max(1, std::atoi(batch_size_str.c_str()));
+    auto num_threads = std::max(1, std::atoi(num_threads_str.c_str()));
+
+    auto initial_activations = splitList(initial_activation);
+    auto label_protos = splitList(label_proto);
+    auto dim_selections = splitList(modified_fgsm_dim_selection);
+    std::vector<unsigned> num_abstractions_list;
+    for(auto&& n : splitList(num_abstractions_str))
+        num_abstractions_list.push_back(std::atoi(n.c_str()));
+    std::vector<double> fgsm_balance_factors;
+    for(auto&& f : splitList(fgsm_balance_factor_opt))
+        fgsm_balance_factors.push_back(std::atof(f.c_str()));
 
     auto hasAveragesProto = class_averages != "class_averages";
     auto hasLabelProto = label_proto != "label_proto";
@@ -164,146 +250,347 @@ int main(int argc, char* argv[])
         LOG(ERROR) << "Need gradient layer, label proto, and label layer";
         return -1;
     }
+    if(label_protos.size() != initial_activations.size())
+    {
+        LOG(ERROR) << "Need one label proto per initial activation";
+        return -1;
+    }
 
-    if(modified_fgsm_dim_selection == "random")
+    auto graph_path = tensorflow::io::JoinPath(root_dir, graph);
+    GraphManager gm(graph_path);
+    if(!gm.ok())
     {
-        std::cout << "Using random dimension selection heuristic\n";
-        dimension_selection_strategy = 
-            grid::randomDimSelection;
+        LOG(ERROR) << "Could not initialize graph manager at: "
+            << graph_path;
+        return -1;
     }
 
-    if(hasAveragesProto && modified_fgsm_dim_selection == "intellifeature")
+    std::vector<grid::point> averages;
+    if(hasAveragesProto)
     {
-        std::cout << "Using Intellifeature\n";
-        std::string class_averages_path = 
+        std::string class_averages_path =
             tensorflow::io::JoinPath(root_dir, class_averages);
-        auto class_averages_proto_pair = 
+        auto class_averages_proto_pair =
             GraphManager::ReadBinaryTensorProto(class_averages_path);
         if(!class_averages_proto_pair.first)
         {
             LOG(ERROR) << "Unable to read class averages proto";
             return -1;
         }
-        auto averages = graph_tool::tensorToPoints(
+        averages = graph_tool::tensorToPoints(
                 class_averages_proto_pair.second);
-        dimension_selection_strategy = 
-            grid::IntellifeatureDimSelection(
-                averages,
-                &grid::l2norm,
-                orig_class);
     }
 
-    auto label_tensor_path = 
-        tensorflow::io::JoinPath(root_dir, label_proto);
-    auto label_tensor_pair =
-        GraphManager::ReadBinaryTensorProto(label_tensor_path);
-    if(!label_tensor_pair.first)
+    std::cout << "Granularity: " << granularity_val << "\n";
+    std::cout << "Verification radius: " << radius << "\n";
+    std::cout << "Root Directory: " << root_dir << "\n";
+    std::cout << "Batch size: " << batch_size
+        << " Threads: " << num_threads << "\n";
+
+    std::vector<FGSMTestResult> results;
+    for(auto input_index = 0u;
+            input_index < initial_activations.size();
+            ++input_index)
     {
-        LOG(ERROR) << "Unable to read label proto";
-        exit(1);
-    }
-    auto label_tensor = label_tensor_pair.second;
+        auto initial_activation_path =
+            tensorflow::io::JoinPath(root_dir,
+                    initial_activations[input_index]);
+        auto init_act_tensor_status_pair =
+            GraphManager::ReadBinaryTensorProto(initial_activation_path);
+        if(!init_act_tensor_status_pair.first)
+        {
+            LOG(ERROR)
+                << "Could not read initial activation protobuf: "
+                << initial_activation_path;
+            return -1;
+        }
 
-    std::cout << "FGSM Balance Factor: " << fgsm_balance_factor
-        << "\n";
-    auto grad_func = 
-            [&,label_tensor_copy = label_tensor]
-            (grid::point const& p) -> grid::point
-            {
-                auto createGradientFeedDict = 
-                [&]() -> graph_tool::feed_dict_type_t
+        auto init_act_tensor = init_act_tensor_status_pair.second;
+        auto init_act_point = graph_tool::tensorToPoint(
+                init_act_tensor);
+
+        std::vector<tensorflow::int64> batch_input_shape(
+                init_act_tensor.dims());
+        for(auto i = 0u; i < batch_input_shape.size(); ++i)
+            batch_input_shape[i] = init_act_tensor.dim_size(i);
+        // shape of a single input without the batch dimension
+        std::vector<tensorflow::int64> input_shape(
+                batch_input_shape.begin() + 1, batch_input_shape.end());
+
+        auto logits_init_activation =
+            gm.feedThroughModel(
+                    std::bind(graph_tool::makeFeedDict,
+                        input_layer,
+                        init_act_point,
+                        batch_input_shape),
+                    &graph_tool::parseGraphOutToVector,
+                    {output_layer});
+        if(!gm.ok())
+        {
+            LOG(ERROR) << "Error while feeding through model";
+            exit(1);
+        }
+
+        unsigned orig_class =
+            graph_tool::getClassOfClassificationVector(
+                    logits_init_activation);
+
+        std::cout << "Initial activation: "
+            << initial_activations[input_index] << "\n";
+        std::cout << "Original class: " << orig_class << "\n";
+        std::cout << "Input shape: (";
+        for(auto&& elem : batch_input_shape)
+            std::cout << elem << " ";
+        std::cout << ")\n";
+
+        std::vector<long double> granularity(init_act_point.size(),
+                granularity_val);
+
+        auto label_tensor_path =
+            tensorflow::io::JoinPath(root_dir, label_protos[input_index]);
+        auto label_tensor_pair =
+            GraphManager::ReadBinaryTensorProto(label_tensor_path);
+        if(!label_tensor_pair.first)
+        {
+            LOG(ERROR) << "Unable to read label proto";
+            exit(1);
+        }
+        auto label_tensor = label_tensor_pair.second;
+
+        auto grad_func =
+                [&,label_tensor_copy = label_tensor]
+                (grid::point const& p) -> grid::point
                 {
-                    auto p_tensor = 
-                    graph_tool::pointToTensor(p, batch_input_shape);
-                    return {{input_layer, p_tensor},
-                        {label_layer, label_tensor_copy}};
+                    auto createGradientFeedDict =
+                    [&]() -> graph_tool::feed_dict_type_t
+                    {
+                        auto p_tensor =
+                        graph_tool::pointToTensor(p, batch_input_shape);
+                        return {{input_layer, p_tensor},
+                            {label_layer, label_tensor_copy}};
+                    };
+                    auto retVal = gm.feedThroughModel(
+                            createGradientFeedDict,
+                            &graph_tool::parseGraphOutToVector,
+                            {gradient_layer});
+                    if(!gm.ok())
+                        LOG(ERROR) << "Error with model";
+                    return retVal;
                 };
-                auto retVal = gm.feedThroughModel(
-                        createGradientFeedDict,
-                        &graph_tool::parseGraphOutToVector,
-                        {gradient_layer});
-                if(!gm.ok())
-                    LOG(ERROR) << "Error with model";
-                return retVal;
-            };
-
-    if(modified_fgsm_dim_selection == "gradient_based")
-    {
-        std::cout << "Using gradient_based dimension selection\n";
-        dimension_selection_strategy = 
-            grid::GradientBasedDimensionSelection(grad_func);
-    }
 
-    grid::region_abstraction_strategy_t abstraction_strategy = 
-        grid::ModifiedFGSMWithFallbackRegionAbstraction(
-                num_abstractions,
-                grad_func,
-                dimension_selection_strategy,
-                grid::RandomPointRegionAbstraction(1u),
-                granularity,
-                fgsm_balance_factor);
-
-    grid::region orig_region(init_act_point.size());
-    for(auto i = 0u; i < orig_region.size(); ++i)
-    {
-        orig_region[i].first = 
-            init_act_point[i] - radius;
-        orig_region[i].second = 
-            init_act_point[i] + radius;
-    }
+        grid::region orig_region(init_act_point.size());
+        for(auto i = 0u; i < orig_region.size(); ++i)
+        {
+            orig_region[i].first =
+                init_act_point[i] - radius;
+            orig_region[i].second =
+                init_act_point[i] + radius;
+        }
 
-    grid::region domain_range(orig_region.size());
-    for(auto i = 0u; i < domain_range.size(); ++i)
-    {
-        domain_range[i].first = domain_range_min;
-        domain_range[i].second = domain_range_max;
-    }
+        grid::region domain_range(orig_region.size());
+        for(auto i = 0u; i < domain_range.size(); ++i)
+        {
+            domain_range[i].first = domain_range_min;
+            domain_range[i].second = domain_range_max;
+        }
 
-    orig_region = grid::snapToDomainRange(orig_region, domain_range);
+        orig_region = grid::snapToDomainRange(orig_region, domain_range);
 
-    auto abstractions = abstraction_strategy(orig_region);
-    std::set<grid::point> unique_abstractions;
-    for(auto&& pt : abstractions)
-    {
-        auto pt_to_add = grid::enforceSnapDiscreteGrid(
-            pt, init_act_point, granularity);
-        if(enforce_domain)
+        for(auto&& dim_selection : dim_selections)
         {
-            pt_to_add = grid::snapToDomainRange(
-                    pt_to_add, domain_range);
+            grid::dimension_selection_strategy_t
+                dimension_selection_strategy = grid::largestDimFirst;
+            if(dim_selection == "random")
+            {
+                dimension_selection_strategy = grid::randomDimSelection;
+            }
+            else if(dim_selection == "intellifeature")
+            {
+                if(!hasAveragesProto)
+                {
+                    LOG(ERROR) << "intellifeature requires class averages";
+                    return -1;
+                }
+                dimension_selection_strategy =
+                    grid::IntellifeatureDimSelection(
+                        averages,
+                        &grid::l2norm,
+                        orig_class);
+            }
+            else if(dim_selection == "gradient_based")
+            {
+                dimension_selection_strategy =
+                    grid::GradientBasedDimensionSelection(grad_func);
+            }
+            else if(dim_selection != "largest_first")
+            {
+                LOG(ERROR) << "Unknown dimension selection strategy: "
+                    << dim_selection;
+                return -1;
+            }
+
+            for(auto&& num_abstractions : num_abstractions_list)
+            {
+                for(auto&& fgsm_balance_factor : fgsm_balance_factors)
+                {
+                    std::cout << "Dimension selection: " << dim_selection
+                        << " Abstractions: " << num_abstractions
+                        << " FGSM Balance Factor: " << fgsm_balance_factor
+                        << "\n";
+
+                    auto generation_start =
+                        std::chrono::steady_clock::now();
+                    grid::region_abstraction_strategy_t abstraction_strategy =
+                        grid::ModifiedFGSMWithFallbackRegionAbstraction(
+                                num_abstractions,
+                                grad_func,
+                                dimension_selection_strategy,
+                                grid::RandomPointRegionAbstraction(1u),
+                                granularity,
+                                fgsm_balance_factor);
+
+                    auto abstractions = abstraction_strategy(orig_region);
+                    std::set<grid::point> unique_abstractions;
+                    for(auto&& pt : abstractions)
+                    {
+                        auto pt_to_add = grid::enforceSnapDiscreteGrid(
+                            pt, init_act_point, granularity);
+                        if(enforce_domain)
+                        {
+                            pt_to_add = grid::snapToDomainRange(
+                                    pt_to_add, domain_range);
+                        }
+                        unique_abstractions.insert(pt_to_add);
+                    }
+                    auto generation_seconds =
+                        std::chrono::duration<double>(
+                                std::chrono::steady_clock::now()
+                                - generation_start).count();
+                    std::cout << "Unique Abstractions: "
+                        << unique_abstractions.size() << "\n";
+
+                    // classify the points in batches spread
+                    // over the thread pool
+                    std::vector<grid::point> points(
+                            unique_abstractions.begin(),
+                            unique_abstractions.end());
+                    std::atomic<std::size_t> next_batch(0u);
+                    std::atomic<std::size_t> numAdvExamples(0u);
+                    std::atomic<std::size_t> numClassified(0u);
+                    std::atomic<std::size_t> numFailedBatches(0u);
+                    std::vector<double> latencies_ms;
+                    std::mutex latency_mutex;
+                    auto evaluate_batches = [&]()
+                    {
+                        while(true)
+                        {
+                            auto begin = next_batch.fetch_add(batch_size);
+                            if(begin >= points.size()) break;
+                            auto end = std::min(points.size(),
+                                    begin + batch_size);
+                            std::vector<grid::point> batch(
+                                    points.begin() + begin,
+                                    points.begin() + end);
+                            auto batch_start =
+                                std::chrono::steady_clock::now();
+                            auto logits_out = gm.feedThroughModel(
+                                    std::bind(graph_tool::makeBatchFeedDict,
+                                        input_layer, batch, input_shape),
+                                    &graph_tool::parseGraphOutToVectors,
+                                    {output_layer});
+                            auto latency =
+                                std::chrono::duration<double, std::milli>(
+                                        std::chrono::steady_clock::now()
+                                        - batch_start).count();
+                            // the error flag of the graph manager is
+                            // shared by the threads, so a batch failed
+                            // if it did not get one output per point
+                            if(logits_out.size() != batch.size())
+                            {
+                                LOG(ERROR) << "GM Error in pointIsSafe";
+                                ++numFailedBatches;
+                                continue;
+                            }
+                            numClassified += batch.size();
+                            auto adv = 0u;
+                            for(auto&& logits : logits_out)
+                            {
+                                if(graph_tool::getClassOfClassificationVector(
+                                            logits) != orig_class)
+                                    ++adv;
+                            }
+                            numAdvExamples += adv;
+                            std::lock_guard<std::mutex> lock(latency_mutex);
+                            latencies_ms.push_back(latency);
+                        }
+                    };
+
+                    auto evaluation_start = std::chrono::steady_clock::now();
+                    std::vector<std::thread> thread_pool;
+                    for(auto i = 0; i < num_threads; ++i)
+                        thread_pool.emplace_back(evaluate_batches);
+                    for(auto&& t : thread_pool)
+                        t.join();
+                    auto evaluation_seconds =
+                        std::chrono::duration<double>(
+                                std::chrono::steady_clock::now()
+                                - evaluation_start).count();
+
+                    FGSMTestResult result;
+                    result.initial_activation =
+                        initial_activations[input_index];
+                    result.dim_selection = dim_selection;
+                    result.num_abstractions = num_abstractions;
+                    result.fgsm_balance_factor = fgsm_balance_factor;
+                    result.orig_class = orig_class;
+                    result.unique_abstractions = unique_abstractions.size();
+                    result.adversarial_examples = numAdvExamples.load();
+                    result.failed_batches = numFailedBatches.load();
+                    auto classified = numClassified.load();
+                    result.success_rate = classified == 0u ? 0.0 :
+                        (double)result.adversarial_examples
+                        / (double)classified * 100.0;
+                    result.generation_seconds = generation_seconds;
+                    result.evaluation_seconds = evaluation_seconds;
+                    result.points_per_second = evaluation_seconds > 0 ?
+                        (double)classified / evaluation_seconds : 0.0;
+                    result.latency_p50_ms = percentile(latencies_ms, 50.0);
+                    result.latency_p90_ms = percentile(latencies_ms, 90.0);
+                    result.latency_p99_ms = percentile(latencies_ms, 99.0);
+                    results.push_back(result);
+
+                    std::cout << "Number Adversarial Examples: "
+                        << result.adversarial_examples << "\n";
+                    if(result.failed_batches > 0)
+                        std::cout << "Failed Batches: "
+                            << result.failed_batches << "\n";
+                    std::cout << "Success Rate: "
+                        << result.success_rate << "\n";
+                    std::cout << "Points/s: "
+                        << result.points_per_second << "\n";
+                }
+            }
         }
-        unique_abstractions.insert(pt_to_add);
     }
-    std::cout << "Unique Abstractions: " 
-        << unique_abstractions.size() << "\n";
 
-    auto pointIsSafe = [&](grid::point const& p)
-            {
-                auto logits_out = gm.feedThroughModel(
-                        std::bind(graph_tool::makeFeedDict, 
-                            input_layer, p, batch_input_shape),
-                        &graph_tool::parseGraphOutToVector,
-                        {output_layer});
-                if(!gm.ok())
-                    LOG(ERROR) << "GM Error in pointIsSafe";
-                auto class_out = 
-                    graph_tool::getClassOfClassificationVector(
-                            logits_out);
-                return class_out == orig_class;
-            };
-
-    auto numAdvExamples = 0u;
-    for(auto&& pt : unique_abstractions)
+    if(!output_file.empty())
     {
-        if(pointIsSafe(pt))
-            continue;
-        ++numAdvExamples;
+        std::ofstream out(output_file);
+        if(!out)
+        {
+            LOG(ERROR) << "Could not open output file: " << output_file;
+            return -1;
+        }
+        auto is_json = output_file.size() >= 5 &&
+            output_file.compare(output_file.size() - 5, 5, ".json") == 0;
+        if(is_json) writeJSON(out, results);
+        else writeCSV(out, results);
+        std::cout << "Results written to " << output_file << "\n";
+    }
+    else
+    {
+        writeCSV(std::cout, results);
     }
-    std::cout << "Number Adversarial Examples: "
-        << numAdvExamples << "\n";
-    auto success_rate = (double)numAdvExamples / (double)unique_abstractions.size() * 100.0;
-    std::cout << "Success Rate: " << success_rate << "\n";
 
     return 0;
 }
-
@@ -0,0 +1,240 @@
+#include <cstdio>
+#include <cstdint>
+
+#include "tensorflow/core/platform/logging.h"
+
+#include "FrontierSpill.hpp"
+
+FrontierSpill::FrontierSpill(std::string const& p)
+    : path(p),
+    file(p, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc),
+    readOffset(0),
+    writeOffset(0),
+    writeQueue(),
+    segments(),
+    prefetched(),
+    hasPrefetched(false),
+    prefetchRequested(false),
+    stop(false),
+    numSpilled(0u),
+    numLost(0u),
+    errorOccurred(false),
+    io_mutex(),
+    io_cv(),
+    io_thread()
+{
+    if(!file.is_open())
+    {
+        LOG(ERROR) << "Could not open frontier spill file: " << path;
+        errorOccurred = true;
+        return;
+    }
+    io_thread = std::thread([this](){ io_routine(); });
+}
+
+FrontierSpill::~FrontierSpill()
+{
+    {
+        std::lock_guard<std::mutex> lock(io_mutex);
+        stop = true;
+    }
+    io_cv.notify_all();
+    if(io_thread.joinable()) io_thread.join();
+    file.close();
+    std::remove(path.c_str());
+}
+
+void FrontierSpill::spill(std::vector<entry>&& regions)
+{
+    if(regions.empty()) return;
+    numSpilled += regions.size();
+    {
+        std::lock_guard<std::mutex> lock(io_mutex);
+        writeQueue.push_back(std::move(regions));
+    }
+    io_cv.notify_all();
+}
+
+void FrontierSpill::prefetch()
+{
+    {
+        std::lock_guard<std::mutex> lock(io_mutex);
+        if(hasPrefetched || segments.empty()) return;
+        prefetchRequested = true;
+    }
+    io_cv.notify_all();
+}
+
+std::vector<FrontierSpill::entry> FrontierSpill::reload()
+{
+    std::vector<entry> retVal;
+    {
+        std::unique_lock<std::mutex> lock(io_mutex);
+        while(true)
+        {
+            if(hasPrefetched)
+            {
+                retVal = std::move(prefetched);
+                prefetched.clear();
+                hasPrefetched = false;
+                break;
+            }
+            // batches that have not reached the disk yet are
+            // handed back directly
+            if(!writeQueue.empty())
+            {
+                retVal = std::move(writeQueue.back());
+                writeQueue.pop_back();
+                break;
+            }
+            if(numSpilled.load() == 0u || stop) break;
+            prefetchRequested = true;
+            io_cv.notify_all();
+            io_cv.wait(lock);
+        }
+        numSpilled -= retVal.size();
+        // read the following segment while this one is processed
+        if(!segments.empty()) prefetchRequested = true;
+    }
+    io_cv.notify_all();
+    return retVal;
+}
+
+void FrontierSpill::io_routine()
+{
+    std::unique_lock<std::mutex> lock(io_mutex);
+    while(!stop)
+    {
+        if(prefetchRequested && !hasPrefetched && !segments.empty())
+        {
+            auto seg = segments.front();
+            segments.pop_front();
+            prefetchRequested = false;
+            lock.unlock();
+            std::vector<entry> batch;
+            auto read = read_segment(seg, batch);
+            lock.lock();
+            if(!read)
+            {
+                // the position of the following segments can no longer
+                // be trusted, count them as lost with the rest of this one
+                auto lostRegions = seg.count - batch.size();
+                for(auto&& s : segments)
+                    lostRegions += s.count;
+                segments.clear();
+                numLost += lostRegions;
+                numSpilled -= lostRegions;
+                errorOccurred = true;
+                LOG(ERROR) << lostRegions 
+                    << " spilled regions could not be read back";
+            }
+            prefetched = std::move(batch);
+            hasPrefetched = true;
+            // everything written has been read back, start over at
+            // the beginning of the file instead of growing it
+            if(segments.empty() && readOffset == writeOffset)
+            {
+                readOffset = 0;
+                writeOffset = 0;
+            }
+            io_cv.notify_all();
+        }
+        else if(!writeQueue.empty() && ok())
+        {
+            auto batch = std::move(writeQueue.front());
+            writeQueue.pop_front();
+            lock.unlock();
+            auto written = write_segment(batch);
+            lock.lock();
+            if(written)
+            {
+                segments.push_back({batch.size(), writeOffset});
+            }
+            else
+            {
+                // stop writing and keep the regions in memory
+                // rather than losing them
+                writeQueue.push_front(std::move(batch));
+                errorOccurred = true;
+            }
+            io_cv.notify_all();
+        }
+        else
+        {
+            io_cv.wait(lock);
+        }
+    }
+}
+
+bool FrontierSpill::write_segment(std::vector<entry> const& regions)
+{
+    std::vector<grid::numeric_type_t> buffer;
+    file.seekp(writeOffset);
+    for(auto&& e : regions)
+    {
+        auto& r = e.first;
+        std::uint64_t dims = r.size();
+        buffer.resize(2*r.size());
+        for(auto i = 0u; i < r.size(); ++i)
+        {
+            buffer[2*i] = r[i].first;
+            buffer[2*i + 1] = r[i].second;
+        }
+        file.write(reinterpret_cast<char const*>(&dims), sizeof(dims));
+        file.write(reinterpret_cast<char const*>(&e.second), 
+                sizeof(e.second));
+        file.write(reinterpret_cast<char const*>(buffer.data()), 
+                buffer.size()*sizeof(grid::numeric_type_t));
+    }
+    file.flush();
+    if(!file)
+    {
+        LOG(ERROR) << "Failed writing frontier spill file: " << path;
+        file.clear();
+        return false;
+    }
+    writeOffset = file.tellp();
+    return true;
+}
+
+bool FrontierSpill::read_segment(
+        segment const& seg, 
+        std::vector<entry>& retVal)
+{
+    retVal.clear();
+    retVal.reserve(seg.count);
+    std::vector<grid::numeric_type_t> buffer;
+    file.seekg(readOffset);
+    for(auto i = 0u; i < seg.count; ++i)
+    {
+        std::uint64_t dims = 0u;
+        std::uint64_t tag = 0u;
+        file.read(reinterpret_cast<char*>(&dims), sizeof(dims));
+        file.read(reinterpret_cast<char*>(&tag), sizeof(tag));
+        // a record must end inside its segment, anything else means
+        // the file is corrupt and dims is not to be trusted
+        std::streamoff pos = file ? std::streamoff(file.tellg()) : seg.end;
+        std::uint64_t remaining = pos < seg.end ? seg.end - pos : 0u;
+        if(!file || dims > remaining / (2*sizeof(grid::numeric_type_t)))
+        {
+            LOG(ERROR) << "Corrupt frontier spill file: " << path;
+            file.clear();
+            return false;
+        }
+        buffer.resize(2*dims);
+        file.read(reinterpret_cast<char*>(buffer.data()), 
+                buffer.size()*sizeof(grid::numeric_type_t));
+        if(!file)
+        {
+            LOG(ERROR) << "Failed reading frontier spill file: " << path;
+            file.clear();
+            return false;
+        }
+        grid::region r(dims);
+        for(auto j = 0u; j < dims; ++j)
+            r[j] = {buffer[2*j], buffer[2*j + 1]};
+        retVal.emplace_back(std::move(r), tag);
+    }
+    readOffset = seg.end;
+    return true;
+}
@@ -0,0 +1,78 @@
+#ifndef FRONTIER_SPILL_HPP_INCLUDED
+#define FRONTIER_SPILL_HPP_INCLUDED
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+#include <cstdint>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+#include "grid_tools.hpp"
+
+// on-disk overflow for the region frontier
+// batches of regions are appended as segments to a single file by a
+// background thread and read back (oldest segment first) when the
+// in-memory frontier drains. reading the next segment is started ahead
+// of time so reloading overlaps with verification
+class FrontierSpill
+{
+public:
+    FrontierSpill(std::string const& /* spill file path */);
+    ~FrontierSpill();
+    FrontierSpill(FrontierSpill const&) = delete;
+    FrontierSpill& operator=(FrontierSpill const&) = delete;
+
+    // a region and a tag of the caller (e.g. the partition it belongs to
+    // in the safe region store), written and read back together
+    using entry = std::pair<grid::region, std::uint64_t>;
+
+    // queue a batch of regions to be written, does not block on io
+    void spill(std::vector<entry>&&);
+    // returns the next batch of spilled regions, empty if none remain
+    std::vector<entry> reload();
+    // start reading the next batch in the background
+    void prefetch();
+    // number of regions spilled and not yet reloaded
+    std::size_t size() const { return numSpilled.load(); }
+    // number of spilled regions that could not be read back, after a
+    // failed read the rest of the file is not trusted and every
+    // segment still on disk is counted here
+    std::size_t lost() const { return numLost.load(); }
+    inline bool ok() const { return !errorOccurred.load(); }
+private:
+    struct segment
+    {
+        std::size_t count;
+        // file offset one past the last byte of the segment
+        std::streamoff end;
+    };
+    void io_routine();
+    bool write_segment(std::vector<entry> const&);
+    // false if the segment could not be read completely
+    bool read_segment(segment const&, std::vector<entry>&);
+
+    std::string path;
+    std::fstream file;
+    std::streamoff readOffset;
+    std::streamoff writeOffset;
+    std::deque<std::vector<entry>> writeQueue;
+    // segments on disk, oldest first
+    std::deque<segment> segments;
+    std::vector<entry> prefetched;
+    bool hasPrefetched;
+    bool prefetchRequested;
+    bool stop;
+    std::atomic<std::size_t> numSpilled;
+    std::atomic<std::size_t> numLost;
+    std::atomic<bool> errorOccurred;
+    std::mutex io_mutex;
+    std::condition_variable io_cv;
+    std::thread io_thread;
+};
+
+#endif
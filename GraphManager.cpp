@@ -1,10 +1,28 @@
 #include "tensorflow/core/platform/logging.h"
 #include "tensorflow/core/framework/tensor.pb.h"
+#include "tensorflow/core/framework/node_def.pb.h"
+
+#include <algorithm>
+#include <limits>
+#include <thread>
 
 #include "GraphManager.hpp"
+#include "thread_tools.hpp"
+
+thread_local std::size_t GraphManager::thread_session = 0u;
 
-GraphManager::GraphManager(std::string const& graph_file_name)
-    : session(std::move(tensorflow::NewSession(tensorflow::SessionOptions()))),
+GraphManager::GraphManager(
+        std::string const& graph_file_name,
+        SessionConfig const& config,
+        std::size_t number_of_sessions)
+    : sessions(),
+    callables(),
+    hasGradientCallables(false),
+    hasSafetyCallables(false),
+    safetyOpsAdded(false),
+    safetyExtendedSessions(0u),
+    node_types(),
+    signature(),
     errorOccurred(false)
 {
     tensorflow::GraphDef graph_def;
@@ -15,12 +33,357 @@ GraphManager::GraphManager(std::string const& graph_file_name)
         LOG(FATAL) << "Could not load graph from file: " << graph_file_name;
         errorOccurred = true;
     }
-    auto session_create_status = session->Create(graph_def);
-    if(!session_create_status.ok())
+    for(auto i = 0; i < graph_def.node_size(); ++i)
+    {
+        auto const& node = graph_def.node(i);
+        for(auto&& type_attr : {"T", "dtype"})
+        {
+            auto found = node.attr().find(type_attr);
+            if(node.attr().end() == found) continue;
+            node_types[node.name()] = found->second.type();
+            break;
+        }
+    }
+    auto options = makeSessionOptions(config);
+    for(auto i = 0u; i < std::max<std::size_t>(1u, number_of_sessions); ++i)
+    {
+        tensorflow::Status session_create_status;
+        auto create_session = [&]()
+        {
+            sessions.emplace_back(tensorflow::NewSession(options));
+            session_create_status = sessions.back()->Create(graph_def);
+        };
+        if(i < config.session_cores.size() && 
+                !config.session_cores[i].empty())
+        {
+            // threads inherit the affinity of the thread starting them,
+            // so the pools the session starts stay on its cores
+            std::thread creator([&]()
+                    {
+                        if(!thread_tool::pinCurrentThreadToCores(
+                                    config.session_cores[i]))
+                            LOG(ERROR) << "Could not pin the threads of "
+                                << "session " << i;
+                        create_session();
+                    });
+            creator.join();
+        }
+        else
+        {
+            create_session();
+        }
+        if(!session_create_status.ok())
+        {
+            LOG(FATAL) << "Could not create graph from GraphDef";
+            errorOccurred = true;
+        }
+    }
+}
+
+GraphManager::~GraphManager()
+{
+    releaseCallables();
+}
+
+void GraphManager::releaseCallables()
+{
+    for(auto i = 0u; i < callables.size(); ++i)
     {
-        LOG(FATAL) << "Could not create graph from GraphDef";
+        sessions[i]->ReleaseCallable(callables[i].logits);
+        if(hasGradientCallables)
+            sessions[i]->ReleaseCallable(callables[i].gradient);
+        if(hasSafetyCallables)
+            sessions[i]->ReleaseCallable(callables[i].safety);
+    }
+    callables.clear();
+    hasGradientCallables = false;
+    hasSafetyCallables = false;
+}
+
+namespace
+{
+    const std::string safety_scope = "arframework_safety/";
+
+    tensorflow::NodeDef* addNode(
+            tensorflow::GraphDef& graph_def,
+            std::string const& name,
+            std::string const& op,
+            std::vector<std::string> const& inputs)
+    {
+        auto node = graph_def.add_node();
+        node->set_name(safety_scope + name);
+        node->set_op(op);
+        for(auto&& input : inputs)
+            node->add_input(input);
+        return node;
+    }
+
+    // bool safe and float margin tensors of a batch of logits
+    template <class T>
+    std::vector<tensorflow::Tensor> hostSafetyOf(
+            tensorflow::Tensor const& logits,
+            tensorflow::Tensor const& original_class)
+    {
+        auto batch_size = logits.dim_size(0);
+        auto classes = logits.NumElements() / std::max<tensorflow::int64>(
+                1, batch_size);
+        auto orig = original_class.scalar<tensorflow::int64>()();
+        tensorflow::Tensor safe(tensorflow::DT_BOOL, 
+                tensorflow::TensorShape({batch_size}));
+        tensorflow::Tensor margin(tensorflow::DT_FLOAT,
+                tensorflow::TensorShape({batch_size}));
+        auto logits_data = logits.flat<T>().data();
+        auto safe_data = safe.flat<bool>().data();
+        auto margin_data = margin.flat<float>().data();
+        for(auto i = 0; i < batch_size; ++i)
+        {
+            auto row = logits_data + i*classes;
+            auto best = std::max_element(row, row + classes);
+            auto second = std::numeric_limits<T>::lowest();
+            for(auto j = 0; j < classes; ++j)
+                if(row + j != best) second = std::max(second, row[j]);
+            safe_data[i] = best - row == orig;
+            margin_data[i] = classes > 1 
+                ? static_cast<float>(*best - second) : 0.0f;
+        }
+        return {safe, margin};
+    }
+
+    void addScalarConst(
+            tensorflow::GraphDef& graph_def,
+            std::string const& name,
+            tensorflow::int32 value)
+    {
+        auto node = addNode(graph_def, name, "Const", {});
+        (*node->mutable_attr())["dtype"].set_type(tensorflow::DT_INT32);
+        tensorflow::Tensor value_tensor(
+                tensorflow::DT_INT32, tensorflow::TensorShape({}));
+        value_tensor.scalar<tensorflow::int32>()() = value;
+        value_tensor.AsProtoTensorContent(
+                (*node->mutable_attr())["value"].mutable_tensor());
+    }
+}
+
+bool GraphManager::addSafetyOps()
+{
+    if(safetyOpsAdded) return true;
+    // outputs are [batch, classes], the ops are typed like them
+    auto output_node = signature.output_layer.substr(
+            0, signature.output_layer.find(':'));
+    auto found_type = node_types.find(output_node);
+    if(node_types.end() == found_type ||
+            (found_type->second != tensorflow::DT_FLOAT &&
+             found_type->second != tensorflow::DT_DOUBLE))
+    {
+        LOG(ERROR) << "Unknown or unsupported type of " << output_node
+            << ", checking safety on the host";
+        return false;
+    }
+    auto output_type = found_type->second;
+    tensorflow::GraphDef graph_def;
+    auto class_node = addNode(graph_def, "original_class", "Placeholder", {});
+    (*class_node->mutable_attr())["dtype"].set_type(tensorflow::DT_INT64);
+    addScalarConst(graph_def, "class_axis", 1);
+    addScalarConst(graph_def, "k", 2);
+    auto argmax = addNode(graph_def, "argmax", "ArgMax", 
+            {signature.output_layer, safety_scope + "class_axis"});
+    (*argmax->mutable_attr())["T"].set_type(output_type);
+    (*argmax->mutable_attr())["Tidx"].set_type(tensorflow::DT_INT32);
+    (*argmax->mutable_attr())["output_type"].set_type(tensorflow::DT_INT64);
+    auto safe = addNode(graph_def, "safe", "Equal",
+            {safety_scope + "argmax", safety_scope + "original_class"});
+    (*safe->mutable_attr())["T"].set_type(tensorflow::DT_INT64);
+    auto top2 = addNode(graph_def, "top2", "TopKV2",
+            {signature.output_layer, safety_scope + "k"});
+    (*top2->mutable_attr())["T"].set_type(output_type);
+    (*top2->mutable_attr())["sorted"].set_b(true);
+    auto top2_columns = addNode(graph_def, "top2_columns", "Unpack",
+            {safety_scope + "top2:0"});
+    (*top2_columns->mutable_attr())["T"].set_type(output_type);
+    (*top2_columns->mutable_attr())["num"].set_i(2);
+    (*top2_columns->mutable_attr())["axis"].set_i(1);
+    auto margin = addNode(graph_def, "margin", "Sub",
+            {safety_scope + "top2_columns:0", 
+            safety_scope + "top2_columns:1"});
+    (*margin->mutable_attr())["T"].set_type(output_type);
+    // a retry after a partial failure must not extend a session twice
+    for(; safetyExtendedSessions < sessions.size(); ++safetyExtendedSessions)
+    {
+        auto status = sessions[safetyExtendedSessions]->Extend(graph_def);
+        if(!status.ok())
+        {
+            LOG(ERROR) << "Could not add safety ops to the graph: "
+                << status.ToString();
+            return false;
+        }
+    }
+    safetyOpsAdded = true;
+    return true;
+}
+
+bool GraphManager::makeCallables(ModelSignature const& sig)
+{
+    releaseCallables();
+    signature = sig;
+    auto withGradient = 
+        !sig.label_layer.empty() && !sig.gradient_layer.empty();
+    tensorflow::CallableOptions logits_options;
+    logits_options.add_feed(sig.input_layer);
+    logits_options.add_fetch(sig.output_layer);
+    tensorflow::CallableOptions gradient_options;
+    gradient_options.add_feed(sig.input_layer);
+    gradient_options.add_feed(sig.label_layer);
+    gradient_options.add_fetch(sig.gradient_layer);
+    auto withSafety = addSafetyOps();
+    tensorflow::CallableOptions safety_options;
+    safety_options.add_feed(sig.input_layer);
+    safety_options.add_feed(safety_scope + "original_class");
+    safety_options.add_fetch(safety_scope + "safe");
+    safety_options.add_fetch(safety_scope + "margin");
+    std::vector<session_callables> made;
+    for(auto&& session : sessions)
+    {
+        session_callables handles;
+        // handles made for this session so far, released on failure
+        std::vector<tensorflow::Session::CallableHandle> session_made;
+        auto make = [&](tensorflow::CallableOptions const& options,
+                tensorflow::Session::CallableHandle* handle)
+        {
+            auto status = session->MakeCallable(options, handle);
+            if(status.ok())
+                session_made.push_back(*handle);
+            return status;
+        };
+        auto status = make(logits_options, &handles.logits);
+        if(status.ok() && withGradient)
+            status = make(gradient_options, &handles.gradient);
+        if(status.ok() && withSafety)
+            status = make(safety_options, &handles.safety);
+        if(!status.ok())
+        {
+            LOG(ERROR) << "Could not make callables, running by name: "
+                << status.ToString();
+            for(auto&& handle : session_made)
+                session->ReleaseCallable(handle);
+            callables = std::move(made);
+            hasGradientCallables = withGradient;
+            hasSafetyCallables = withSafety;
+            releaseCallables();
+            return false;
+        }
+        made.push_back(handles);
+    }
+    callables = std::move(made);
+    hasGradientCallables = withGradient;
+    hasSafetyCallables = withSafety;
+    return true;
+}
+
+std::vector<tensorflow::Tensor> GraphManager::runQuery(
+        tensorflow::Session::CallableHandle session_callables::* handle,
+        std::vector<tensorflow::Tensor> const& feeds,
+        std::vector<std::string> const& feed_names,
+        std::vector<std::string> const& fetch_names)
+{
+    std::vector<tensorflow::Tensor> outputs;
+    tensorflow::Status run_status;
+    auto available = handle == &session_callables::logits 
+        || (handle == &session_callables::safety 
+                ? hasSafetyCallables : hasGradientCallables);
+    if(!callables.empty() && available)
+    {
+        run_status = current_session().RunCallable(
+                callables[current_index()].*handle, 
+                feeds, 
+                &outputs, 
+                nullptr);
+    }
+    else
+    {
+        std::vector<std::pair<std::string, tensorflow::Tensor>> feed_dict;
+        for(auto i = 0u; i < feeds.size(); ++i)
+            feed_dict.push_back({feed_names[i], feeds[i]});
+        run_status = current_session().Run(
+                feed_dict, fetch_names, {}, &outputs);
+    }
+    if(!run_status.ok() || outputs.size() != fetch_names.size())
+    {
+        outputs.clear();
         errorOccurred = true;
     }
+    return outputs;
+}
+
+std::vector<tensorflow::Tensor> GraphManager::classify(
+        tensorflow::Tensor const& batch)
+{
+    return runQuery(
+            &session_callables::logits,
+            {batch},
+            {signature.input_layer},
+            {signature.output_layer});
+}
+
+std::vector<tensorflow::Tensor> GraphManager::gradient(
+        tensorflow::Tensor const& batch,
+        tensorflow::Tensor const& labels)
+{
+    return runQuery(
+            &session_callables::gradient,
+            {batch, labels},
+            {signature.input_layer, signature.label_layer},
+            {signature.gradient_layer});
+}
+
+std::vector<tensorflow::Tensor> GraphManager::safetyCheck(
+        tensorflow::Tensor const& batch,
+        tensorflow::Tensor const& original_class)
+{
+    if(!safetyOpsAdded)
+        return hostSafetyCheck(batch, original_class);
+    return runQuery(
+            &session_callables::safety,
+            {batch, original_class},
+            {signature.input_layer, safety_scope + "original_class"},
+            {safety_scope + "safe", safety_scope + "margin"});
+}
+
+std::vector<tensorflow::Tensor> GraphManager::hostSafetyCheck(
+        tensorflow::Tensor const& batch,
+        tensorflow::Tensor const& original_class)
+{
+    auto outputs = classify(batch);
+    if(outputs.empty()) return {};
+    auto& logits = outputs.front();
+    if(logits.dtype() == tensorflow::DT_DOUBLE)
+        return hostSafetyOf<double>(logits, original_class);
+    if(logits.dtype() == tensorflow::DT_FLOAT)
+        return hostSafetyOf<float>(logits, original_class);
+    LOG(ERROR) << "Unsupported output type in the safety check";
+    errorOccurred = true;
+    return {};
+}
+
+tensorflow::SessionOptions 
+GraphManager::makeSessionOptions(SessionConfig const& config)
+{
+    tensorflow::SessionOptions options;
+    // tensorflow otherwise sizes process wide pools from the first
+    // session and every later session (another configuration or another
+    // session of the pool) would run on them
+    options.config.set_use_per_session_threads(true);
+    options.config.set_intra_op_parallelism_threads(config.intra_op_threads);
+    options.config.set_inter_op_parallelism_threads(config.inter_op_threads);
+    auto optimizer_options = 
+        options.config.mutable_graph_options()->mutable_optimizer_options();
+    if(config.opt_level == "L0")
+        optimizer_options->set_opt_level(tensorflow::OptimizerOptions::L0);
+    else if(config.opt_level == "L1")
+        optimizer_options->set_opt_level(tensorflow::OptimizerOptions::L1);
+    if(config.xla_jit)
+        optimizer_options->set_global_jit_level(
+                tensorflow::OptimizerOptions::ON_1);
+    return options;
 }
 
 std::pair<bool, tensorflow::Tensor>
@@ -7,6 +7,8 @@
 #include <vector>
 #include <functional>
 #include <memory>
+#include <atomic>
+#include <map>
 
 #include "tensorflow/cc/ops/const_op.h"
 #include "tensorflow/cc/ops/standard_ops.h"
@@ -20,11 +22,46 @@
 #include "tensorflow/core/platform/env.h"
 #include "tensorflow/core/platform/types.h"
 #include "tensorflow/core/public/session.h"
+#include "tensorflow/core/protobuf/config.pb.h"
 
 class GraphManager
 {
 public:
-    GraphManager(std::string const&);
+    // session settings, zero threads leaves the choice to tensorflow
+    // (one per core), each session has its own thread pools
+    struct SessionConfig
+    {
+        SessionConfig()
+            : intra_op_threads(0), inter_op_threads(0),
+            opt_level("default"), xla_jit(false), session_cores() {}
+        int intra_op_threads;
+        int inter_op_threads;
+        // default, L0 (no optimization) or L1
+        std::string opt_level;
+        bool xla_jit;
+        // cores the pool threads of session i run on (e.g. one NUMA
+        // node per session), sessions without an entry are not pinned
+        std::vector<std::vector<unsigned>> session_cores;
+    };
+
+    // feed and fetch names of the queries made during verification,
+    // the label and gradient layers may be empty
+    struct ModelSignature
+    {
+        std::string input_layer;
+        std::string output_layer;
+        std::string label_layer;
+        std::string gradient_layer;
+    };
+
+    // creates number_of_sessions sessions of the same graph, each thread
+    // runs the model on the session selected by setThreadSession
+    GraphManager(
+            std::string const&, 
+            SessionConfig const& = SessionConfig(),
+            std::size_t /* number_of_sessions */ = 1u);
+    ~GraphManager();
+    static tensorflow::SessionOptions makeSessionOptions(SessionConfig const&);
     static std::pair<bool, tensorflow::Tensor> ReadBinaryTensorProto(std::string const&);
     template <class InConvFunc, class OutConvFunc, class... In>
     typename 
@@ -37,7 +74,7 @@ public:
     {
         auto feed_dict = in_func(std::forward<In>(in_args)...);
         std::vector<tensorflow::Tensor> outputs;
-        auto run_status = session->Run(
+        auto run_status = current_session().Run(
                 feed_dict,
                 output_labels,
                 {},
@@ -50,11 +87,72 @@ public:
         auto outs = out_func(outputs);
         return outs;
     }
+    // precompiles the logits, gradient and safety runs on every
+    // session so the typed queries below skip resolving feeds
+    // and fetches by name, returns false if they could not be made
+    // (the typed queries then fall back to running by name)
+    bool makeCallables(ModelSignature const&);
+    // the outputs are returned like feedThroughModel passes them to
+    // its output function, empty if the run failed
+    // logits of a batch of inputs
+    std::vector<tensorflow::Tensor> classify(
+            tensorflow::Tensor const& /* batch */);
+    // gradient of a batch of inputs, one label per input
+    std::vector<tensorflow::Tensor> gradient(
+            tensorflow::Tensor const& /* batch */,
+            tensorflow::Tensor const& /* labels */);
+    // safety of a batch against the original class (an int64 scalar):
+    // a bool per input (argmax equals the class) followed by the
+    // difference of the two largest outputs per input (of the output
+    // type, float or double), computed by ops appended to the graph, or
+    // on the host (as float) if they could not be
+    std::vector<tensorflow::Tensor> safetyCheck(
+            tensorflow::Tensor const& /* batch */,
+            tensorflow::Tensor const& /* original class */);
     inline bool ok() { return !errorOccurred; }
     inline void resetErrorFlag() { errorOccurred = false; }
+    inline std::size_t numSessions() const { return sessions.size(); }
+    // session used by the calling thread, out of range indices use
+    // the first session
+    static void setThreadSession(std::size_t index) { thread_session = index; }
 private:
-    std::unique_ptr<tensorflow::Session> session;
-    bool errorOccurred;
+    struct session_callables
+    {
+        tensorflow::Session::CallableHandle logits;
+        tensorflow::Session::CallableHandle gradient;
+        tensorflow::Session::CallableHandle safety;
+    };
+
+    std::vector<std::unique_ptr<tensorflow::Session>> sessions;
+    // one entry per session when makeCallables succeeded
+    std::vector<session_callables> callables;
+    bool hasGradientCallables;
+    bool hasSafetyCallables;
+    bool safetyOpsAdded;
+    // sessions [0, n) already extended with the safety ops
+    std::size_t safetyExtendedSessions;
+    // output type of each node of the graph (its T or dtype attribute)
+    std::map<std::string, tensorflow::DataType> node_types;
+    ModelSignature signature;
+    // set by any session on a failed run, callers that run concurrently
+    // should decide from their own outputs
+    std::atomic<bool> errorOccurred;
+    static thread_local std::size_t thread_session;
+
+    inline std::size_t current_index() const
+    { return thread_session < sessions.size() ? thread_session : 0u; }
+    inline tensorflow::Session& current_session()
+    { return *sessions[current_index()]; }
+    void releaseCallables();
+    bool addSafetyOps();
+    std::vector<tensorflow::Tensor> hostSafetyCheck(
+            tensorflow::Tensor const&,
+            tensorflow::Tensor const&);
+    std::vector<tensorflow::Tensor> runQuery(
+            tensorflow::Session::CallableHandle session_callables::*,
+            std::vector<tensorflow::Tensor> const&,
+            std::vector<std::string> const&,
+            std::vector<std::string> const&);
 };
 
 #endif
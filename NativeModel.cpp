@@ -0,0 +1,633 @@
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+
+#include "NativeModel.hpp"
+
+namespace
+{
+    const char model_magic[8] = {'A','R','F','N','E','T','0','1'};
+    // points processed together by the dense kernel, each block of
+    // weight rows is reused for the whole tile while it is in cache
+    const std::size_t dense_batch_tile = 8u;
+    const std::size_t dense_row_block = 256u;
+
+    template <class T>
+    bool readValue(std::istream& in, T& value)
+    {
+        return static_cast<bool>(
+                in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+    }
+
+    template <class T>
+    void writeValue(std::ostream& out, T const& value)
+    {
+        out.write(reinterpret_cast<char const*>(&value), sizeof(T));
+    }
+
+    bool readFloats(std::istream& in, std::vector<float>& values)
+    {
+        std::uint64_t count;
+        if(!readValue(in, count)) return false;
+        values.resize(count);
+        return count == 0u || static_cast<bool>(
+                in.read(reinterpret_cast<char*>(values.data()),
+                    count*sizeof(float)));
+    }
+
+    void writeFloats(std::ostream& out, std::vector<float> const& values)
+    {
+        writeValue(out, static_cast<std::uint64_t>(values.size()));
+        out.write(reinterpret_cast<char const*>(values.data()),
+                values.size()*sizeof(float));
+    }
+
+    inline std::size_t layerInSize(NativeModel::Layer const& l)
+    { return std::size_t(l.in_h)*l.in_w*l.in_c; }
+    inline std::size_t layerOutSize(NativeModel::Layer const& l)
+    { return std::size_t(l.out_h)*l.out_w*l.out_c; }
+
+    void conv2dForward(
+            NativeModel::Layer const& l,
+            float const* x,
+            float* y)
+    {
+        auto ph = (l.a - 1) / 2;
+        auto pw = (l.b - 1) / 2;
+        auto ci = l.in_c;
+        auto co = l.out_c;
+        for(auto oy = 0u; oy < l.out_h; ++oy)
+        {
+            for(auto ox = 0u; ox < l.out_w; ++ox)
+            {
+                auto yo = y + (std::size_t(oy)*l.out_w + ox)*co;
+                std::copy(l.bias.begin(), l.bias.end(), yo);
+                for(auto ky = 0u; ky < l.a; ++ky)
+                {
+                    auto iy = int(oy + ky) - int(ph);
+                    if(iy < 0 || iy >= int(l.in_h)) continue;
+                    for(auto kx = 0u; kx < l.b; ++kx)
+                    {
+                        auto ix = int(ox + kx) - int(pw);
+                        if(ix < 0 || ix >= int(l.in_w)) continue;
+                        auto xi = x + (std::size_t(iy)*l.in_w + ix)*ci;
+                        auto wk = l.weights.data()
+                            + (std::size_t(ky)*l.b + kx)*ci*co;
+                        for(auto c = 0u; c < ci; ++c)
+                        {
+                            auto v = xi[c];
+                            if(v == 0.0f) continue;
+                            auto wr = wk + std::size_t(c)*co;
+                            for(auto o = 0u; o < co; ++o)
+                                yo[o] += v*wr[o];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void conv2dBackward(
+            NativeModel::Layer const& l,
+            float const* dy,
+            float* dx)
+    {
+        auto ph = (l.a - 1) / 2;
+        auto pw = (l.b - 1) / 2;
+        auto ci = l.in_c;
+        auto co = l.out_c;
+        std::fill(dx, dx + layerInSize(l), 0.0f);
+        for(auto oy = 0u; oy < l.out_h; ++oy)
+        {
+            for(auto ox = 0u; ox < l.out_w; ++ox)
+            {
+                auto dyo = dy + (std::size_t(oy)*l.out_w + ox)*co;
+                for(auto ky = 0u; ky < l.a; ++ky)
+                {
+                    auto iy = int(oy + ky) - int(ph);
+                    if(iy < 0 || iy >= int(l.in_h)) continue;
+                    for(auto kx = 0u; kx < l.b; ++kx)
+                    {
+                        auto ix = int(ox + kx) - int(pw);
+                        if(ix < 0 || ix >= int(l.in_w)) continue;
+                        auto dxi = dx + (std::size_t(iy)*l.in_w + ix)*ci;
+                        auto wk = l.weights.data()
+                            + (std::size_t(ky)*l.b + kx)*ci*co;
+                        for(auto c = 0u; c < ci; ++c)
+                        {
+                            auto wr = wk + std::size_t(c)*co;
+                            auto sum = 0.0f;
+                            for(auto o = 0u; o < co; ++o)
+                                sum += wr[o]*dyo[o];
+                            dxi[c] += sum;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // index (within the input) of the maximum of the pooling window
+    inline std::size_t maxpoolArgmax(
+            NativeModel::Layer const& l,
+            float const* x,
+            std::uint32_t oy,
+            std::uint32_t ox,
+            std::uint32_t c)
+    {
+        auto p = l.a;
+        auto best = (std::size_t(oy*p)*l.in_w + ox*p)*l.in_c + c;
+        for(auto py = 0u; py < p; ++py)
+        {
+            for(auto px = 0u; px < p; ++px)
+            {
+                auto idx =
+                    (std::size_t(oy*p + py)*l.in_w + ox*p + px)*l.in_c + c;
+                if(x[idx] > x[best]) best = idx;
+            }
+        }
+        return best;
+    }
+
+    void maxpoolForward(
+            NativeModel::Layer const& l,
+            float const* x,
+            float* y)
+    {
+        for(auto oy = 0u; oy < l.out_h; ++oy)
+            for(auto ox = 0u; ox < l.out_w; ++ox)
+                for(auto c = 0u; c < l.out_c; ++c)
+                    y[(std::size_t(oy)*l.out_w + ox)*l.out_c + c] =
+                        x[maxpoolArgmax(l, x, oy, ox, c)];
+    }
+
+    void maxpoolBackward(
+            NativeModel::Layer const& l,
+            float const* x,
+            float const* dy,
+            float* dx)
+    {
+        std::fill(dx, dx + layerInSize(l), 0.0f);
+        for(auto oy = 0u; oy < l.out_h; ++oy)
+            for(auto ox = 0u; ox < l.out_w; ++ox)
+                for(auto c = 0u; c < l.out_c; ++c)
+                    dx[maxpoolArgmax(l, x, oy, ox, c)] +=
+                        dy[(std::size_t(oy)*l.out_w + ox)*l.out_c + c];
+    }
+
+    void denseForward(
+            NativeModel::Layer const& l,
+            float const* x,
+            float* y,
+            std::size_t batch)
+    {
+        auto n_in = layerInSize(l);
+        auto n_out = std::size_t(l.out_c);
+        for(auto b0 = 0u; b0 < batch; b0 += dense_batch_tile)
+        {
+            auto b1 = std::min(batch, b0 + dense_batch_tile);
+            for(auto b = b0; b < b1; ++b)
+                std::copy(l.bias.begin(), l.bias.end(), y + b*n_out);
+            for(auto i0 = 0u; i0 < n_in; i0 += dense_row_block)
+            {
+                auto i1 = std::min(n_in, i0 + dense_row_block);
+                for(auto b = b0; b < b1; ++b)
+                {
+                    auto xb = x + b*n_in;
+                    auto yb = y + b*n_out;
+                    for(auto i = i0; i < i1; ++i)
+                    {
+                        auto v = xb[i];
+                        if(v == 0.0f) continue;
+                        auto wr = l.weights.data() + i*n_out;
+                        for(auto j = 0u; j < n_out; ++j)
+                            yb[j] += v*wr[j];
+                    }
+                }
+            }
+        }
+    }
+
+    void denseBackward(
+            NativeModel::Layer const& l,
+            float const* dy,
+            float* dx)
+    {
+        auto n_in = layerInSize(l);
+        auto n_out = std::size_t(l.out_c);
+        for(auto i = 0u; i < n_in; ++i)
+        {
+            auto wr = l.weights.data() + i*n_out;
+            auto sum = 0.0f;
+            for(auto j = 0u; j < n_out; ++j)
+                sum += wr[j]*dy[j];
+            dx[i] = sum;
+        }
+    }
+
+    // adds the change of one input coordinate to the output of a
+    // linear (conv2d or dense) layer before bias and relu are applied
+    void linearDelta(
+            NativeModel::Layer const& l,
+            std::size_t i,
+            float dv,
+            float* y)
+    {
+        auto co = std::size_t(l.out_c);
+        if(l.type == NativeModel::LayerType::DENSE)
+        {
+            auto wr = l.weights.data() + i*co;
+            for(auto o = 0u; o < co; ++o)
+                y[o] += dv*wr[o];
+            return;
+        }
+        auto ci = std::size_t(l.in_c);
+        auto c = i % ci;
+        auto ix = int((i / ci) % l.in_w);
+        auto iy = int(i / (ci*l.in_w));
+        auto ph = int(l.a - 1) / 2;
+        auto pw = int(l.b - 1) / 2;
+        for(auto ky = 0; ky < int(l.a); ++ky)
+        {
+            auto oy = iy + ph - ky;
+            if(oy < 0 || oy >= int(l.out_h)) continue;
+            for(auto kx = 0; kx < int(l.b); ++kx)
+            {
+                auto ox = ix + pw - kx;
+                if(ox < 0 || ox >= int(l.out_w)) continue;
+                auto wr = l.weights.data()
+                    + ((std::size_t(ky)*l.b + kx)*ci + c)*co;
+                auto yo = y + (std::size_t(oy)*l.out_w + ox)*co;
+                for(auto o = 0u; o < co; ++o)
+                    yo[o] += dv*wr[o];
+            }
+        }
+    }
+
+    void softmax(float const* x, float* y, std::size_t n)
+    {
+        if(n == 0u) return;
+        auto max_val = *std::max_element(x, x + n);
+        auto sum = 0.0f;
+        for(auto i = 0u; i < n; ++i)
+        {
+            y[i] = std::exp(x[i] - max_val);
+            sum += y[i];
+        }
+        for(auto i = 0u; i < n; ++i)
+            y[i] /= sum;
+    }
+}
+
+NativeModel::NativeModel(std::string const& path)
+    : height(0u),
+    width(0u),
+    channels(0u),
+    layers(),
+    errorOccurred(false)
+{
+    std::ifstream in(path, std::ios::binary);
+    char magic[sizeof(model_magic)];
+    std::uint32_t num_layers = 0u;
+    if(!in || !in.read(magic, sizeof(magic))
+            || std::memcmp(magic, model_magic, sizeof(magic)) != 0
+            || !readValue(in, height) || !readValue(in, width)
+            || !readValue(in, channels) || !readValue(in, num_layers))
+    {
+        std::cerr << "Could not read native model header: " << path << "\n";
+        errorOccurred = true;
+        return;
+    }
+    for(auto i = 0u; i < num_layers; ++i)
+    {
+        Layer l{};
+        std::uint32_t type, relu;
+        if(!readValue(in, type) || !readValue(in, relu)
+                || !readValue(in, l.a) || !readValue(in, l.b)
+                || !readValue(in, l.c)
+                || !readFloats(in, l.weights) || !readFloats(in, l.bias))
+        {
+            std::cerr << "Could not read layer " << i
+                << " of native model: " << path << "\n";
+            errorOccurred = true;
+            return;
+        }
+        l.type = static_cast<LayerType>(type);
+        l.relu = relu != 0u;
+        layers.push_back(std::move(l));
+    }
+    inferShapes();
+}
+
+NativeModel::NativeModel(
+        std::uint32_t h,
+        std::uint32_t w,
+        std::uint32_t c,
+        std::vector<Layer> const& ls)
+    : height(h),
+    width(w),
+    channels(c),
+    layers(ls),
+    errorOccurred(false)
+{
+    inferShapes();
+}
+
+void NativeModel::inferShapes()
+{
+    auto h = height, w = width, c = channels;
+    for(auto i = 0u; i < layers.size(); ++i)
+    {
+        auto& l = layers[i];
+        l.in_h = h; l.in_w = w; l.in_c = c;
+        std::size_t expected_weights = 0u, expected_bias = 0u;
+        switch(l.type)
+        {
+            case LayerType::CONV2D:
+                l.out_h = h; l.out_w = w; l.out_c = l.c;
+                expected_weights = std::size_t(l.a)*l.b*c*l.c;
+                expected_bias = l.c;
+                break;
+            case LayerType::MAXPOOL:
+                l.out_h = l.a ? h / l.a : 0u;
+                l.out_w = l.a ? w / l.a : 0u;
+                l.out_c = c;
+                break;
+            case LayerType::DENSE:
+                l.out_h = 1u; l.out_w = 1u; l.out_c = l.a;
+                expected_weights = std::size_t(h)*w*c*l.a;
+                expected_bias = l.a;
+                break;
+            case LayerType::SOFTMAX:
+                l.out_h = h; l.out_w = w; l.out_c = c;
+                if(i + 1u != layers.size())
+                {
+                    std::cerr << "Softmax must be the last layer\n";
+                    errorOccurred = true;
+                }
+                break;
+            default:
+                std::cerr << "Unknown native model layer type "
+                    << static_cast<std::uint32_t>(l.type) << "\n";
+                errorOccurred = true;
+                return;
+        }
+        if(l.weights.size() != expected_weights
+                || l.bias.size() != expected_bias
+                || layerOutSize(l) == 0u)
+        {
+            std::cerr << "Native model layer " << i
+                << " has inconsistent parameters\n";
+            errorOccurred = true;
+            return;
+        }
+        h = l.out_h; w = l.out_w; c = l.out_c;
+    }
+}
+
+bool NativeModel::save(std::string const& path) const
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(model_magic, sizeof(model_magic));
+    writeValue(out, height);
+    writeValue(out, width);
+    writeValue(out, channels);
+    writeValue(out, static_cast<std::uint32_t>(layers.size()));
+    for(auto&& l : layers)
+    {
+        writeValue(out, static_cast<std::uint32_t>(l.type));
+        writeValue(out, static_cast<std::uint32_t>(l.relu ? 1u : 0u));
+        writeValue(out, l.a);
+        writeValue(out, l.b);
+        writeValue(out, l.c);
+        writeFloats(out, l.weights);
+        writeFloats(out, l.bias);
+    }
+    out.close();
+    return static_cast<bool>(out);
+}
+
+std::size_t NativeModel::inputSize() const
+{
+    return std::size_t(height)*width*channels;
+}
+
+std::size_t NativeModel::outputSize() const
+{
+    return layers.empty() ? inputSize() : layerOutSize(layers.back());
+}
+
+void NativeModel::forward(
+        std::vector<grid::point> const& pts,
+        std::vector<std::vector<float>>& activations,
+        bool include_softmax) const
+{
+    auto batch = pts.size();
+    auto num_layers = layers.size();
+    if(!include_softmax && num_layers > 0u
+            && layers.back().type == LayerType::SOFTMAX)
+        --num_layers;
+    activations.resize(num_layers + 1u);
+    auto n_in = inputSize();
+    activations[0].assign(batch*n_in, 0.0f);
+    for(auto b = 0u; b < batch; ++b)
+        std::copy(pts[b].begin(),
+                pts[b].begin() + std::min(n_in, pts[b].size()),
+                activations[0].begin() + b*n_in);
+    runLayers(activations, 0u, num_layers, batch);
+}
+
+void NativeModel::runLayers(
+        std::vector<std::vector<float>>& activations,
+        std::size_t first,
+        std::size_t last,
+        std::size_t batch) const
+{
+    for(auto i = first; i < last; ++i)
+    {
+        auto& l = layers[i];
+        auto in_size = layerInSize(l);
+        auto out_size = layerOutSize(l);
+        auto x = activations[i].data();
+        activations[i + 1].resize(batch*out_size);
+        auto y = activations[i + 1].data();
+        switch(l.type)
+        {
+            case LayerType::CONV2D:
+                for(auto b = 0u; b < batch; ++b)
+                    conv2dForward(l, x + b*in_size, y + b*out_size);
+                break;
+            case LayerType::MAXPOOL:
+                for(auto b = 0u; b < batch; ++b)
+                    maxpoolForward(l, x + b*in_size, y + b*out_size);
+                break;
+            case LayerType::DENSE:
+                denseForward(l, x, y, batch);
+                break;
+            case LayerType::SOFTMAX:
+                for(auto b = 0u; b < batch; ++b)
+                    softmax(x + b*in_size, y + b*out_size, out_size);
+                break;
+        }
+        if(l.relu)
+            for(auto& v : activations[i + 1])
+                v = std::max(v, 0.0f);
+    }
+}
+
+std::vector<grid::point> NativeModel::classify(
+        std::vector<grid::point> const& pts) const
+{
+    if(errorOccurred) return {};
+    // scratch buffers are reused by the calling thread
+    thread_local std::vector<std::vector<float>> activations;
+    forward(pts, activations, true);
+    auto n_out = outputSize();
+    std::vector<grid::point> retVal;
+    retVal.reserve(pts.size());
+    for(auto b = 0u; b < pts.size(); ++b)
+        retVal.emplace_back(
+                activations.back().begin() + b*n_out,
+                activations.back().begin() + (b + 1)*n_out);
+    return retVal;
+}
+
+bool NativeModel::supportsIncremental() const
+{
+    return !errorOccurred && !layers.empty() &&
+        (layers.front().type == LayerType::CONV2D 
+         || layers.front().type == LayerType::DENSE);
+}
+
+std::vector<grid::point> NativeModel::classifyIncremental(
+        std::vector<grid::point> const& pts) const
+{
+    if(!supportsIncremental()) return classify(pts);
+    // first layer output (with bias, before relu) of the base point
+    struct incremental_base
+    {
+        NativeModel const* model = nullptr;
+        std::vector<float> input;
+        std::vector<float> first_layer;
+    };
+    thread_local incremental_base base;
+    thread_local std::vector<std::vector<float>> activations;
+    thread_local std::vector<std::size_t> changed;
+    if(base.model != this)
+    {
+        base.model = this;
+        base.input.clear();
+    }
+    auto& first = layers.front();
+    auto n_in = inputSize();
+    auto n_first = layerOutSize(first);
+    // past this many changed coordinates a full first layer is cheaper
+    auto max_changed = std::max<std::size_t>(1u, n_in / 4u);
+    auto batch = pts.size();
+    activations.resize(layers.size() + 1u);
+    activations[1].resize(batch*n_first);
+    for(auto b = 0u; b < batch; ++b)
+    {
+        auto& p = pts[b];
+        changed.clear();
+        auto rebase = base.input.size() != n_in;
+        for(auto i = 0u; !rebase && i < n_in; ++i)
+        {
+            auto v = i < p.size() ? float(p[i]) : 0.0f;
+            if(v != base.input[i])
+            {
+                changed.push_back(i);
+                rebase = changed.size() > max_changed;
+            }
+        }
+        if(rebase)
+        {
+            base.input.assign(n_in, 0.0f);
+            std::copy(p.begin(), p.begin() + std::min(n_in, p.size()),
+                    base.input.begin());
+            base.first_layer.resize(n_first);
+            if(first.type == LayerType::CONV2D)
+                conv2dForward(first, base.input.data(), 
+                        base.first_layer.data());
+            else
+                denseForward(first, base.input.data(), 
+                        base.first_layer.data(), 1u);
+            changed.clear();
+        }
+        auto y = activations[1].data() + b*n_first;
+        std::copy(base.first_layer.begin(), base.first_layer.end(), y);
+        for(auto&& i : changed)
+            linearDelta(first, i, float(p[i]) - base.input[i], y);
+        if(first.relu)
+            for(auto j = 0u; j < n_first; ++j)
+                y[j] = std::max(y[j], 0.0f);
+    }
+    runLayers(activations, 1u, layers.size(), batch);
+    auto n_out = outputSize();
+    std::vector<grid::point> retVal;
+    retVal.reserve(batch);
+    for(auto b = 0u; b < batch; ++b)
+        retVal.emplace_back(
+                activations.back().begin() + b*n_out,
+                activations.back().begin() + (b + 1)*n_out);
+    return retVal;
+}
+
+std::vector<grid::point> NativeModel::gradient(
+        std::vector<grid::point> const& pts,
+        grid::point const& label) const
+{
+    if(errorOccurred) return {};
+    thread_local std::vector<std::vector<float>> activations;
+    thread_local std::vector<float> dy, dx;
+    forward(pts, activations, false);
+    auto num_layers = activations.size() - 1u;
+    auto n_logits = num_layers > 0u
+        ? layerOutSize(layers[num_layers - 1u]) : inputSize();
+    auto label_sum = std::accumulate(label.begin(), label.end(), 0.0L);
+    std::vector<grid::point> retVal;
+    retVal.reserve(pts.size());
+    for(auto b = 0u; b < pts.size(); ++b)
+    {
+        // d cross entropy / d logits = softmax * sum(label) - label
+        dy.resize(n_logits);
+        softmax(activations.back().data() + b*n_logits, dy.data(), n_logits);
+        for(auto j = 0u; j < n_logits; ++j)
+            dy[j] = dy[j]*label_sum - (j < label.size() ? label[j] : 0.0L);
+        for(auto i = num_layers; i-- > 0u;)
+        {
+            auto& l = layers[i];
+            auto in_size = layerInSize(l);
+            auto out_size = layerOutSize(l);
+            if(l.relu)
+            {
+                auto y = activations[i + 1].data() + b*out_size;
+                for(auto j = 0u; j < out_size; ++j)
+                    if(y[j] <= 0.0f) dy[j] = 0.0f;
+            }
+            dx.resize(in_size);
+            switch(l.type)
+            {
+                case LayerType::CONV2D:
+                    conv2dBackward(l, dy.data(), dx.data());
+                    break;
+                case LayerType::MAXPOOL:
+                    maxpoolBackward(l, activations[i].data() + b*in_size,
+                            dy.data(), dx.data());
+                    break;
+                case LayerType::DENSE:
+                    denseBackward(l, dy.data(), dx.data());
+                    break;
+                case LayerType::SOFTMAX:
+                    std::copy(dy.begin(), dy.end(), dx.begin());
+                    break;
+            }
+            std::swap(dx, dy);
+        }
+        retVal.emplace_back(dy.begin(), dy.end());
+    }
+    return retVal;
+}
@@ -0,0 +1,98 @@
+#ifndef NATIVE_MODEL_HPP_INCLUDED
+#define NATIVE_MODEL_HPP_INCLUDED
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "grid_tools.hpp"
+
+// cpu inference for the conv/pool/dense networks used in the examples,
+// weights are exported from a frozen graph by native_model_export.py
+// tensors are NHWC like in tensorflow, so the flattened points fed to
+// the graph can be used unchanged
+//
+// file format (little endian):
+//   "ARFNET01", uint32 height, width, channels, uint32 number of layers
+//   per layer: uint32 type, relu, a, b, c
+//              uint64 count + float weights, uint64 count + float bias
+//   conv2d:  a, b = kernel height, width, c = filters (same padding,
+//            stride 1, weights [kh][kw][in][out])
+//   maxpool: a = window size = stride (valid padding)
+//   dense:   a = units (weights [in][out])
+//   softmax: no parameters
+class NativeModel
+{
+public:
+    enum class LayerType : std::uint32_t
+    {
+        CONV2D = 1,
+        MAXPOOL = 2,
+        DENSE = 3,
+        SOFTMAX = 4
+    };
+
+    struct Layer
+    {
+        LayerType type;
+        bool relu;
+        std::uint32_t a, b, c;
+        std::vector<float> weights;
+        std::vector<float> bias;
+        // filled in from the previous layer
+        std::uint32_t in_h, in_w, in_c;
+        std::uint32_t out_h, out_w, out_c;
+    };
+
+    explicit NativeModel(std::string const&);
+    NativeModel(
+            std::uint32_t /* height */,
+            std::uint32_t /* width */,
+            std::uint32_t /* channels */,
+            std::vector<Layer> const&);
+
+    bool save(std::string const&) const;
+    inline bool ok() const { return !errorOccurred; }
+    std::size_t inputSize() const;
+    std::size_t outputSize() const;
+
+    // model outputs (softmax probabilities if the model ends in a
+    // softmax), one per point
+    std::vector<grid::point> classify(std::vector<grid::point> const&) const;
+    // same as classify, but the first layer of a point that differs
+    // from the previous base point of the calling thread in a few
+    // coordinates is computed by updating the cached first layer of
+    // the base for the changed coordinates only; a point differing in
+    // more than a quarter of the coordinates becomes the new base
+    std::vector<grid::point> classifyIncremental(
+            std::vector<grid::point> const&) const;
+    // the first layer is a conv2d or dense layer
+    bool supportsIncremental() const;
+    // gradient of the softmax cross entropy between the label and the
+    // outputs before the softmax w.r.t. the input, one per point
+    std::vector<grid::point> gradient(
+            std::vector<grid::point> const&,
+            grid::point const& /* label */) const;
+
+private:
+    std::uint32_t height, width, channels;
+    std::vector<Layer> layers;
+    bool errorOccurred;
+
+    void inferShapes();
+    // runs the points through the layers, activations[i] holds the
+    // input of layer i for the whole batch (activations.back() is the
+    // output), stopping before a final softmax if requested
+    void forward(
+            std::vector<grid::point> const&,
+            std::vector<std::vector<float>>& /* activations */,
+            bool /* include softmax */) const;
+    // runs layers [first, last) on activations[first]
+    void runLayers(
+            std::vector<std::vector<float>>&,
+            std::size_t /* first */,
+            std::size_t /* last */,
+            std::size_t /* batch */) const;
+};
+
+#endif
@@ -3,21 +3,150 @@
 #include <numeric>
 #include <cmath>
 #include <limits>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <unordered_set>
+#include <iterator>
 
 #include "grid_tools.hpp"
 
+namespace
+{
+    // a nonzero N replaces the runtime size, making the trip count of
+    // the kernel loops a constant
+    template <std::size_t N>
+    inline std::size_t tripCount(std::size_t n)
+    {
+        return N == 0u ? n : N;
+    }
+
+    template <std::size_t N>
+    void snapToGridKernel(
+            grid::numeric_type_t* p,
+            grid::numeric_type_t const* referencePoint,
+            grid::numeric_type_t const* granularity,
+            std::size_t n)
+    {
+        const auto count = tripCount<N>(n);
+        for(std::size_t i = 0u; i < count; ++i)
+        {
+            auto multiplier = 
+                round((p[i] - referencePoint[i]) / granularity[i]);
+            p[i] = referencePoint[i] + multiplier*granularity[i];
+        }
+    }
+
+    template <std::size_t N>
+    void snapPointToRangeKernel(
+            grid::numeric_type_t* p,
+            grid::region_element const* range,
+            std::size_t n)
+    {
+        const auto count = tripCount<N>(n);
+        for(std::size_t i = 0u; i < count; ++i)
+            p[i] = std::min(std::max(p[i], range[i].first), range[i].second);
+    }
+
+    template <std::size_t N>
+    void snapRegionToRangeKernel(
+            grid::region_element* r,
+            grid::region_element const* range,
+            std::size_t n)
+    {
+        const auto count = tripCount<N>(n);
+        for(std::size_t i = 0u; i < count; ++i)
+        {
+            if(r[i].first < range[i].first) r[i].first = range[i].first;
+            if(r[i].second < range[i].first) r[i].second = range[i].first;
+            if(r[i].first > range[i].second) r[i].first = range[i].second;
+            if(r[i].second > range[i].second) r[i].second = range[i].second;
+        }
+    }
+
+    // membership tests accumulate without branching so the loops
+    // can be unrolled, points are almost always inside
+    template <std::size_t N>
+    bool pointInRangeKernel(
+            grid::numeric_type_t const* p,
+            grid::region_element const* range,
+            std::size_t n)
+    {
+        const auto count = tripCount<N>(n);
+        bool retVal = true;
+        for(std::size_t i = 0u; i < count; ++i)
+            retVal &= (p[i] >= range[i].first) & (p[i] <= range[i].second);
+        return retVal;
+    }
+
+    template <std::size_t N>
+    bool pointInRegionKernel(
+            grid::numeric_type_t const* p,
+            grid::region_element const* r,
+            std::size_t n)
+    {
+        const auto count = tripCount<N>(n);
+        bool retVal = true;
+        for(std::size_t i = 0u; i < count; ++i)
+            retVal &= (p[i] >= r[i].first) & (p[i] < r[i].second);
+        return retVal;
+    }
+
+    template <std::size_t N>
+    grid::GridKernels makeKernels()
+    {
+        return {N,
+            &snapToGridKernel<N>,
+            &snapPointToRangeKernel<N>,
+            &snapRegionToRangeKernel<N>,
+            &pointInRangeKernel<N>,
+            &pointInRegionKernel<N>};
+    }
+
+    const grid::GridKernels genericKernels = makeKernels<0u>();
+    const grid::GridKernels registeredKernels[] = {
+        makeKernels<28u*28u>(),
+        makeKernels<32u*32u*3u>(),
+        makeKernels<50u*50u*3u>()
+    };
+    grid::GridKernels const* selectedKernels = &genericKernels;
+
+    // salts keeping the streams of strategies that work on the same
+    // region independent of each other
+    enum : std::uint64_t
+    {
+        RANDOM_POINT_STREAM = 1u,
+        RANDOM_DIM_STREAM,
+        FGSM_STREAM,
+        PGD_STREAM,
+        RANDOM_SEARCH_STREAM
+    };
+}
+
+grid::GridKernels const& grid::kernelsFor(std::size_t dims)
+{
+    for(auto&& k : registeredKernels)
+        if(k.dims == dims) return k;
+    return genericKernels;
+}
+
+bool grid::useKernelsFor(std::size_t dims)
+{
+    selectedKernels = &grid::kernelsFor(dims);
+    return selectedKernels->dims != 0u;
+}
+
+grid::GridKernels const& grid::activeKernels(std::size_t dims)
+{
+    return selectedKernels->dims == dims ? *selectedKernels : genericKernels;
+}
+
 grid::region grid::snapToDomainRange(
         grid::region const& r,
         grid::region const& range)
 {
     grid::region retVal(r);
-    for(auto i = 0u; i < r.size(); ++i)
-    {
-        if(retVal[i].first < range[i].first) retVal[i].first = range[i].first;
-        if(retVal[i].second < range[i].first) retVal[i].second = range[i].first;
-        if(retVal[i].first > range[i].second) retVal[i].first = range[i].second;
-        if(retVal[i].second > range[i].second) retVal[i].second = range[i].second;
-    }
+    grid::snapToDomainRangeInPlace(retVal, range);
     return retVal;
 }
 
@@ -26,25 +155,32 @@ grid::point grid::snapToDomainRange(
         grid::region const& r)
 {
     grid::point retVal(p);
-    for(auto i = 0u; i < p.size(); ++i)
-    {
-        if(retVal[i] < r[i].first) retVal[i] = r[i].first;
-        else if(retVal[i] > r[i].second) retVal[i] = r[i].second;
-    }
+    grid::snapToDomainRangeInPlace(retVal, r);
     return retVal;
 }
 
+void grid::snapToDomainRangeInPlace(
+        grid::region& r,
+        grid::region const& range)
+{
+    grid::activeKernels(r.size()).snapRegionToRange(
+            r.data(), range.data(), r.size());
+}
+
+void grid::snapToDomainRangeInPlace(
+        grid::point& p,
+        grid::region const& r)
+{
+    grid::activeKernels(p.size()).snapPointToRange(
+            p.data(), r.data(), p.size());
+}
+
 bool grid::isInDomainRange(
         grid::point const& p, 
         grid::region const& range)
 {
-    for(auto i = 0u; i < p.size(); ++i)
-    {
-        if(p[i] < range[i].first ||
-                p[i] > range[i].second)
-            return false;
-    }
-    return true;
+    return grid::activeKernels(p.size()).pointInRange(
+            p.data(), range.data(), p.size());
 }
 
 bool grid::isInDomainRange(
@@ -67,16 +203,20 @@ grid::point grid::enforceSnapDiscreteGrid(
         grid::point const& referencePoint, 
         grid::point const& granularity)
 {
-    grid::point retVal(p.size());
-    for(auto i = 0u; i < retVal.size(); ++i)
-    {
-        auto multiplier = 
-            round((p[i] - referencePoint[i]) / granularity[i]);
-        retVal[i] = referencePoint[i] + multiplier*granularity[i];
-    }
+    grid::point retVal(p);
+    grid::enforceSnapDiscreteGridInPlace(retVal, referencePoint, granularity);
     return retVal;
 }
 
+void grid::enforceSnapDiscreteGridInPlace(
+        grid::point& p, 
+        grid::point const& referencePoint, 
+        grid::point const& granularity)
+{
+    grid::activeKernels(p.size()).snapToGrid(
+            p.data(), referencePoint.data(), granularity.data(), p.size());
+}
+
 bool grid::isValidRegion(grid::region const & r)
 {
     for(auto&& range : r)
@@ -88,10 +228,8 @@ bool grid::isValidRegion(grid::region const & r)
 
 bool grid::pointIsInRegion(grid::region const& r, grid::point const& p)
 {
-    for(auto i = 0u; i < r.size(); ++i)
-        if(p[i] < r[i].first || p[i] >= r[i].second)
-            return false;
-    return true;
+    return grid::activeKernels(r.size()).pointInRegion(
+            p.data(), r.data(), r.size());
 }
 
 long double grid::regionVolume(grid::region const& r)
@@ -118,7 +256,7 @@ grid::VolumeThresholdFilterStrategy::operator()(grid::region const& r)
 
 grid::RandomPointRegionAbstraction::RandomPointRegionAbstraction(
         unsigned n)
-    : numPoints(n), generator(1029)
+    : numPoints(n)
 {
 }
 
@@ -126,7 +264,7 @@ grid::abstraction_strategy_return_t
 grid::RandomPointRegionAbstraction::operator()(region const& r)
 {
     grid::abstraction_strategy_return_t retVal;
-    //std::default_random_engine generator;
+    grid::RandomStream generator(r, RANDOM_POINT_STREAM);
     for(auto i = 0u; i < numPoints; ++i)
     {
         grid::point tmp(r.size());
@@ -210,6 +348,28 @@ grid::AllValidDiscretizedPointsAbstraction::getNumberValidPoints(
     return getNumberValidPoints(r, knownValidPoint, granularity);
 }
 
+std::vector<unsigned long long> 
+grid::AllValidDiscretizedPointsAbstraction::getNumberValidPointsPerDim(
+        grid::region const& r,// region in question 
+        grid::point const& p, // valid point
+        grid::point const& g) // granularity
+{
+    auto validPointInRegion = findValidPointInRegion(r, p, g);
+    if(!validPointInRegion.first) 
+    {
+        return std::vector<unsigned long long>(r.size(), 0ull);
+    }
+    std::vector<unsigned long long> retVal(r.size(), 1ull);
+    for(auto i = 0u; i < r.size(); ++i)
+    {
+        if(r[i].first == r[i].second) continue;
+        retVal[i] = static_cast<unsigned long long>(
+                ceil((r[i].second - validPointInRegion.second[i])
+                / g[i]));
+    }
+    return retVal;
+}
+
 std::pair<bool, grid::point> 
 grid::AllValidDiscretizedPointsAbstraction::findValidPointInRegion(
         grid::region const& r,
@@ -261,7 +421,22 @@ grid::DiscreteSearchVerificationEngine::DiscreteSearchVerificationEngine(
         std::function<bool(point const&)> const& point_safe)
     : shouldAttemptCheck(shouldAttempt), 
     discretePointGenerator(dpg), 
-    point_safe_func(point_safe)
+    point_safe_func(point_safe),
+    async_point_safe_func(),
+    max_in_flight(0u)
+{
+}
+
+grid::DiscreteSearchVerificationEngine::DiscreteSearchVerificationEngine(
+        std::function<bool(grid::region const&)> const& shouldAttempt,
+        grid::region_abstraction_strategy_t const& dpg,
+        grid::async_point_predicate_t const& point_safe,
+        std::size_t in_flight)
+    : shouldAttemptCheck(shouldAttempt), 
+    discretePointGenerator(dpg), 
+    point_safe_func(),
+    async_point_safe_func(point_safe),
+    max_in_flight(in_flight)
 {
 }
 
@@ -274,6 +449,34 @@ grid::DiscreteSearchVerificationEngine::operator()(
         return {grid::VERIFICATION_RETURN::UNKNOWN, {}};
     }
     auto points = discretePointGenerator(r);
+    if(async_point_safe_func)
+    {
+        auto chunk = max_in_flight > 0u ? max_in_flight : points.size();
+        std::vector<std::future<bool>> safe;
+        safe.reserve(std::min(chunk, points.size()));
+        for(auto begin = 0u; begin < points.size(); begin += chunk)
+        {
+            auto end = std::min(points.size(), begin + chunk);
+            safe.clear();
+            for(auto i = begin; i < end; ++i)
+                safe.push_back(async_point_safe_func(points[i]));
+            for(auto i = begin; i < end; ++i)
+            {
+                try
+                {
+                    if(!safe[i - begin].get())
+                        return {grid::VERIFICATION_RETURN::UNSAFE, points[i]};
+                }
+                catch(std::exception const& e)
+                {
+                    // an error is not a verdict, the region is refined
+                    std::cerr << "Safety query failed: " << e.what() << "\n";
+                    return {grid::VERIFICATION_RETURN::UNKNOWN, {}};
+                }
+            }
+        }
+        return {grid::VERIFICATION_RETURN::SAFE, {}};
+    }
     for(auto&& p : points)
     {
         if(!point_safe_func(p))
@@ -285,8 +488,7 @@ grid::DiscreteSearchVerificationEngine::operator()(
 grid::dim_selection_strategy_return_t
 grid::randomDimSelection(region const& r, std::size_t numDims)
 {
-    static std::minstd_rand0 rd(133);
-    static std::mt19937 g(rd());
+    grid::RandomStream g(r, RANDOM_DIM_STREAM);
     grid::dim_selection_strategy_return_t indices(r.size());
     std::iota(indices.begin(), indices.end(), 0);
     std::shuffle(indices.begin(), indices.end(), g);
@@ -327,7 +529,14 @@ grid::maxAverageDimSelection(grid::region const& r, std::size_t numDims)
 grid::GradientBasedDimensionSelection
     ::GradientBasedDimensionSelection(
             std::function<point(point const&)> const& gradient)
-    : grad(gradient)
+    : grad(gradient), async_grad()
+{
+}
+
+grid::GradientBasedDimensionSelection
+    ::GradientBasedDimensionSelection(
+            grid::async_model_function_t const& gradient)
+    : grad(), async_grad(gradient)
 {
 }
 
@@ -340,7 +549,7 @@ grid::GradientBasedDimensionSelection::operator()(
     auto centralPoint = grid::centralPointRegionAbstraction(r);
     if(centralPoint.empty()) return {};
     auto p = *centralPoint.begin();
-    auto gradient = grad(p);
+    auto gradient = async_grad ? async_grad(p).get() : grad(p);
     for(auto&& elem : gradient)
         elem = std::abs(elem);
     auto indices = getSortedIndices(gradient, false);
@@ -406,12 +615,26 @@ grid::ModifiedFGSMWithFallbackRegionAbstraction::ModifiedFGSMWithFallbackRegionA
         grid::region_abstraction_strategy_t const& fallback_strategy,
         grid::point const& granularity,
         double pFGSM)
-    : maxPoints(mp), gradient(grad), 
+    : maxPoints(mp), gradient(grad), async_gradient(),
+      dim_select_strategy(dim_sel),
+      fallback_strategy(fallback_strategy),
+      granularity(granularity),
+      percentFGSM(std::abs(pFGSM) > 1 ? 1 : std::abs(pFGSM))
+{
+}
+
+grid::ModifiedFGSMWithFallbackRegionAbstraction::ModifiedFGSMWithFallbackRegionAbstraction(
+        std::size_t mp, 
+        grid::async_model_function_t const& grad,
+        grid::dimension_selection_strategy_t const& dim_sel,
+        grid::region_abstraction_strategy_t const& fallback_strategy,
+        grid::point const& granularity,
+        double pFGSM)
+    : maxPoints(mp), gradient(), async_gradient(grad), 
       dim_select_strategy(dim_sel),
       fallback_strategy(fallback_strategy),
       granularity(granularity),
-      percentFGSM(std::abs(pFGSM) > 1 ? 1 : std::abs(pFGSM)),
-      rand_gen(42)
+      percentFGSM(std::abs(pFGSM) > 1 ? 1 : std::abs(pFGSM))
 {
 }
 
@@ -422,7 +645,6 @@ grid::ModifiedFGSMWithFallbackRegionAbstraction::operator()(grid::region const&
     if(centralPointSet.empty()) return {};
 
     auto p = *centralPointSet.begin();
-    auto grad_sign = grid::sign(gradient(p));
 
     auto min_dimension = 
         std::min_element(r.begin(), r.end(),
@@ -439,7 +661,12 @@ grid::ModifiedFGSMWithFallbackRegionAbstraction::operator()(grid::region const&
         return fallback_strategy(r);
     }
 
+    std::future<grid::point> pending_gradient;
+    if(async_gradient)
+        pending_gradient = async_gradient(p);
     auto dims = dim_select_strategy(r, r.size());
+    auto grad_sign = grid::sign(
+            async_gradient ? pending_gradient.get() : gradient(p));
     auto numDimsFGSM = 
         static_cast<unsigned>(
                 percentFGSM * static_cast<double>(r.size()));
@@ -455,7 +682,7 @@ grid::ModifiedFGSMWithFallbackRegionAbstraction::operator()(grid::region const&
     auto e1_upperbound = 
         static_cast<int>(max_radius / granularity[min_dimension_index]);
 
-    //std::default_random_engine rand_gen;
+    grid::RandomStream rand_gen(r, FGSM_STREAM);
     auto dist_R = std::uniform_int_distribution<int>(0,1);
     auto e1_dist = std::uniform_int_distribution<int>(
             e1_lowerbound, e1_upperbound);
@@ -482,6 +709,377 @@ grid::ModifiedFGSMWithFallbackRegionAbstraction::operator()(grid::region const&
     return retVal;
 }
 
+grid::ProjectedGradientRegionAbstraction::ProjectedGradientRegionAbstraction(
+        std::size_t starts,
+        std::size_t steps,
+        grid::batch_gradient_function_t const& grad,
+        grid::point const& vp,
+        grid::point const& gran,
+        double step)
+    : numStarts(starts), numSteps(steps),
+    batch_gradient(grad),
+    knownValidPoint(vp),
+    granularity(std::abs(gran)),
+    stepFraction(std::abs(step))
+{
+}
+
+grid::point grid::projectToGridInRegion(
+        grid::point const& p,
+        grid::region const& r,
+        grid::point const& referencePoint,
+        grid::point const& granularity)
+{
+    auto retVal = grid::enforceSnapDiscreteGrid(
+            p, referencePoint, granularity);
+    for(auto i = 0u; i < retVal.size(); ++i)
+    {
+        // upper bound is exclusive, step back onto the grid inside r
+        while(retVal[i] >= r[i].second && retVal[i] > r[i].first)
+            retVal[i] -= granularity[i];
+        while(retVal[i] < r[i].first)
+            retVal[i] += granularity[i];
+    }
+    return retVal;
+}
+
+grid::abstraction_strategy_return_t
+grid::ProjectedGradientRegionAbstraction::operator()(grid::region const& r)
+{
+    if(r.empty() || numStarts == 0u) return {};
+    if(!AllValidDiscretizedPointsAbstraction::findValidPointInRegion(
+                r, knownValidPoint, granularity).first)
+        return {};
+
+    grid::point stepSize(r.size());
+    for(auto i = 0u; i < r.size(); ++i)
+    {
+        stepSize[i] = std::max<grid::numeric_type_t>(
+                granularity[i],
+                stepFraction * (r[i].second - r[i].first));
+    }
+
+    grid::RandomStream rand_gen(r, PGD_STREAM);
+    std::vector<grid::point> current;
+    current.reserve(numStarts);
+    for(auto i = 0u; i < numStarts; ++i)
+    {
+        grid::point tmp(r.size());
+        for(auto j = 0u; j < r.size(); ++j)
+        {
+            std::uniform_real_distribution<grid::numeric_type_t>
+                dist(r[j].first, r[j].second);
+            tmp[j] = dist(rand_gen);
+        }
+        current.push_back(grid::projectToGridInRegion(
+                    tmp, r, knownValidPoint, granularity));
+    }
+
+    for(auto step = 0u; step < numSteps; ++step)
+    {
+        // all starts share one model run per step
+        auto gradients = batch_gradient(current);
+        if(gradients.size() != current.size()) break;
+        for(auto i = 0u; i < current.size(); ++i)
+        {
+            if(gradients[i].size() != current[i].size()) continue;
+            auto grad_sign = grid::sign(gradients[i]);
+            current[i] = grid::projectToGridInRegion(
+                    current[i] + elementWiseMult(grad_sign, stepSize), 
+                    r, knownValidPoint, granularity);
+        }
+    }
+    return current;
+}
+
+grid::RandomSearchRegionAbstraction::RandomSearchRegionAbstraction(
+        std::size_t chains,
+        std::size_t iterations,
+        grid::batch_model_function_t const& logits,
+        std::size_t orig_cl,
+        grid::point const& vp,
+        grid::point const& gran,
+        double fraction)
+    : numChains(chains), numIterations(iterations),
+    batch_logits(logits),
+    orig_class(orig_cl),
+    knownValidPoint(vp),
+    granularity(std::abs(gran)),
+    initialFraction(std::abs(fraction) > 1 ? 1 : std::abs(fraction))
+{
+}
+
+grid::numeric_type_t 
+grid::RandomSearchRegionAbstraction::margin(
+        grid::point const& logits, 
+        std::size_t orig_class)
+{
+    if(orig_class >= logits.size()) 
+        return std::numeric_limits<grid::numeric_type_t>::lowest();
+    auto other = std::numeric_limits<grid::numeric_type_t>::lowest();
+    for(auto i = 0u; i < logits.size(); ++i)
+        if(i != orig_class && logits[i] > other) other = logits[i];
+    return logits[orig_class] - other;
+}
+
+grid::point 
+grid::RandomSearchRegionAbstraction::randomVertex(
+        grid::region const& r,
+        grid::point const& base,
+        double fraction,
+        grid::RandomStream& rand_gen)
+{
+    auto retVal = base;
+    auto dist_R = std::uniform_int_distribution<int>(0,1);
+    auto dist_p = std::uniform_real_distribution<double>(0.0, 1.0);
+    for(auto i = 0u; i < r.size(); ++i)
+    {
+        if(fraction < 1.0 && dist_p(rand_gen) >= fraction) continue;
+        retVal[i] = dist_R(rand_gen) ? r[i].first : r[i].second;
+    }
+    return grid::projectToGridInRegion(
+            retVal, r, knownValidPoint, granularity);
+}
+
+grid::abstraction_strategy_return_t
+grid::RandomSearchRegionAbstraction::operator()(grid::region const& r)
+{
+    if(r.empty() || numChains == 0u) return {};
+    if(!AllValidDiscretizedPointsAbstraction::findValidPointInRegion(
+                r, knownValidPoint, granularity).first)
+        return {};
+
+    auto center = *grid::centralPointRegionAbstraction(r).begin();
+    grid::RandomStream rand_gen(r, RANDOM_SEARCH_STREAM);
+    std::vector<grid::point> current;
+    current.reserve(numChains);
+    for(auto i = 0u; i < numChains; ++i)
+        current.push_back(randomVertex(r, center, 1.0, rand_gen));
+
+    auto logits = batch_logits(current);
+    if(logits.size() != current.size()) return current;
+    std::vector<grid::numeric_type_t> margins(current.size());
+    for(auto i = 0u; i < current.size(); ++i)
+        margins[i] = margin(logits[i], orig_class);
+
+    grid::abstraction_strategy_return_t retVal;
+    for(auto iter = 0u; iter < numIterations; ++iter)
+    {
+        // shrink the perturbed fraction as the search progresses
+        auto fraction = initialFraction * 
+            (1.0 - static_cast<double>(iter) / 
+             static_cast<double>(numIterations));
+        std::vector<grid::point> candidates;
+        candidates.reserve(current.size());
+        for(auto&& p : current)
+            candidates.push_back(randomVertex(r, p, fraction, rand_gen));
+        auto candidate_logits = batch_logits(candidates);
+        if(candidate_logits.size() != candidates.size()) break;
+        for(auto i = 0u; i < candidates.size(); ++i)
+        {
+            auto m = margin(candidate_logits[i], orig_class);
+            // adversarial candidates are kept even if a chain
+            // moves on from them
+            if(m < 0) retVal.push_back(candidates[i]);
+            if(m < margins[i])
+            {
+                margins[i] = m;
+                current[i] = std::move(candidates[i]);
+            }
+        }
+    }
+    std::copy(current.begin(), current.end(), std::back_inserter(retVal));
+    return retVal;
+}
+
+const std::size_t grid::AdaptiveAbstractionStrategy::maxFactor = 4u;
+
+struct grid::AdaptiveAbstractionStrategy::SharedState
+{
+    SharedState(
+            std::vector<std::pair<std::string, 
+                grid::budgeted_abstraction_strategy_t>> const& a,
+            std::size_t base,
+            double reference,
+            grid::point const& vp,
+            grid::point const& gran)
+        : arms(a), basePoints(std::max<std::size_t>(1u, base)), 
+        referenceMargin(reference), hash(vp, gran),
+        mutex(), stats(), totalCalls(0u), 
+        pendingPoints(), hotRegions(), parentMargin()
+    {
+        for(auto&& arm : arms)
+            stats.push_back({arm.first, 0u, 0u, 0u});
+    }
+
+    // bounds on the bookkeeping, points dropped by the framework
+    // (duplicates, outside the region) and regions verified without
+    // abstraction never get feedback
+    static const std::size_t pendingCap = 1u << 20;
+    static const std::size_t regionCap = 1u << 16;
+
+    std::vector<std::pair<std::string, 
+        grid::budgeted_abstraction_strategy_t>> arms;
+    std::size_t basePoints;
+    double referenceMargin;
+    grid::LatticeHash hash;
+    std::mutex mutex;
+    std::vector<ArmStats> stats;
+    unsigned long long totalCalls;
+    struct pending_point
+    {
+        std::size_t arm;
+        // NaN until the point is classified
+        double margin;
+    };
+    // lattice hash of a generated point -> arm that generated it
+    std::unordered_map<std::uint64_t, pending_point> pendingPoints;
+    // regions with a sibling that held an adversarial example
+    std::unordered_set<std::uint64_t> hotRegions;
+    // regions -> smallest margin of the safe points of their parent
+    std::unordered_map<std::uint64_t, double> parentMargin;
+};
+
+grid::AdaptiveAbstractionStrategy::AdaptiveAbstractionStrategy(
+        std::vector<std::pair<std::string, 
+            grid::budgeted_abstraction_strategy_t>> const& arms,
+        std::size_t base,
+        double reference,
+        grid::point const& vp,
+        grid::point const& gran)
+    : shared(std::make_shared<SharedState>(arms, base, reference, vp, gran))
+{
+}
+
+std::size_t grid::AdaptiveAbstractionStrategy::budgetFor(grid::region const& r)
+{
+    auto& state = *shared;
+    auto key = state.hash(r);
+    std::lock_guard<std::mutex> lock(state.mutex);
+    auto maxPoints = state.basePoints * maxFactor;
+    if(state.hotRegions.erase(key) > 0u) 
+        return maxPoints;
+    auto margin = state.parentMargin.find(key);
+    if(state.parentMargin.end() == margin || 
+            !(state.referenceMargin > 0.0))
+        return state.basePoints;
+    auto relative = std::max(0.0, margin->second / state.referenceMargin);
+    auto budget = state.basePoints / (maxFactor * relative);
+    // at least one point so every region keeps feeding the arms
+    if(!(budget < maxPoints)) return maxPoints;
+    return std::max<std::size_t>(1u, 
+            static_cast<std::size_t>(std::ceil(budget)));
+}
+
+std::size_t grid::AdaptiveAbstractionStrategy::chooseArm()
+{
+    auto& state = *shared;
+    std::lock_guard<std::mutex> lock(state.mutex);
+    ++state.totalCalls;
+    auto best = 0u;
+    auto bestScore = std::numeric_limits<long double>::lowest();
+    for(auto i = 0u; i < state.stats.size(); ++i)
+    {
+        auto const& arm = state.stats[i];
+        if(arm.calls == 0u)
+        {
+            best = i;
+            break;
+        }
+        long double rate = arm.points > 0u 
+            ? static_cast<long double>(arm.unsafe) / arm.points : 0;
+        auto score = rate + std::sqrt(
+                2 * std::log(static_cast<long double>(state.totalCalls)) / 
+                arm.calls);
+        if(score > bestScore)
+        {
+            bestScore = score;
+            best = i;
+        }
+    }
+    ++state.stats[best].calls;
+    return best;
+}
+
+grid::abstraction_strategy_return_t
+grid::AdaptiveAbstractionStrategy::operator()(grid::region const& r)
+{
+    auto& state = *shared;
+    if(state.arms.empty()) return {};
+    auto budget = budgetFor(r);
+    auto arm = chooseArm();
+    auto retVal = state.arms[arm].second(r, budget);
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if(state.pendingPoints.size() + retVal.size() > SharedState::pendingCap)
+        state.pendingPoints.clear();
+    for(auto&& pt : retVal)
+        state.pendingPoints[state.hash(pt)] = 
+            {arm, std::numeric_limits<double>::quiet_NaN()};
+    return retVal;
+}
+
+void grid::AdaptiveAbstractionStrategy::recordMargins(
+        std::vector<grid::point> const& points,
+        std::vector<double> const& margins)
+{
+    auto& state = *shared;
+    std::lock_guard<std::mutex> lock(state.mutex);
+    for(auto i = 0u; i < points.size() && i < margins.size(); ++i)
+    {
+        auto found = state.pendingPoints.find(state.hash(points[i]));
+        if(state.pendingPoints.end() != found)
+            found->second.margin = margins[i];
+    }
+}
+
+void grid::AdaptiveAbstractionStrategy::feedback(
+        grid::region const& refined,
+        std::vector<grid::point> const& points,
+        std::vector<bool> const& safe,
+        std::set<grid::region, grid::region_less_compare> const& siblings)
+{
+    auto& state = *shared;
+    auto anyUnsafe = false;
+    auto smallestMargin = std::numeric_limits<double>::infinity();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    for(auto i = 0u; i < points.size() && i < safe.size(); ++i)
+    {
+        anyUnsafe = anyUnsafe || !safe[i];
+        auto found = state.pendingPoints.find(state.hash(points[i]));
+        if(state.pendingPoints.end() == found) continue;
+        auto& arm = state.stats[found->second.arm];
+        ++arm.points;
+        if(!safe[i]) ++arm.unsafe;
+        // a NaN margin (not recorded) leaves the smallest one unchanged
+        if(safe[i] && found->second.margin < smallestMargin)
+            smallestMargin = found->second.margin;
+        state.pendingPoints.erase(found);
+    }
+    // the refined region was abstracted for the last time
+    state.parentMargin.erase(state.hash(refined));
+    if(state.hotRegions.size() + state.parentMargin.size() + 
+            siblings.size() > SharedState::regionCap)
+    {
+        state.hotRegions.clear();
+        state.parentMargin.clear();
+    }
+    for(auto&& sibling : siblings)
+    {
+        if(anyUnsafe)
+            state.hotRegions.insert(state.hash(sibling));
+        // without a margin the region tells nothing about its children
+        else if(smallestMargin < std::numeric_limits<double>::infinity())
+            state.parentMargin[state.hash(sibling)] = smallestMargin;
+    }
+}
+
+std::vector<grid::AdaptiveAbstractionStrategy::ArmStats>
+grid::AdaptiveAbstractionStrategy::stats() const
+{
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    return shared->stats;
+}
+
 grid::HierarchicalDimensionRefinementStrategy::HierarchicalDimensionRefinementStrategy(
         grid::dimension_selection_strategy_t const& dim_select,
         unsigned divisor,
@@ -493,14 +1091,32 @@ grid::HierarchicalDimensionRefinementStrategy::HierarchicalDimensionRefinementSt
 grid::refinement_strategy_return_t
 grid::HierarchicalDimensionRefinementStrategy::operator()(grid::region const& r)
 {
-    auto dims = dim_select_strategy(r, numDims);
+    return refine(r, dim_divisor, numDims);
+}
+
+grid::refinement_strategy_return_t
+grid::HierarchicalDimensionRefinementStrategy::refine(
+        grid::region const& r,
+        unsigned divisor,
+        unsigned ndims)
+{
+    auto dims = dim_select_strategy(r, ndims);
+    return refine(r, dims, std::vector<unsigned>(dims.size(), divisor));
+}
+
+grid::refinement_strategy_return_t
+grid::HierarchicalDimensionRefinementStrategy::refine(
+        grid::region const& r,
+        grid::dim_selection_strategy_return_t const& dims,
+        std::vector<unsigned> const& divisors)
+{
     grid::refinement_strategy_return_t retVal;
     auto firstRegion = r;
     for(auto i = 0u; i < dims.size(); ++i)
     {
         auto curIndex = dims[i];
         auto sizeIncrement = (r[curIndex].second - r[curIndex].first)
-            / (grid::numeric_type_t)dim_divisor;
+            / (grid::numeric_type_t)divisors[i];
         firstRegion[curIndex].second = firstRegion[curIndex].first + sizeIncrement;
     }
     enumerateAllRegions(retVal, firstRegion, 0, dims, r);
@@ -530,6 +1146,433 @@ grid::HierarchicalDimensionRefinementStrategy::enumerateAllRegions(
     return false;
 }
 
+grid::AdaptiveDimensionRefinementStrategy::AdaptiveDimensionRefinementStrategy(
+        grid::dimension_selection_strategy_t const& dim_select,
+        grid::point const& vp,
+        grid::point const& gran,
+        unsigned long long target,
+        unsigned long long max_children,
+        grid::RefinementCostModel const& cost)
+    : dim_select_strategy(dim_select),
+    hierarchical(dim_select, 2u, 1u),
+    knownValidPoint(vp),
+    granularity(std::abs(gran)),
+    targetPoints(target < 1ull ? 1ull : target),
+    childBudget(max_children < 2ull ? 2ull : max_children)
+{
+    // creating a child costs regionCost before any of its points are
+    // classified, so only allow as many children per refinement as the
+    // model could classify target points in the same amount of time
+    if(cost.pointCost > 0 && cost.regionCost > 0)
+    {
+        auto affordable = static_cast<long double>(targetPoints)
+            * cost.pointCost / cost.regionCost;
+        if(affordable < static_cast<long double>(childBudget))
+            childBudget = affordable < 2 
+                ? 2ull : static_cast<unsigned long long>(affordable);
+    }
+}
+
+grid::AdaptiveDimensionRefinementStrategy::refinement_plan
+grid::AdaptiveDimensionRefinementStrategy::planRefinement(
+        grid::region const& r) const
+{
+    refinement_plan plan{2u, {}, {}};
+    auto counts = AllValidDiscretizedPointsAbstraction
+        ::getNumberValidPointsPerDim(r, knownValidPoint, granularity);
+    // the selection strategies return a prefix of one ordering of the
+    // dimensions, so a single query ranks all of them, dimensions
+    // with a single valid point cannot be split and are skipped
+    grid::dim_selection_strategy_return_t order;
+    for(auto&& dim : dim_select_strategy(r, r.size()))
+        if(dim < counts.size() && counts[dim] > 1ull)
+            order.push_back(dim);
+    if(order.empty()) return plan;
+
+    // work in log space, the number of valid points in a region
+    // easily exceeds the range of any integer type
+    long double logPoints = 0;
+    for(auto&& c : counts)
+        if(c > 1ull) logPoints += std::log((long double)c);
+    auto needed = logPoints - std::log((long double)targetPoints);
+    if(needed <= 0) return plan;
+
+    // a dimension is split into at most as many parts as it has
+    // valid points, more would only create empty children
+    auto maxCount = 0ull;
+    for(auto&& dim : order)
+        maxCount = std::max(maxCount, counts[dim]);
+    auto capped = [&](unsigned long long d, std::size_t dim)
+    {
+        return std::min(d, counts[dim]);
+    };
+    std::size_t bestDims = 0u;
+    long double bestReduction = -1;
+    unsigned long long bestChildren = 0ull;
+    bool reachesTarget = false;
+    auto maxDivisor = std::min(childBudget, maxCount);
+    for(auto d = 2ull; d <= maxDivisor; ++d)
+    {
+        long double reduction = 0;
+        unsigned long long children = 1ull;
+        for(auto k = 0u; k < order.size(); ++k)
+        {
+            auto parts = capped(d, order[k]);
+            if(children > childBudget / parts) break;
+            children *= parts;
+            auto remaining = (counts[order[k]] + parts - 1ull) / parts;
+            reduction += std::log((long double)counts[order[k]] / remaining);
+            auto candidateReaches = reduction >= needed;
+            auto better = false;
+            if(candidateReaches)
+                better = !reachesTarget || children < bestChildren;
+            else if(!reachesTarget)
+                better = reduction > bestReduction ||
+                    (reduction == bestReduction && children < bestChildren);
+            if(better)
+            {
+                plan.divisor = static_cast<unsigned>(d);
+                bestDims = k + 1u;
+                bestReduction = reduction;
+                bestChildren = children;
+                reachesTarget = candidateReaches;
+            }
+            if(candidateReaches) break;
+        }
+    }
+    plan.dims.assign(order.begin(), order.begin() + bestDims);
+    for(auto&& dim : plan.dims)
+        plan.divisors.push_back(
+                static_cast<unsigned>(capped(plan.divisor, dim)));
+    return plan;
+}
+
+std::pair<unsigned, unsigned>
+grid::AdaptiveDimensionRefinementStrategy::chooseRefinement(
+        grid::region const& r) const
+{
+    auto plan = planRefinement(r);
+    if(plan.dims.empty()) return {2u, 1u};
+    return {plan.divisor, static_cast<unsigned>(plan.dims.size())};
+}
+
+grid::refinement_strategy_return_t
+grid::AdaptiveDimensionRefinementStrategy::operator()(grid::region const& r)
+{
+    auto plan = planRefinement(r);
+    if(plan.dims.empty())
+        return hierarchical.refine(r, 2u, 1u);
+    return hierarchical.refine(r, plan.dims, plan.divisors);
+}
+
+namespace
+{
+    // combines a value into the hash and mixes the bits with the
+    // splitmix64 finalizer
+    std::uint64_t mixHash(std::uint64_t h, std::int64_t value)
+    {
+        h ^= static_cast<std::uint64_t>(value) + 0x9e3779b97f4a7c15ull 
+            + (h << 6) + (h >> 2);
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ull;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebull;
+        h ^= h >> 31;
+        return h;
+    }
+
+    std::atomic<std::uint64_t> runSeed(0u);
+
+    // exact bits of a bound, regions are told apart by their bounds
+    // rather than by their lattice coordinates
+    std::int64_t boundBits(grid::numeric_type_t value)
+    {
+        auto d = static_cast<double>(value);
+        std::int64_t retVal;
+        std::memcpy(&retVal, &d, sizeof(retVal));
+        return retVal;
+    }
+}
+
+void grid::setRandomSeed(std::uint64_t seed)
+{
+    runSeed = seed;
+}
+
+std::uint64_t grid::randomSeed()
+{
+    return runSeed;
+}
+
+grid::RandomStream::RandomStream(std::uint64_t k)
+    : key(mixHash(runSeed, static_cast<std::int64_t>(k))), counter(0u)
+{
+}
+
+grid::RandomStream::RandomStream(grid::region const& r, std::uint64_t salt)
+    : key(0u), counter(0u)
+{
+    std::uint64_t h = mixHash(runSeed, static_cast<std::int64_t>(salt));
+    h = mixHash(h, static_cast<std::int64_t>(r.size()));
+    for(auto&& elem : r)
+    {
+        h = mixHash(h, boundBits(elem.first));
+        h = mixHash(h, boundBits(elem.second));
+    }
+    key = h;
+}
+
+grid::RandomStream::result_type grid::RandomStream::operator()()
+{
+    auto z = key + (++counter) * 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+grid::LatticeHash::LatticeHash(
+        grid::point const& vp,
+        grid::point const& gran)
+    : knownValidPoint(vp),
+    granularity(std::abs(gran))
+{
+}
+
+std::uint64_t grid::LatticeHash::operator()(grid::point const& p) const
+{
+    std::uint64_t retVal = p.size();
+    for(auto i = 0u; i < p.size() && i < granularity.size(); ++i)
+        retVal = mixHash(retVal, std::llround(
+                    (p[i] - knownValidPoint[i]) / granularity[i]));
+    return retVal;
+}
+
+std::uint64_t grid::LatticeHash::operator()(grid::region const& r) const
+{
+    std::uint64_t retVal = ~static_cast<std::uint64_t>(r.size());
+    for(auto i = 0u; i < r.size() && i < granularity.size(); ++i)
+    {
+        retVal = mixHash(retVal, std::llround(
+                    (r[i].first - knownValidPoint[i]) / granularity[i]));
+        retVal = mixHash(retVal, std::llround(
+                    (r[i].second - knownValidPoint[i]) / granularity[i]));
+    }
+    return retVal;
+}
+
+const std::size_t grid::SafeRegionStore::no_parent = 
+    std::numeric_limits<std::size_t>::max();
+
+grid::SafeRegionStore::SafeRegionStore(
+        grid::point const& vp,
+        grid::point const& gran)
+    : knownValidPoint(vp),
+    granularity(std::abs(gran)),
+    nextId(0u),
+    numStored(0u),
+    totalPoints(0),
+    totalVolume(0),
+    nodes(),
+    pendingChildren(),
+    rootSafe()
+{
+}
+
+grid::SafeRegionStore::lattice_box 
+grid::SafeRegionStore::toLatticeBox(grid::region const& r) const
+{
+    lattice_box retVal(r.size());
+    for(auto i = 0u; i < r.size(); ++i)
+    {
+        auto lower = ceil((r[i].first - knownValidPoint[i]) / granularity[i]);
+        auto upper = ceil((r[i].second - knownValidPoint[i]) / granularity[i]);
+        // a degenerate dimension holds a single point if it lies on
+        // the grid (same convention as findValidPointInRegion)
+        if(r[i].first == r[i].second)
+        {
+            auto value = knownValidPoint[i] + lower*granularity[i];
+            upper = value == r[i].first ? lower + 1 : lower;
+        }
+        retVal[i] = {static_cast<std::int32_t>(lower),
+            static_cast<std::int32_t>(upper)};
+    }
+    return retVal;
+}
+
+grid::region 
+grid::SafeRegionStore::toRegion(lattice_box const& b) const
+{
+    grid::region retVal(b.size());
+    for(auto i = 0u; i < b.size(); ++i)
+    {
+        retVal[i] = {
+            knownValidPoint[i] + b[i].first*granularity[i],
+            knownValidPoint[i] + b[i].second*granularity[i]};
+    }
+    return retVal;
+}
+
+long double 
+grid::SafeRegionStore::latticePoints(lattice_box const& b) const
+{
+    if(isEmpty(b)) return 0;
+    long double retVal = 1;
+    for(auto&& dim : b)
+        retVal *= dim.second - dim.first;
+    return retVal;
+}
+
+long double 
+grid::SafeRegionStore::latticePoints(grid::region const& r) const
+{
+    return latticePoints(toLatticeBox(r));
+}
+
+bool grid::SafeRegionStore::isEmpty(lattice_box const& b)
+{
+    for(auto&& dim : b)
+        if(dim.second <= dim.first) return true;
+    return false;
+}
+
+std::uint64_t grid::SafeRegionStore::boxHash(lattice_box const& b)
+{
+    std::uint64_t retVal = b.size();
+    for(auto&& dim : b)
+    {
+        retVal = mixHash(retVal, dim.first);
+        retVal = mixHash(retVal, dim.second);
+    }
+    return retVal;
+}
+
+void grid::SafeRegionStore::addRefinement(
+        grid::region const& parent,
+        grid::refinement_strategy_return_t const& children)
+{
+    auto parentBox = toLatticeBox(parent);
+    if(isEmpty(parentBox)) return;
+    auto grandparent = no_parent;
+    auto found = pendingChildren.find(boxHash(parentBox));
+    if(pendingChildren.end() != found)
+    {
+        grandparent = found->second;
+        pendingChildren.erase(found);
+    }
+    auto id = nextId++;
+    auto& n = nodes[id];
+    n.box = parentBox;
+    n.parent = grandparent;
+    n.pending = 0u;
+    n.blocked = false;
+    for(auto&& child : children)
+    {
+        auto childBox = toLatticeBox(child);
+        // empty children are never verified, they are trivially safe
+        if(isEmpty(childBox)) continue;
+        if(pendingChildren.insert({boxHash(childBox), id}).second)
+            ++n.pending;
+    }
+    if(n.pending == 0u)
+    {
+        nodes.erase(id);
+        if(no_parent == grandparent) return;
+        settle(grandparent, parentBox);
+    }
+}
+
+void grid::SafeRegionStore::insert(grid::region const& r)
+{
+    auto box = toLatticeBox(r);
+    if(isEmpty(box)) return;
+    auto points = latticePoints(box);
+    totalPoints += points;
+    auto volume = points;
+    for(auto&& g : granularity) volume *= g;
+    totalVolume += volume;
+    auto found = pendingChildren.find(boxHash(box));
+    if(pendingChildren.end() == found)
+    {
+        rootSafe.push_back(box);
+        ++numStored;
+        return;
+    }
+    auto id = found->second;
+    pendingChildren.erase(found);
+    settle(id, box);
+}
+
+void grid::SafeRegionStore::remove(grid::region const& r)
+{
+    auto found = pendingChildren.find(boxHash(toLatticeBox(r)));
+    if(pendingChildren.end() == found) return;
+    auto id = found->second;
+    pendingChildren.erase(found);
+    abandon(id);
+}
+
+std::uint64_t grid::SafeRegionStore::detach(grid::region const& r)
+{
+    auto found = pendingChildren.find(boxHash(toLatticeBox(r)));
+    if(pendingChildren.end() == found) return no_parent;
+    auto id = found->second;
+    pendingChildren.erase(found);
+    return id;
+}
+
+void grid::SafeRegionStore::attach(grid::region const& r, std::uint64_t id)
+{
+    if(no_parent == id || nodes.end() == nodes.find(id)) return;
+    pendingChildren.insert({boxHash(toLatticeBox(r)), id});
+}
+
+void grid::SafeRegionStore::settle(std::size_t id, lattice_box const& box)
+{
+    auto n = nodes.find(id);
+    if(nodes.end() == n) return;
+    n->second.safeChildren.push_back(box);
+    ++numStored;
+    childDone(id);
+}
+
+void grid::SafeRegionStore::abandon(std::size_t id)
+{
+    auto n = nodes.find(id);
+    if(nodes.end() == n) return;
+    n->second.blocked = true;
+    childDone(id);
+}
+
+void grid::SafeRegionStore::childDone(std::size_t id)
+{
+    auto n = nodes.find(id);
+    if(nodes.end() == n) return;
+    if(n->second.pending > 0u) --n->second.pending;
+    if(n->second.pending > 0u) return;
+    auto grandparent = n->second.parent;
+    if(n->second.blocked)
+    {
+        // keep the safe children, the parent can not replace them
+        std::move(n->second.safeChildren.begin(), 
+                n->second.safeChildren.end(),
+                std::back_inserter(rootSafe));
+        nodes.erase(n);
+        if(no_parent != grandparent) abandon(grandparent);
+        return;
+    }
+    // every child of the partition is safe, replace them with the parent
+    numStored -= n->second.safeChildren.size();
+    auto parentBox = std::move(n->second.box);
+    nodes.erase(n);
+    if(no_parent == grandparent)
+    {
+        rootSafe.push_back(parentBox);
+        ++numStored;
+        return;
+    }
+    settle(grandparent, parentBox);
+}
+
 bool operator<(grid::point const& p, grid::region const& r)
 {
     for(auto i = 0u; i < p.size(); ++i)
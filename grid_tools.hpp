@@ -7,6 +7,12 @@
 #include <utility>
 #include <ostream>
 #include <functional>
+#include <future>
+#include <map>
+#include <unordered_map>
+#include <cstdint>
+#include <memory>
+#include <string>
 
 namespace grid
 {
@@ -68,6 +74,49 @@ namespace grid
     using verification_engine_type_t = 
         std::function<verification_engine_return_t(region const&)>;
 
+    // single point model queries answered asynchronously (for example
+    // by a thread_tool::QueryCoalescer batching the queries of all
+    // threads), so a strategy can issue its independent queries before
+    // waiting on the first result
+    using async_model_function_t = 
+        std::function<std::future<point>(point const&)>;
+    using async_point_predicate_t = 
+        std::function<std::future<bool>(point const&)>;
+
+    // innermost point and region loops compiled for a fixed number of
+    // dimensions (dims), so their trip count is a compile time constant
+    // that can be unrolled. dims == 0 is the generic version taking the
+    // size at runtime. the functions below (snapping, range and region
+    // membership) run through the kernels selected by useKernelsFor
+    struct GridKernels
+    {
+        std::size_t dims;
+        void (*snapToGrid)(
+                numeric_type_t* /* point */,
+                numeric_type_t const* /* referencePoint */,
+                numeric_type_t const* /* granularity */,
+                std::size_t);
+        void (*snapPointToRange)(
+                numeric_type_t*, region_element const*, std::size_t);
+        void (*snapRegionToRange)(
+                region_element*, region_element const*, std::size_t);
+        // closed range
+        bool (*pointInRange)(
+                numeric_type_t const*, region_element const*, std::size_t);
+        // upper bounds exclusive
+        bool (*pointInRegion)(
+                numeric_type_t const*, region_element const*, std::size_t);
+    };
+
+    // kernels instantiated for the registered input sizes (mnist 28x28,
+    // cifar10 32x32x3, gtsrb 50x50x3), generic kernels otherwise
+    GridKernels const& kernelsFor(std::size_t /* dims */);
+    // selects the kernels for the input size, returns false if the
+    // generic kernels are used. must be called before workers start
+    bool useKernelsFor(std::size_t /* dims */);
+    // the selected kernels if they match the size, else the generic ones
+    GridKernels const& activeKernels(std::size_t /* dims */);
+
     region
     snapToDomainRange(
             region const&, /* region */
@@ -78,6 +127,15 @@ namespace grid
             point const&, /* point */
             region const& /* domain range */);
 
+    // in place versions of snapToDomainRange and enforceSnapDiscreteGrid
+    // for callers that own the region or point, no allocation
+    void snapToDomainRangeInPlace(region&, region const& /* domain range */);
+    void snapToDomainRangeInPlace(point&, region const& /* domain range */);
+    void enforceSnapDiscreteGridInPlace(
+            point& /* p */,
+            point const& /* referencePoint */,
+            point const& /* granularity */);
+
     bool isInDomainRange(point const&, region const&);
     bool isInDomainRange(region const&, region const&);
 
@@ -104,12 +162,34 @@ namespace grid
         bool operator()(region const&);
     };
 
+    // counter based random numbers (splitmix64 of a key and a counter)
+    // a stream only depends on the run seed and the key it was created
+    // with, strategies draw from a stream keyed by the region they work
+    // on so their points do not depend on the thread running them or on
+    // the order regions are processed in
+    struct RandomStream
+    {
+        using result_type = std::uint64_t;
+        explicit RandomStream(std::uint64_t /* key */);
+        RandomStream(region const&, std::uint64_t /* salt */);
+        static constexpr result_type min() { return 0u; }
+        static constexpr result_type max() { return ~result_type(0u); }
+        result_type operator()();
+    private:
+        std::uint64_t key;
+        std::uint64_t counter;
+    };
+
+    // seed every stream is derived from (0 unless set), must be set
+    // before any worker is started
+    void setRandomSeed(std::uint64_t);
+    std::uint64_t randomSeed();
+
     struct RandomPointRegionAbstraction
     {
         explicit RandomPointRegionAbstraction(unsigned);
         abstraction_strategy_return_t operator()(region const&);
         unsigned numPoints;
-        std::minstd_rand0 generator;
     };
 
     // abstracts a region to the central point
@@ -131,6 +211,12 @@ namespace grid
                 grid::point const&,
                 grid::point const&);
         unsigned long long getNumberValidPoints(grid::region const&);
+        // number of valid points along each dimension of a region
+        // (the total is the product of these counts)
+        static std::vector<unsigned long long> getNumberValidPointsPerDim(
+                grid::region const&,
+                grid::point const&,
+                grid::point const&);
         static std::pair<bool, grid::point> findValidPointInRegion(
                 grid::region const&, 
                 grid::point const&,
@@ -153,11 +239,22 @@ namespace grid
                 std::function<bool(region const&)> const& /* should attempt? */,
                 region_abstraction_strategy_t const& /* point generation */,
                 std::function<bool(point const&)> const& /* is point safe */);
+        // up to max_in_flight points of a region (0 for all of them) are
+        // queried before any result is awaited, so an unsafe point leaves
+        // at most that many queries running. a query that fails (its
+        // future holds an exception) makes the result UNKNOWN
+        DiscreteSearchVerificationEngine(
+                std::function<bool(region const&)> const& /* should attempt? */,
+                region_abstraction_strategy_t const& /* point generation */,
+                async_point_predicate_t const& /* is point safe */,
+                std::size_t /* max_in_flight */ = 0u);
         verification_engine_return_t operator()(region const&);
     private:
         std::function<bool(region const&)> shouldAttemptCheck;
         region_abstraction_strategy_t discretePointGenerator;
         std::function<bool(point const&)> point_safe_func;
+        async_point_predicate_t async_point_safe_func;
+        std::size_t max_in_flight;
     };
 
     // random dimension selection algorithm
@@ -176,10 +273,13 @@ namespace grid
     public:
         GradientBasedDimensionSelection(
                 std::function<point(point const&)> const& /*gradient*/);
+        GradientBasedDimensionSelection(
+                async_model_function_t const& /*gradient*/);
         dim_selection_strategy_return_t operator()(
                 region const&, std::size_t);
     private:
         std::function<point(point const&)> grad;
+        async_model_function_t async_grad;
     };
 
     numeric_type_t l2norm(point const&);
@@ -210,15 +310,151 @@ namespace grid
                 region_abstraction_strategy_t const&,
                 point const&,
                 double /* percent of dimensions for normal FGSM */);
+        // the gradient at the central point is queried before the
+        // dimensions are selected, so a gradient based dimension
+        // selection can share its model run
+        ModifiedFGSMWithFallbackRegionAbstraction(
+                std::size_t /* number of points to generate */, 
+                async_model_function_t const& /* gradient */,
+                dimension_selection_strategy_t const&,
+                region_abstraction_strategy_t const&,
+                point const&,
+                double /* percent of dimensions for normal FGSM */);
         abstraction_strategy_return_t operator()(region const&);
     private:
         std::size_t maxPoints;
         std::function<point(point const&)> gradient;
+        async_model_function_t async_gradient;
         dimension_selection_strategy_t dim_select_strategy;
         region_abstraction_strategy_t fallback_strategy;
         const point granularity;
         double percentFGSM;
-        std::minstd_rand0 rand_gen;
+    };
+
+    // model outputs (logits, gradients) of a batch of points
+    // computed in a single model run
+    using batch_model_function_t = 
+        std::function<std::vector<point>(std::vector<point> const&)>;
+    using batch_gradient_function_t = batch_model_function_t;
+
+    // snaps a point to the discrete grid and moves it onto the
+    // nearest grid point inside the region (upper bounds exclusive)
+    point projectToGridInRegion(
+            point const&,
+            region const&,
+            point const& /* referencePoint */,
+            point const& /* granularity */);
+
+    // projected gradient descent (ascent on the loss) from a batch of
+    // random starts, each step is projected back into the region and
+    // snapped to the discrete grid
+    struct ProjectedGradientRegionAbstraction
+    {
+        ProjectedGradientRegionAbstraction(
+                std::size_t /* number of random starts */,
+                std::size_t /* number of steps */,
+                batch_gradient_function_t const&,
+                point const& /* knownValidPoint */,
+                point const& /* granularity */,
+                double /* step size as a fraction of each dimension */);
+        abstraction_strategy_return_t operator()(region const&);
+    private:
+        std::size_t numStarts;
+        std::size_t numSteps;
+        batch_gradient_function_t batch_gradient;
+        const point knownValidPoint;
+        const point granularity;
+        double stepFraction;
+    };
+
+    // gradient free random search (in the style of the square attack)
+    // using only the model output. a batch of chains start at random
+    // vertices of the region, every iteration each chain moves a random
+    // subset of dimensions to the region bounds and keeps the move if
+    // the margin of the original class decreases. the candidates of all
+    // chains are classified in one model run per iteration
+    struct RandomSearchRegionAbstraction
+    {
+        RandomSearchRegionAbstraction(
+                std::size_t /* number of chains */,
+                std::size_t /* number of iterations */,
+                batch_model_function_t const& /* batch logits */,
+                std::size_t /* original class */,
+                point const& /* knownValidPoint */,
+                point const& /* granularity */,
+                double /* initial fraction of dimensions perturbed */);
+        abstraction_strategy_return_t operator()(region const&);
+        // logit of the original class minus the largest other logit
+        static numeric_type_t margin(point const&, std::size_t);
+    private:
+        point randomVertex(
+                region const&, point const&, double, RandomStream&);
+        std::size_t numChains;
+        std::size_t numIterations;
+        batch_model_function_t batch_logits;
+        std::size_t orig_class;
+        const point knownValidPoint;
+        const point granularity;
+        double initialFraction;
+    };
+
+    // abstraction strategy generating a given number of points
+    using budgeted_abstraction_strategy_t =
+        std::function<abstraction_strategy_return_t(
+                region const&, std::size_t)>;
+
+    // picks one of several abstraction strategies (arms) per region with
+    // the UCB1 rule on the fraction of their points that turned out
+    // unsafe, and scales the number of points per region from the
+    // points already classified (no model queries of its own):
+    // regions whose siblings held an adversarial example get maxFactor
+    // times the base number of points, the children of a region whose
+    // points were all safe get base / (maxFactor * m) points, where m is
+    // the smallest logit margin (largest minus second largest output)
+    // of those points relative to the margin of the original input,
+    // clamped to [1, maxFactor * base]. so regions close to the decision
+    // boundary are sampled more densely and confident ones less.
+    // margins are recorded by the safety queries with recordMargins and
+    // the classification results come back through feedback(), copies
+    // share their statistics
+    struct AdaptiveAbstractionStrategy
+    {
+        struct ArmStats
+        {
+            std::string name;
+            unsigned long long calls;
+            unsigned long long points;
+            unsigned long long unsafe;
+        };
+
+        AdaptiveAbstractionStrategy(
+                std::vector<std::pair<std::string, 
+                    budgeted_abstraction_strategy_t>> const& /* arms */,
+                std::size_t /* base number of points */,
+                double /* margin of the original input */,
+                point const& /* knownValidPoint */,
+                point const& /* granularity */);
+        abstraction_strategy_return_t operator()(region const&);
+        // logit margins of classified points, points this strategy did
+        // not generate are ignored
+        void recordMargins(
+                std::vector<point> const&,
+                std::vector<double> const&);
+        // a refined region, the classified points of it and its
+        // subregions, and the subregions that are still unverified
+        void feedback(
+                region const&,
+                std::vector<point> const&,
+                std::vector<bool> const& /* safe */,
+                std::set<region, region_less_compare> const& /* siblings */);
+        std::size_t budgetFor(region const&);
+        std::vector<ArmStats> stats() const;
+
+        static const std::size_t maxFactor;
+    private:
+        struct SharedState;
+        std::size_t chooseArm();
+        std::shared_ptr<SharedState> shared;
     };
 
     struct HierarchicalDimensionRefinementStrategy
@@ -228,6 +464,17 @@ namespace grid
                 unsigned /* dimension divisor */,
                 unsigned /* number of dimensions to subdivide */);
         refinement_strategy_return_t operator()(region const&);
+        // partition using an explicit divisor and number of dimensions
+        // instead of the ones given at construction
+        refinement_strategy_return_t refine(
+                region const&,
+                unsigned /* dimension divisor */,
+                unsigned /* number of dimensions to subdivide */);
+        // partition the given dimensions, each by its own divisor
+        refinement_strategy_return_t refine(
+                region const&,
+                dim_selection_strategy_return_t const& /* dims */,
+                std::vector<unsigned> const& /* divisor per dimension */);
     private:
         bool enumerateAllRegions(
                 refinement_strategy_return_t&,
@@ -239,6 +486,152 @@ namespace grid
         unsigned dim_divisor;
         unsigned numDims;
     };
+
+    // measured costs used to decide how aggressively to refine
+    // pointCost: seconds to classify a single point
+    // regionCost: seconds of cpu overhead per created region
+    //     (refinement, abstraction and bookkeeping)
+    struct RefinementCostModel
+    {
+        long double pointCost;
+        long double regionCost;
+    };
+
+    // hierarchical refinement that picks the dimension divisor and
+    // the number of dimensions per region so that the children reach
+    // the discrete search threshold in as few levels as possible
+    // without creating more children than the cost model allows
+    struct AdaptiveDimensionRefinementStrategy
+    {
+        AdaptiveDimensionRefinementStrategy(
+                dimension_selection_strategy_t const&,
+                point const& /* knownValidPoint */,
+                point const& /* granularity */,
+                unsigned long long /* target valid points per region */,
+                unsigned long long /* max children per refinement */,
+                RefinementCostModel const&);
+        refinement_strategy_return_t operator()(region const&);
+        // returns {dimension divisor, number of dimensions}
+        std::pair<unsigned, unsigned> chooseRefinement(region const&) const;
+        unsigned long long maxChildren() const { return childBudget; }
+    private:
+        // the dimensions in the order of the selection strategy and
+        // the divisor, capped by the number of valid points, of each
+        struct refinement_plan
+        {
+            unsigned divisor;
+            dim_selection_strategy_return_t dims;
+            std::vector<unsigned> divisors;
+        };
+        refinement_plan planRefinement(region const&) const;
+
+        dimension_selection_strategy_t dim_select_strategy;
+        HierarchicalDimensionRefinementStrategy hierarchical;
+        point knownValidPoint;
+        point granularity;
+        unsigned long long targetPoints;
+        unsigned long long childBudget;
+    };
+
+    // 64 bit hash of the discrete grid coordinates (indices relative to
+    // a known valid point) of a point or of the bounds of a region,
+    // points or regions on the same grid cells hash equally
+    struct LatticeHash
+    {
+        LatticeHash(
+                point const& /* knownValidPoint */,
+                point const& /* granularity */);
+        std::uint64_t operator()(point const&) const;
+        std::uint64_t operator()(region const&) const;
+    private:
+        point knownValidPoint;
+        point granularity;
+    };
+
+    // compact store of verified safe regions
+    // regions are kept as bounds on the discrete grid (indices relative
+    // to a known valid point) and a refinement tree is tracked so that
+    // once every nonempty child of a partition is safe the children are
+    // replaced by their parent. memory therefore grows with the
+    // boundary between safe and unsafe space instead of its volume
+    // (a region awaiting a verdict only costs a hash and an id)
+    struct SafeRegionStore
+    {
+        // lower bound (inclusive), upper bound (exclusive) of each dim
+        using lattice_box = std::vector<std::pair<std::int32_t, std::int32_t>>;
+
+        SafeRegionStore(
+                point const& /* knownValidPoint */,
+                point const& /* granularity */);
+        // record that a region was partitioned into subregions
+        void addRefinement(
+                region const& /* parent */,
+                refinement_strategy_return_t const& /* children */);
+        // record that a region was verified safe
+        void insert(region const&);
+        // record that a region left the frontier without being verified
+        // safe (it holds an adversarial example), the partition it
+        // belongs to is never replaced by its parent
+        void remove(region const&);
+        // a region leaving memory (e.g. spilled to disk) takes the id of
+        // the partition it belongs to along, attach restores it. a
+        // region that is never attached again keeps that partition from
+        // being replaced by its parent
+        std::uint64_t detach(region const&);
+        void attach(region const&, std::uint64_t);
+        // regions awaiting a verdict
+        std::size_t pending() const { return pendingChildren.size(); }
+
+        lattice_box toLatticeBox(region const&) const;
+        region toRegion(lattice_box const&) const;
+        long double latticePoints(lattice_box const&) const;
+        long double latticePoints(region const&) const;
+
+        // number of boxes currently stored
+        std::size_t size() const { return numStored; }
+        // running totals of verified safe lattice points and volume
+        long double safePoints() const { return totalPoints; }
+        long double safeVolume() const { return totalVolume; }
+
+        template <class CallbackFunc>
+        void forEach(CallbackFunc&& cb) const
+        {
+            for(auto&& b : rootSafe) cb(toRegion(b));
+            for(auto&& n : nodes)
+                for(auto&& b : n.second.safeChildren) cb(toRegion(b));
+        }
+    private:
+        struct node
+        {
+            lattice_box box;
+            std::size_t parent;
+            std::size_t pending;
+            // a child will never be safe, the safe children are kept
+            // as they are once the others have their verdict
+            bool blocked;
+            std::vector<lattice_box> safeChildren;
+        };
+        static const std::size_t no_parent;
+        static bool isEmpty(lattice_box const&);
+        static std::uint64_t boxHash(lattice_box const&);
+        void settle(std::size_t /* node */, lattice_box const&);
+        // a child of the node will never be safe
+        void abandon(std::size_t /* node */);
+        // a child of the node has its final verdict
+        void childDone(std::size_t /* node */);
+
+        point knownValidPoint;
+        point granularity;
+        std::size_t nextId;
+        std::size_t numStored;
+        long double totalPoints;
+        long double totalVolume;
+        std::unordered_map<std::size_t, node> nodes;
+        // regions awaiting a verdict, keyed by the hash of their
+        // lattice box, mapped to the partition they belong to
+        std::unordered_map<std::uint64_t, std::size_t> pendingChildren;
+        std::vector<lattice_box> rootSafe;
+    };
 }
 
 bool operator<(grid::point const&, grid::region const&);
@@ -6,6 +6,10 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <future>
+#include <memory>
+#include <set>
+#include <cstdlib>
 
 #include "tensorflow/core/lib/io/path.h"
 #include "tensorflow/core/lib/strings/str_util.h"
@@ -17,8 +21,11 @@
 
 #include "tensorflow_graph_tools.hpp"
 #include "GraphManager.hpp"
+#include "NativeModel.hpp"
 #include "ARFramework.hpp"
 #include "grid_tools.hpp"
+#include "AdversarialExampleStore.hpp"
+#include "thread_tools.hpp"
 
 std::function<void(void)> shutdown_callback;
 void shutdown_handler(int p)
@@ -47,6 +54,38 @@ int main(int argc, char* argv[])
     std::string output_dir = "adv_examples";
     std::string refinement_dim_selection = "largest_first";
     std::string modified_fgsm_dim_selection = "intellifeature";
+    std::string refinement_mode = "fixed";
+    std::string max_refinement_children_str = "4096";
+    std::string frontier_memory_cap_mb_str = "0";
+    std::string safe_point_filter_mb_str = "0";
+    std::string frontier_spill_file = "";
+    std::string abstraction_strategy_opt = "fgsm";
+    std::string pgd_steps_str = "10";
+    std::string pgd_step_size_str = "0.25";
+    std::string random_search_iterations_str = "20";
+    std::string random_search_fraction_str = "0.05";
+    std::string adv_example_store_dir = "";
+    std::string warmup_runs_str = "1";
+    std::string warmup_batch_sizes_str = "auto";
+    std::string intra_op_threads_str = "0";
+    std::string inter_op_threads_str = "0";
+    std::string graph_opt_level = "default";
+    std::string xla_jit_str = "false";
+    std::string thread_affinity = "none";
+    std::string session_autotune_str = "false";
+    std::string session_pool = "single";
+    std::string native_model_path = "";
+    std::string incremental_forward_str = "false";
+    std::string pipeline_str = "false";
+    std::string pipeline_threads_str = "1,4,1,1";
+    std::string pipeline_batch_size_str = "64";
+    std::string workers_per_session_str = "1";
+    std::string async_queries_str = "false";
+    std::string async_batch_size_str = "64";
+    std::string async_max_wait_us_str = "200";
+    std::string static_dispatch_str = "true";
+    std::string random_seed_str = "0";
+    std::string adaptive_abstraction_str = "false";
 
     std::vector<tensorflow::Flag> flag_list = {
         tensorflow::Flag("graph", &graph, "path to protobuf graph to be executed - root_dir/graph"),
@@ -65,7 +104,39 @@ int main(int argc, char* argv[])
         tensorflow::Flag("num_abstractions", &num_abstractions_str, "number of points to use as abstractions for each region"),
         tensorflow::Flag("output_dir", &output_dir, "directory where adversarial examples and other output should be saved"),
         tensorflow::Flag("refinement_dim_selection", &refinement_dim_selection, "strategy to use for hierarchical dimension refinement"),
-        tensorflow::Flag("modified_fgsm_dim_selection", &modified_fgsm_dim_selection, "dimension selection strategy to use for modified FGSM")
+        tensorflow::Flag("modified_fgsm_dim_selection", &modified_fgsm_dim_selection, "dimension selection strategy to use for modified FGSM"),
+        tensorflow::Flag("refinement_mode", &refinement_mode, "fixed (halve 2 dimensions per refinement) or adaptive (divisor and dimensions chosen per region from lattice counts and measured model cost)"),
+        tensorflow::Flag("max_refinement_children", &max_refinement_children_str, "upper bound on the number of subregions created by one adaptive refinement"),
+        tensorflow::Flag("frontier_memory_cap_mb", &frontier_memory_cap_mb_str, "memory (MB) for unverified regions before low priority regions are spilled to disk (0 = unlimited)"),
+        tensorflow::Flag("safe_point_filter_mb", &safe_point_filter_mb_str, "memory (MB) of the shared filter of abstracted points already classified safe, such points are not classified again, a false positive may skip an unsafe point so results are then neither exact nor repeatable across thread counts (0 = disabled)"),
+        tensorflow::Flag("frontier_spill_file", &frontier_spill_file, "file used for spilled regions (default output_dir/frontier_spill.bin)"),
+        tensorflow::Flag("abstraction_strategy", &abstraction_strategy_opt, "abstraction strategy (fgsm, pgd with a gradient layer; random_search (default) or random without one)"),
+        tensorflow::Flag("pgd_steps", &pgd_steps_str, "number of projected gradient steps per region (pgd abstraction, num_abstractions random starts)"),
+        tensorflow::Flag("pgd_step_size", &pgd_step_size_str, "pgd step as a fraction of the region width in each dimension"),
+        tensorflow::Flag("random_search_iterations", &random_search_iterations_str, "iterations of the gradient free random search (num_abstractions chains queried per batch)"),
+        tensorflow::Flag("random_search_fraction", &random_search_fraction_str, "initial fraction of dimensions perturbed per random search step"),
+        tensorflow::Flag("adv_example_store", &adv_example_store_dir, "directory of adversarial examples kept across runs, keyed by model and input (optional)"),
+        tensorflow::Flag("warmup_runs", &warmup_runs_str, "number of warmup model runs per warmup batch size (0 disables warmup)"),
+        tensorflow::Flag("warmup_batch_sizes", &warmup_batch_sizes_str, "comma separated batch sizes to warm up, auto = 1, num_abstractions and the async and pipeline batch sizes in use"),
+        tensorflow::Flag("intra_op_threads", &intra_op_threads_str, "tensorflow intra-op thread pool size (0 = tensorflow default)"),
+        tensorflow::Flag("inter_op_threads", &inter_op_threads_str, "tensorflow inter-op thread pool size (0 = tensorflow default)"),
+        tensorflow::Flag("graph_opt_level", &graph_opt_level, "graph optimizer level (default, L0, L1)"),
+        tensorflow::Flag("xla_jit", &xla_jit_str, "enable XLA JIT compilation (true, false)"),
+        tensorflow::Flag("thread_affinity", &thread_affinity, "worker thread placement (none, compact = worker i pinned to core i, numa = worker pinned to the cores of its NUMA node)"),
+        tensorflow::Flag("session_autotune", &session_autotune_str, "measure throughput of several session thread configurations at startup and keep the best (true, false)"),
+        tensorflow::Flag("session_pool", &session_pool, "sessions shared by the workers (single, numa = one session and frontier partition per NUMA node, workers = one session and frontier partition per workers_per_session workers)"),
+        tensorflow::Flag("workers_per_session", &workers_per_session_str, "workers sharing a session when session_pool is workers"),
+        tensorflow::Flag("native_model", &native_model_path, "weights exported by native_model_export.py - root_dir/native_model, runs classification and gradients on the built-in cpu engine instead of the session (optional)"),
+        tensorflow::Flag("incremental_forward", &incremental_forward_str, "with a native model, compute the first layer of points close to the previous point as an update for the changed coordinates (true, false), rounds differently from a full pass so it is only used for abstraction and logit queries, never to certify regions"),
+        tensorflow::Flag("pipeline", &pipeline_str, "run verification as pipelined stages instead of num_threads independent workers (true, false)"),
+        tensorflow::Flag("pipeline_threads", &pipeline_threads_str, "threads of the selection, preparation (verification, refinement, abstraction), inference and integration stages"),
+        tensorflow::Flag("pipeline_batch_size", &pipeline_batch_size_str, "points classified together by the pipeline inference stage"),
+        tensorflow::Flag("async_queries", &async_queries_str, "strategies issue their safety and gradient queries up front and a dispatcher thread answers the queries of all workers in batches (true, false)"),
+        tensorflow::Flag("async_batch_size", &async_batch_size_str, "largest batch of coalesced async queries"),
+        tensorflow::Flag("async_max_wait_us", &async_max_wait_us_str, "microseconds an async query waits for others to share its batch"),
+        tensorflow::Flag("static_dispatch", &static_dispatch_str, "run the default strategy combinations (modified FGSM or random search abstraction, fixed refinement, discrete search) with their concrete types instead of std::function (true, false)"),
+        tensorflow::Flag("random_seed", &random_seed_str, "seed of the random streams used by the strategies, the points generated for a region only depend on the seed and the region so runs are repeatable for any thread count as long as safe_point_filter_mb is 0"),
+        tensorflow::Flag("adaptive_abstraction", &adaptive_abstraction_str, "pick the abstraction strategy of each region (random, random_search, and fgsm, pgd with a gradient layer) from the fraction of unsafe points each one found, and scale num_abstractions per region by the logit margins of its parent's points and the results of its siblings (true, false), the choices depend on the order results come in so runs are not repeatable")
     };
 
     std::string usage = tensorflow::Flags::Usage(argv[0], flag_list);
@@ -84,6 +155,7 @@ int main(int argc, char* argv[])
     }
 
     auto hasGradientLayer = gradient_layer != "gradient_layer_tmp_placeholder";
+    auto hasLabelLayer = label_layer != "label_layer_placeholder";
     auto granularityProvided = granularity != "granularity";
     double granularityVal = granularityProvided ? atof(granularity.c_str()) : 1.0;
 
@@ -97,19 +169,120 @@ int main(int argc, char* argv[])
     auto num_threads = std::atoi(num_threads_str.c_str());
     auto num_abstractions = std::atoi(num_abstractions_str.c_str());
     auto fgsm_balance_factor = std::atof(fgsm_balance_factor_opt.c_str());
+    auto max_refinement_children = 
+        std::strtoull(max_refinement_children_str.c_str(), nullptr, 10);
+    auto frontier_memory_cap_mb = 
+        std::strtoull(frontier_memory_cap_mb_str.c_str(), nullptr, 10);
+    auto safe_point_filter_mb = 
+        std::strtoull(safe_point_filter_mb_str.c_str(), nullptr, 10);
+    auto pgd_steps = std::atoi(pgd_steps_str.c_str());
+    grid::setRandomSeed(
+            std::strtoull(random_seed_str.c_str(), nullptr, 10));
+    auto pgd_step_size = std::atof(pgd_step_size_str.c_str());
+    auto random_search_iterations = 
+        std::atoi(random_search_iterations_str.c_str());
+    auto random_search_fraction = 
+        std::atof(random_search_fraction_str.c_str());
+
+    auto warmup_runs = std::atoi(warmup_runs_str.c_str());
+    GraphManager::SessionConfig session_config;
+    session_config.intra_op_threads = std::atoi(intra_op_threads_str.c_str());
+    session_config.inter_op_threads = std::atoi(inter_op_threads_str.c_str());
+    session_config.opt_level = graph_opt_level;
+    session_config.xla_jit = xla_jit_str == "true";
+    auto session_autotune = session_autotune_str == "true";
+
+    // worker i runs the model on session session_of_worker(i) and works
+    // on the frontier partition with the same index
+    auto numa_nodes = thread_tool::numaNodeCores();
+    auto workers_per_session = 
+        std::max(1, std::atoi(workers_per_session_str.c_str()));
+    std::size_t number_of_sessions = 1u;
+    if(session_pool == "numa")
+        number_of_sessions = numa_nodes.size();
+    else if(session_pool == "workers")
+        number_of_sessions = 
+            (std::max(1, num_threads) + workers_per_session - 1) 
+            / workers_per_session;
+    else if(session_pool != "single")
+    {
+        LOG(ERROR) << "Unknown session pool: " << session_pool;
+        exit(1);
+    }
+    // the pools of the session of a node run on that node like its workers
+    if(session_pool == "numa")
+        session_config.session_cores = numa_nodes;
+    auto session_of_worker = [&](unsigned worker) -> std::size_t
+    {
+        if(session_pool == "numa") return worker % numa_nodes.size();
+        if(session_pool == "workers") return worker / workers_per_session;
+        return 0u;
+    };
+
+    using startup_clock = std::chrono::steady_clock;
+    auto seconds_since = [](startup_clock::time_point start)
+    {
+        return std::chrono::duration<double>(
+                startup_clock::now() - start).count();
+    };
+    auto startup_start = startup_clock::now();
+
+    auto hasLabelProto = label_proto != "label_proto";
+    auto hasAveragesProto = class_averages != "class_averages";
+    auto needsAverages = hasAveragesProto && 
+        (refinement_dim_selection == "intellifeature" || 
+         modified_fgsm_dim_selection == "intellifeature");
 
+    // the graph and the protobufs do not depend on each other,
+    // load them concurrently
     std::string graph_path = tensorflow::io::JoinPath(root_dir, graph);
-    GraphManager gm(graph_path);
-    if(!gm.ok())
+    std::string initial_activation_path = 
+        tensorflow::io::JoinPath(root_dir, initial_activation);
+    std::string label_tensor_path = 
+        tensorflow::io::JoinPath(root_dir, label_proto);
+    std::string class_averages_path = 
+        tensorflow::io::JoinPath(root_dir, class_averages);
+    auto graph_load_seconds = 0.0;
+    auto init_act_load_seconds = 0.0;
+    auto label_load_seconds = 0.0;
+    auto averages_load_seconds = 0.0;
+    auto load_proto_async = [&](std::string const& path, double* seconds)
+    {
+        return std::async(std::launch::async, [=]()
+                {
+                    auto start = startup_clock::now();
+                    auto retVal = GraphManager::ReadBinaryTensorProto(path);
+                    *seconds = seconds_since(start);
+                    return retVal;
+                });
+    };
+    auto graph_future = std::async(std::launch::async, [&]()
+            {
+                auto start = startup_clock::now();
+                std::unique_ptr<GraphManager> retVal(
+                        new GraphManager(graph_path, session_config,
+                            number_of_sessions));
+                graph_load_seconds = seconds_since(start);
+                return retVal;
+            });
+    auto init_act_future = 
+        load_proto_async(initial_activation_path, &init_act_load_seconds);
+    std::future<std::pair<bool, tensorflow::Tensor>> label_future;
+    if(hasLabelProto)
+        label_future = load_proto_async(label_tensor_path, &label_load_seconds);
+    std::future<std::pair<bool, tensorflow::Tensor>> averages_future;
+    if(needsAverages)
+        averages_future = 
+            load_proto_async(class_averages_path, &averages_load_seconds);
+
+    auto gm_ptr = graph_future.get();
+    if(!gm_ptr->ok())
     {
         LOG(ERROR) << "Error during construction";
         exit(1);
     }
     
-    std::string initial_activation_path = 
-        tensorflow::io::JoinPath(root_dir, initial_activation);
-    auto init_act_tensor_status_pair = 
-        GraphManager::ReadBinaryTensorProto(initial_activation_path);
+    auto init_act_tensor_status_pair = init_act_future.get();
     if(!init_act_tensor_status_pair.first)
     {
         LOG(ERROR) 
@@ -119,6 +292,113 @@ int main(int argc, char* argv[])
     }
 
     auto init_act_tensor = init_act_tensor_status_pair.second;
+
+    auto autotune_seconds = 0.0;
+    if(session_autotune)
+    {
+        // num_threads workers classifying single points, the same
+        // access pattern as the verification workers
+        auto measure_throughput = [&](GraphManager& candidate)
+        {
+            const auto runs_per_thread = 20;
+            auto feed = [&]() -> graph_tool::feed_dict_type_t
+            {
+                return {{input_layer, init_act_tensor}};
+            };
+            // first run outside the timing
+            candidate.feedThroughModel(
+                    feed, &graph_tool::parseGraphOutToVector, 
+                    {output_layer});
+            auto start = startup_clock::now();
+            std::vector<std::thread> measure_pool;
+            for(auto i = 0; i < num_threads; ++i)
+            {
+                measure_pool.emplace_back([&]()
+                        {
+                            for(auto j = 0; j < runs_per_thread; ++j)
+                                candidate.feedThroughModel(
+                                        feed, 
+                                        &graph_tool::parseGraphOutToVector, 
+                                        {output_layer});
+                        });
+            }
+            for(auto&& t : measure_pool)
+                t.join();
+            if(!candidate.ok()) return 0.0;
+            return num_threads * runs_per_thread / seconds_since(start);
+        };
+        auto autotune_start = startup_clock::now();
+        auto cores = static_cast<int>(thread_tool::numCores());
+        auto per_worker = std::max(1, cores / std::max(1, num_threads));
+        std::vector<std::pair<int, int>> candidates = {
+            {session_config.intra_op_threads, 
+                session_config.inter_op_threads},
+            {0, 0},
+            {1, 1},
+            {per_worker, 1},
+            {per_worker, 2},
+            {cores, 1}
+        };
+        auto best_config = session_config;
+        auto best_throughput = measure_throughput(*gm_ptr);
+        std::cout << "Autotune intra " << session_config.intra_op_threads
+            << " inter " << session_config.inter_op_threads << ": " 
+            << best_throughput << " points/s\n";
+        for(auto i = 1u; i < candidates.size(); ++i)
+        {
+            if(candidates[i] == candidates[0]) continue;
+            auto candidate_config = session_config;
+            candidate_config.intra_op_threads = candidates[i].first;
+            candidate_config.inter_op_threads = candidates[i].second;
+            std::unique_ptr<GraphManager> candidate(
+                    new GraphManager(graph_path, candidate_config,
+                        number_of_sessions));
+            auto throughput = measure_throughput(*candidate);
+            std::cout << "Autotune intra " << candidates[i].first
+                << " inter " << candidates[i].second << ": " 
+                << throughput << " points/s\n";
+            if(throughput > best_throughput)
+            {
+                best_throughput = throughput;
+                best_config = candidate_config;
+                gm_ptr = std::move(candidate);
+            }
+        }
+        session_config = best_config;
+        autotune_seconds = seconds_since(autotune_start);
+    }
+    auto& gm = *gm_ptr;
+    GraphManager::ModelSignature model_signature;
+    model_signature.input_layer = input_layer;
+    model_signature.output_layer = output_layer;
+    if(hasGradientLayer && hasLabelLayer)
+    {
+        model_signature.label_layer = label_layer;
+        model_signature.gradient_layer = gradient_layer;
+    }
+    if(gm.makeCallables(model_signature))
+        std::cout << "Using precompiled callables\n";
+    // threads of the pools each session actually starts, 0 is one per core
+    auto applied_threads = [](int threads)
+    {
+        return threads > 0 
+            ? threads : static_cast<int>(thread_tool::numCores());
+    };
+    auto applied_intra = applied_threads(session_config.intra_op_threads);
+    auto applied_inter = applied_threads(session_config.inter_op_threads);
+    std::cout << "Session: intra " << applied_intra
+        << " inter " << applied_inter
+        << " per session (" << gm.numSessions() << " sessions)"
+        << " opt level " << session_config.opt_level
+        << " xla jit " << (session_config.xla_jit ? "on" : "off") << "\n";
+    if(applied_intra * static_cast<int>(gm.numSessions())
+            > static_cast<int>(thread_tool::numCores()))
+    {
+        std::cout << "Warning: " << gm.numSessions() << " sessions x " 
+            << applied_intra
+            << " intra-op threads oversubscribe " 
+            << thread_tool::numCores() << " cores\n";
+    }
     auto init_act_point = graph_tool::tensorToPoint(
             init_act_tensor);
 
@@ -132,6 +412,9 @@ int main(int argc, char* argv[])
     std::cout << "Number of threads: " << num_threads << "\n";
     std::cout << "Number of points per abstractions: " << num_abstractions << "\n";
     std::cout << "Channels: " << numberOfInputDimensions << "\n";
+    if(grid::useKernelsFor(init_act_point.size()))
+        std::cout << "Using grid kernels specialized for " 
+            << init_act_point.size() << " dimensions\n";
     // --------------
 
     // first dimension is the batch size
@@ -166,19 +449,16 @@ int main(int argc, char* argv[])
     unsigned orig_class = 
         graph_tool::getClassOfClassificationVector(logits_init_activation);
 
-    auto hasLabelProto = label_proto != "label_proto";
+    tensorflow::Tensor label_tensor;
     if(hasLabelProto)
     {
-        auto label_tensor_path = 
-            tensorflow::io::JoinPath(root_dir, label_proto);
-        auto label_tensor_pair =
-            GraphManager::ReadBinaryTensorProto(label_tensor_path);
+        auto label_tensor_pair = label_future.get();
         if(!label_tensor_pair.first)
         {
             LOG(ERROR) << "Unable to read label proto";
             exit(1);
         }
-        auto label_tensor = label_tensor_pair.second;
+        label_tensor = label_tensor_pair.second;
         auto label_class = graph_tool::getClassOfClassificationTensor(
                 label_tensor);
         if(label_class != orig_class)
@@ -192,7 +472,127 @@ int main(int argc, char* argv[])
         }
     }
 
-    for(auto i = 0u; i < 20u; ++i)
+    // the native engine replaces the session for abstraction, gradient
+    // and logit queries only if it agrees with the graph. it is a float
+    // reimplementation that may disagree with the graph close to the
+    // decision boundary, so verdicts used to certify regions and
+    // adversarial examples are always decided by the graph
+    std::unique_ptr<NativeModel> native_model;
+    auto incremental_forward = incremental_forward_str == "true";
+    auto native_classify = [&](std::vector<grid::point> const& pts)
+    {
+        return incremental_forward 
+            ? native_model->classifyIncremental(pts)
+            : native_model->classify(pts);
+    };
+    if(!native_model_path.empty())
+    {
+        native_model.reset(new NativeModel(
+                    tensorflow::io::JoinPath(root_dir, native_model_path)));
+        auto init_point = graph_tool::tensorToPoint(init_act_tensor);
+        if(native_model->ok() 
+                && native_model->inputSize() != init_point.size())
+        {
+            LOG(ERROR) << "Native model expects " 
+                << native_model->inputSize() << " inputs, got "
+                << init_point.size();
+            native_model.reset();
+        }
+        else if(native_model->ok())
+        {
+            // compare on the initial point and perturbations of it
+            std::vector<grid::point> check_points(17u, init_point);
+            std::mt19937 check_gen(0);
+            std::uniform_real_distribution<long double> 
+                check_dist(-radius, radius);
+            for(auto i = 1u; i < check_points.size(); ++i)
+                for(auto&& v : check_points[i])
+                    v += check_dist(check_gen);
+            auto graph_out = gm.feedThroughModel(
+                    std::bind(graph_tool::makeBatchFeedDict,
+                        input_layer, check_points, input_shape),
+                    &graph_tool::parseGraphOutToVectors,
+                    {output_layer});
+            auto native_out = native_model->classify(check_points);
+            auto agree = graph_out.size() == native_out.size();
+            for(auto i = 0u; agree && i < native_out.size(); ++i)
+                agree = graph_tool::getClassOfClassificationVector(
+                        graph_out[i]) == 
+                    graph_tool::getClassOfClassificationVector(
+                            native_out[i]);
+            if(!agree)
+            {
+                LOG(ERROR) << "Native model disagrees with the graph";
+                native_model.reset();
+            }
+        }
+        else
+        {
+            native_model.reset();
+        }
+        if(native_model)
+        {
+            std::cout << "Using native model: " << native_model_path << "\n";
+            if(incremental_forward)
+                std::cout << "Incremental first layer: " 
+                    << (native_model->supportsIncremental() ? "on" : "off")
+                    << "\n";
+        }
+        else
+            LOG(ERROR) << "Native model not used, running the graph";
+    }
+
+    auto assets_seconds = seconds_since(startup_start);
+
+    // queries of all workers answered in batches, see async_queries
+    auto async_queries = async_queries_str == "true";
+    auto async_batch_size = static_cast<std::size_t>(
+            std::max(1, std::atoi(async_batch_size_str.c_str())));
+    auto pipeline = pipeline_str == "true";
+    auto pipeline_batch_size = static_cast<std::size_t>(
+            std::max(1, std::atoi(pipeline_batch_size_str.c_str())));
+    // only attempt discrete search if total
+    // valid points in region is less than a threshold
+    const auto discrete_search_attempt_threshold = 1000ull;
+
+    // warm up every batch size used during verification so memory
+    // allocation and kernel selection happen before the workers start
+    std::vector<std::size_t> warmup_batch_sizes;
+    if(warmup_batch_sizes_str == "auto")
+    {
+        // single points (and the synchronous discrete search),
+        // the abstraction of a region
+        warmup_batch_sizes.push_back(1u);
+        if(num_abstractions > 1)
+            warmup_batch_sizes.push_back(num_abstractions);
+        // the coalesced async queries and the lattice of a discrete
+        // search, which is submitted in chunks of async_batch_size
+        if(async_queries)
+        {
+            warmup_batch_sizes.push_back(async_batch_size);
+            warmup_batch_sizes.push_back(std::min<std::size_t>(
+                        async_batch_size,
+                        discrete_search_attempt_threshold - 1ull));
+        }
+        if(pipeline)
+            warmup_batch_sizes.push_back(pipeline_batch_size);
+        std::sort(warmup_batch_sizes.begin(), warmup_batch_sizes.end());
+        warmup_batch_sizes.erase(
+                std::unique(warmup_batch_sizes.begin(),
+                    warmup_batch_sizes.end()),
+                warmup_batch_sizes.end());
+    }
+    else
+    {
+        std::stringstream batch_sizes_stream(warmup_batch_sizes_str);
+        std::string batch_size_str;
+        while(std::getline(batch_sizes_stream, batch_size_str, ','))
+        {
+            auto batch_size = std::atoi(batch_size_str.c_str());
+            if(batch_size > 0) warmup_batch_sizes.push_back(batch_size);
+        }
+    }
+    auto run_single_point = [&]()
     {
         auto tmp = 
             gm.feedThroughModel(
@@ -209,6 +609,71 @@ int main(int argc, char* argv[])
 
         if(tmp_class != orig_class)
             std::cout << tmp_class << " " << orig_class << "\n";
+    };
+    auto warm_session = [&]()
+    {
+        for(auto&& batch_size : warmup_batch_sizes)
+        {
+            if(batch_size == 1u)
+            {
+                for(auto i = 0; i < warmup_runs; ++i)
+                    run_single_point();
+                continue;
+            }
+            std::vector<grid::point> warmup_batch(
+                    batch_size, init_act_point);
+            for(auto i = 0; i < warmup_runs; ++i)
+            {
+                gm.feedThroughModel(
+                        std::bind(graph_tool::makeBatchFeedDict,
+                            input_layer, warmup_batch, input_shape),
+                        &graph_tool::parseGraphOutToVectors,
+                        {output_layer});
+                if(!gm.ok())
+                {
+                    LOG(ERROR) << "Error while warming up batch size " 
+                        << batch_size;
+                    exit(1);
+                }
+            }
+        }
+    };
+    auto warmup_start = startup_clock::now();
+    if(gm.numSessions() == 1u)
+    {
+        warm_session();
+    }
+    else
+    {
+        // each session is first run from a thread placed like its
+        // workers, so its buffers are allocated on their NUMA node
+        std::vector<std::thread> warmup_pool;
+        for(auto s = 0u; s < gm.numSessions(); ++s)
+        {
+            warmup_pool.emplace_back([&, s]()
+                    {
+                        if(session_pool == "numa")
+                            thread_tool::pinCurrentThreadToCores(
+                                    numa_nodes[s]);
+                        GraphManager::setThreadSession(s);
+                        warm_session();
+                    });
+        }
+        for(auto&& t : warmup_pool)
+            t.join();
+    }
+    auto warmup_seconds = seconds_since(warmup_start);
+
+    // seconds to classify a single point, used by the
+    // adaptive refinement cost model
+    long double point_cost = 0;
+    if(refinement_mode == "adaptive")
+    {
+        const auto num_cost_runs = 5;
+        auto cost_start = startup_clock::now();
+        for(auto i = 0; i < num_cost_runs; ++i)
+            run_single_point();
+        point_cost = seconds_since(cost_start) / num_cost_runs;
     }
 
     std::cout << "Granularity: " << granularityVal << "\n";
@@ -241,20 +706,68 @@ int main(int argc, char* argv[])
     grid::dimension_selection_strategy_t modified_fgsm_selection_strategy = 
         grid::randomDimSelection;
 
+    // model outputs for a batch of points, used by the
+    // gradient free abstraction strategy
+    auto batch_logits_func = [&](std::vector<grid::point> const& pts)
+        -> std::vector<grid::point>
+    {
+        if(native_model) return native_classify(pts);
+        thread_local graph_tool::BatchFeed feed(
+                input_layer, input_shape, num_abstractions);
+        auto retVal = graph_tool::parseGraphOutToVectors(
+                gm.classify(feed.pack(pts).front().second));
+        if(!gm.ok())
+            LOG(ERROR) << "GM Error in batch_logits_func";
+        return retVal;
+    };
+
     grid::region_abstraction_strategy_t abstraction_strategy = 
         grid::RandomPointRegionAbstraction(num_abstractions);
+    if(abstraction_strategy_opt != "random")
+    {
+        std::cout << "Using gradient free random search: "
+            << random_search_iterations << " iterations, "
+            << num_abstractions << " chains\n";
+        abstraction_strategy = 
+            grid::RandomSearchRegionAbstraction(
+                    num_abstractions,
+                    random_search_iterations,
+                    batch_logits_func,
+                    orig_class,
+                    init_act_point,
+                    granularity_parsed,
+                    random_search_fraction);
+    }
     /*
     grid::region_abstraction_strategy_t abstraction_strategy = 
         grid::centralPointRegionAbstraction;
     */
 
-    auto hasAveragesProto = class_averages != "class_averages";
-    if(hasAveragesProto && (refinement_dim_selection == "intellifeature" || modified_fgsm_dim_selection == "intellifeature"))
+    // strategies the adaptive abstraction chooses from, called with
+    // the number of points to generate
+    std::vector<std::pair<std::string, grid::budgeted_abstraction_strategy_t>>
+        abstraction_arms;
+    abstraction_arms.emplace_back("random", 
+            [](grid::region const& r, std::size_t n)
+            {
+                return grid::RandomPointRegionAbstraction(n)(r);
+            });
+    abstraction_arms.emplace_back("random_search",
+            [&](grid::region const& r, std::size_t n)
+            {
+                return grid::RandomSearchRegionAbstraction(
+                        n,
+                        random_search_iterations,
+                        batch_logits_func,
+                        orig_class,
+                        init_act_point,
+                        granularity_parsed,
+                        random_search_fraction)(r);
+            });
+
+    if(needsAverages)
     {
-        std::string class_averages_path = 
-            tensorflow::io::JoinPath(root_dir, class_averages);
-        auto class_averages_proto_pair = 
-            GraphManager::ReadBinaryTensorProto(class_averages_path);
+        auto class_averages_proto_pair = averages_future.get();
         if(!class_averages_proto_pair.first)
         {
             LOG(ERROR) << "Unable to read class averages proto";
@@ -282,82 +795,188 @@ int main(int argc, char* argv[])
         }
     }
 
-    auto hasLabelLayer = label_layer != "label_layer_placeholder";
     auto canUseGradient = 
         hasGradientLayer 
         && hasLabelProto 
         && hasLabelLayer;
 
+    auto async_max_wait = std::chrono::microseconds(
+            std::max(0, std::atoi(async_max_wait_us_str.c_str())));
+    std::unique_ptr<thread_tool::QueryCoalescer<grid::point, grid::point>> 
+        gradient_coalescer;
+    std::unique_ptr<thread_tool::QueryCoalescer<grid::point, bool>> 
+        safety_coalescer;
+
     if(canUseGradient)
     {
-        std::cout << "Using Modified FGSM: " 
-            << fgsm_balance_factor << "\n";
-        auto label_tensor_path = 
-            tensorflow::io::JoinPath(root_dir, label_proto);
-        auto label_tensor_pair =
-            GraphManager::ReadBinaryTensorProto(label_tensor_path);
-        if(!label_tensor_pair.first)
+        // the label is repeated once per point so every element
+        // of a batch gets its own gradient
+        auto label_point = graph_tool::tensorToPoint(label_tensor);
+        std::vector<tensorflow::int64> label_shape;
+        for(auto i = 1; i < label_tensor.dims(); ++i)
+            label_shape.push_back(label_tensor.dim_size(i));
+        auto make_gradient_feed = [&, label_point, label_shape]()
         {
-            LOG(ERROR) << "Unable to read label proto";
-            exit(1);
-        }
-        auto label_tensor = label_tensor_pair.second;
+            graph_tool::BatchFeed feed(
+                    input_layer, input_shape, num_abstractions);
+            feed.addRepeatedInput(label_layer, label_point, label_shape);
+            return feed;
+        };
         auto grad_func = 
-                [&,label_tensor_copy = label_tensor]
+                [&, make_gradient_feed, label_point]
                 (grid::point const& p) -> grid::point
                 {
-                    auto createGradientFeedDict = 
-                    [&]() -> graph_tool::feed_dict_type_t
+                    if(native_model)
                     {
-                        auto p_tensor = 
-                        graph_tool::pointToTensor(p, batch_input_shape);
-                        return {{input_layer, p_tensor},
-                            {label_layer, label_tensor_copy}};
-                    };
-                    auto retVal = gm.feedThroughModel(
-                            createGradientFeedDict,
-                            graph_tool::parseGraphOutToVector,
-                            {gradient_layer});
+                        auto grads = native_model->gradient({p}, label_point);
+                        return grads.empty() ? grid::point() : grads[0];
+                    }
+                    thread_local auto feed = make_gradient_feed();
+                    auto const& packed = feed.pack(p);
+                    auto retVal = graph_tool::parseGraphOutToVector(
+                            gm.gradient(packed[0].second, packed[1].second));
                     if(!gm.ok())
                         LOG(ERROR) << "Error with model";
                     return retVal;
                 };
+        auto batch_grad_func = 
+            [&, make_gradient_feed, label_point]
+            (std::vector<grid::point> const& pts) 
+            -> std::vector<grid::point>
+            {
+                if(native_model)
+                    return native_model->gradient(pts, label_point);
+                thread_local auto feed = make_gradient_feed();
+                auto const& packed = feed.pack(pts);
+                auto retVal = graph_tool::parseGraphOutToVectors(
+                        gm.gradient(packed[0].second, packed[1].second));
+                if(!gm.ok())
+                    LOG(ERROR) << "Error with model";
+                return retVal;
+            };
+        auto gradient_based_selection = [&]()
+        {
+            if(async_queries)
+                return grid::GradientBasedDimensionSelection(
+                        gradient_coalescer->asyncFunction());
+            return grid::GradientBasedDimensionSelection(grad_func);
+        };
+        if(async_queries)
+        {
+            std::cout << "Coalescing gradient queries: batches of up to " 
+                << async_batch_size << "\n";
+            gradient_coalescer.reset(
+                    new thread_tool::QueryCoalescer<grid::point, grid::point>(
+                        batch_grad_func, async_batch_size, async_max_wait));
+        }
         if(modified_fgsm_dim_selection == "gradient_based")
         {
             std::cout << "Using gradient-based dimension selection for modified FGSM abstraction strategy\n";
-            modified_fgsm_selection_strategy = 
-                grid::GradientBasedDimensionSelection(grad_func);
+            modified_fgsm_selection_strategy = gradient_based_selection();
         }
-        abstraction_strategy = 
-            grid::ModifiedFGSMWithFallbackRegionAbstraction(
-                num_abstractions,
-                grad_func,
-                modified_fgsm_selection_strategy,
-                grid::RandomPointRegionAbstraction(2u),
-                granularity_parsed,
-                fgsm_balance_factor);
+        if(abstraction_strategy_opt == "pgd")
+        {
+            std::cout << "Using PGD: " << pgd_steps << " steps, "
+                << num_abstractions << " starts, step size "
+                << pgd_step_size << "\n";
+            abstraction_strategy = 
+                grid::ProjectedGradientRegionAbstraction(
+                    num_abstractions,
+                    pgd_steps,
+                    batch_grad_func,
+                    init_act_point,
+                    granularity_parsed,
+                    pgd_step_size);
+        }
+        else if(abstraction_strategy_opt != "random_search" &&
+                abstraction_strategy_opt != "random")
+        {
+            std::cout << "Using Modified FGSM: " 
+                << fgsm_balance_factor << "\n";
+            if(async_queries)
+                abstraction_strategy = 
+                    grid::ModifiedFGSMWithFallbackRegionAbstraction(
+                        num_abstractions,
+                        gradient_coalescer->asyncFunction(),
+                        modified_fgsm_selection_strategy,
+                        grid::RandomPointRegionAbstraction(2u),
+                        granularity_parsed,
+                        fgsm_balance_factor);
+            else
+                abstraction_strategy = 
+                    grid::ModifiedFGSMWithFallbackRegionAbstraction(
+                        num_abstractions,
+                        grad_func,
+                        modified_fgsm_selection_strategy,
+                        grid::RandomPointRegionAbstraction(2u),
+                        granularity_parsed,
+                        fgsm_balance_factor);
+        }
+        abstraction_arms.emplace_back("pgd",
+                [&, batch_grad_func](grid::region const& r, std::size_t n)
+                {
+                    return grid::ProjectedGradientRegionAbstraction(
+                            n,
+                            pgd_steps,
+                            batch_grad_func,
+                            init_act_point,
+                            granularity_parsed,
+                            pgd_step_size)(r);
+                });
+        auto fgsm_selection = modified_fgsm_selection_strategy;
+        auto async_grad = async_queries 
+            ? gradient_coalescer->asyncFunction() 
+            : grid::async_model_function_t();
+        abstraction_arms.emplace_back("fgsm",
+                [&, grad_func, fgsm_selection, async_grad]
+                (grid::region const& r, std::size_t n)
+                {
+                    if(async_grad)
+                        return grid::ModifiedFGSMWithFallbackRegionAbstraction(
+                                n,
+                                async_grad,
+                                fgsm_selection,
+                                grid::RandomPointRegionAbstraction(2u),
+                                granularity_parsed,
+                                fgsm_balance_factor)(r);
+                    return grid::ModifiedFGSMWithFallbackRegionAbstraction(
+                            n,
+                            grad_func,
+                            fgsm_selection,
+                            grid::RandomPointRegionAbstraction(2u),
+                            granularity_parsed,
+                            fgsm_balance_factor)(r);
+                });
         if(refinement_dim_selection == "gradient_based")
         {
             std::cout << "Using gradient-based dimension selection strategy for partitioning\n";
-            dimension_selection_strategy = 
-                grid::GradientBasedDimensionSelection(grad_func);
+            dimension_selection_strategy = gradient_based_selection();
         }
     }
 
-    grid::region_refinement_strategy_t refinement_strategy = 
-        grid::HierarchicalDimensionRefinementStrategy(
-                dimension_selection_strategy,
-                2u,
-                2u);
+    std::unique_ptr<grid::AdaptiveAbstractionStrategy> adaptive_abstraction;
+    if(adaptive_abstraction_str == "true")
+    {
+        std::cout << "Using adaptive abstraction: " << num_abstractions 
+            << " points per region before scaling, strategies";
+        for(auto&& arm : abstraction_arms)
+            std::cout << " " << arm.first;
+        std::cout << "\n";
+        adaptive_abstraction.reset(new grid::AdaptiveAbstractionStrategy(
+                    abstraction_arms,
+                    num_abstractions,
+                    graph_tool::getClassificationMargin(
+                        logits_init_activation),
+                    init_act_point,
+                    granularity_parsed));
+        abstraction_strategy = *adaptive_abstraction;
+    }
 
     auto all_valid_discretization_strategy = 
         grid::AllValidDiscretizedPointsAbstraction(
                 graph_tool::tensorToPoint(init_act_tensor),
                 granularity_parsed);
     
-    // only attempt discrete search if total
-    // valid points in region is less than a threshold
-    const auto discrete_search_attempt_threshold = 1000ull;
     auto discrete_search_attempt_threshold_func = 
         [&](grid::region const& r)
         {
@@ -366,31 +985,176 @@ int main(int argc, char* argv[])
                 < discrete_search_attempt_threshold;
         };
 
+    // argmax and comparison with the original class run in the graph
+    tensorflow::Tensor orig_class_tensor(tensorflow::DT_INT64,
+            tensorflow::TensorShape({}));
+    orig_class_tensor.scalar<tensorflow::int64>()() = orig_class;
+    // safety of a packed batch of count points, decided from this run's
+    // own outputs (the error flag of gm is shared by every session),
+    // a failed run is retried and empty if it keeps failing
+    const auto safety_query_attempts = 3;
+    auto runSafetyCheck = [&](tensorflow::Tensor const& batch, 
+            std::size_t count)
+            {
+                for(auto attempt = 1; attempt <= safety_query_attempts; 
+                        ++attempt)
+                {
+                    auto safety_out = graph_tool::parseSafetyOut(
+                            gm.safetyCheck(batch, orig_class_tensor));
+                    if(safety_out.size() == count)
+                        return safety_out;
+                    LOG(ERROR) << "GM Error in safety check, attempt " 
+                        << attempt << " of " << safety_query_attempts;
+                }
+                return std::vector<std::pair<bool, float>>();
+            };
+    auto graphIsPointSafe = [&](grid::point const& p)
+            {
+                thread_local graph_tool::BatchFeed feed(
+                        input_layer, input_shape);
+                auto safety_out = 
+                    runSafetyCheck(feed.pack(p).front().second, 1u);
+                if(safety_out.empty())
+                {
+                    // a failed run must not be reported as unsafe
+                    LOG(ERROR) << "GM Error in isPointSafe, aborting";
+                    std::abort();
+                }
+                if(adaptive_abstraction)
+                    adaptive_abstraction->recordMargins(
+                            {p}, {safety_out.front().second});
+                return safety_out.front().first;
+            };
+    // safety of abstracted points, the native model only answers for
+    // points it finds safe (which at worst misses a counterexample),
+    // a point it finds unsafe is confirmed by the graph
     auto isPointSafe = [&](grid::point const& p)
             {
-                auto logits_out = gm.feedThroughModel(
-                        std::bind(graph_tool::makeFeedDict, 
-                            input_layer, p, batch_input_shape),
-                        &graph_tool::parseGraphOutToVector,
-                        {output_layer});
-                if(!gm.ok())
-                    LOG(ERROR) << "GM Error in isPointSafe";
-                auto class_out = 
-                    graph_tool::getClassOfClassificationVector(logits_out);
-                return class_out == orig_class;
+                if(native_model)
+                {
+                    auto out = native_classify({p});
+                    if(!out.empty() && orig_class == 
+                            graph_tool::getClassOfClassificationVector(out[0]))
+                    {
+                        if(adaptive_abstraction)
+                            adaptive_abstraction->recordMargins({p}, 
+                                    {graph_tool::getClassificationMargin(
+                                            out[0])});
+                        return true;
+                    }
+                }
+                return graphIsPointSafe(p);
             };
 
-    if(!isPointSafe(init_act_point))
+    if(!graphIsPointSafe(init_act_point))
     {
         LOG(ERROR) << "Original activation and original class do not agree\n";
         exit(1);
     }
 
-    auto verification_engine = 
+    ARFramework::PipelineConfig pipeline_config;
+    {
+        std::vector<unsigned> stage_threads;
+        std::stringstream stage_stream(pipeline_threads_str);
+        std::string count_str;
+        while(std::getline(stage_stream, count_str, ','))
+            stage_threads.push_back(
+                    std::max(1, std::atoi(count_str.c_str())));
+        if(pipeline && stage_threads.size() != 4u)
+        {
+            LOG(ERROR) << "pipeline_threads needs 4 comma separated counts";
+            exit(1);
+        }
+        if(stage_threads.size() == 4u)
+        {
+            pipeline_config.selection_threads = stage_threads[0];
+            pipeline_config.preparation_threads = stage_threads[1];
+            pipeline_config.inference_threads = stage_threads[2];
+            pipeline_config.integration_threads = stage_threads[3];
+        }
+        pipeline_config.batch_size = pipeline_batch_size;
+        pipeline_config.queue_capacity = 
+            4u*pipeline_config.preparation_threads;
+    }
+    // safety of the points of several regions in one model run, empty
+    // if the run failed (the caller must not read that as unsafe)
+    auto graphBatchIsPointSafe = [&](std::vector<grid::point> const& pts)
+            {
+                thread_local graph_tool::BatchFeed feed(
+                        input_layer, input_shape, pipeline_config.batch_size);
+                auto safety_out = runSafetyCheck(
+                        feed.pack(pts).front().second, pts.size());
+                if(safety_out.empty() && !pts.empty())
+                {
+                    LOG(ERROR) << "GM Error in batchIsPointSafe";
+                    return std::vector<bool>();
+                }
+                std::vector<bool> retVal(pts.size());
+                std::vector<double> margins(pts.size());
+                for(auto i = 0u; i < pts.size(); ++i)
+                {
+                    retVal[i] = safety_out[i].first;
+                    margins[i] = safety_out[i].second;
+                }
+                if(adaptive_abstraction)
+                    adaptive_abstraction->recordMargins(pts, margins);
+                return retVal;
+            };
+    // batch version of isPointSafe, used by the pipeline inference stage
+    auto batchIsPointSafe = [&](std::vector<grid::point> const& pts)
+            {
+                if(!native_model) return graphBatchIsPointSafe(pts);
+                std::vector<bool> retVal(pts.size(), false);
+                auto out = native_classify(pts);
+                std::vector<grid::point> unsafe_pts;
+                std::vector<std::size_t> unsafe_indices;
+                std::vector<grid::point> native_safe_pts;
+                std::vector<double> native_margins;
+                for(auto i = 0u; i < pts.size(); ++i)
+                {
+                    retVal[i] = i < out.size() && orig_class == 
+                        graph_tool::getClassOfClassificationVector(out[i]);
+                    if(retVal[i]) 
+                    {
+                        native_safe_pts.push_back(pts[i]);
+                        native_margins.push_back(
+                                graph_tool::getClassificationMargin(out[i]));
+                        continue;
+                    }
+                    unsafe_pts.push_back(pts[i]);
+                    unsafe_indices.push_back(i);
+                }
+                if(adaptive_abstraction)
+                    adaptive_abstraction->recordMargins(
+                            native_safe_pts, native_margins);
+                if(unsafe_pts.empty()) return retVal;
+                auto confirmed = graphBatchIsPointSafe(unsafe_pts);
+                if(confirmed.size() != unsafe_pts.size())
+                    return std::vector<bool>();
+                for(auto i = 0u; i < unsafe_indices.size(); ++i)
+                    retVal[unsafe_indices[i]] = confirmed[i];
+                return retVal;
+            };
+
+    grid::verification_engine_type_t verification_engine = 
         grid::DiscreteSearchVerificationEngine(
                 discrete_search_attempt_threshold_func,
                 all_valid_discretization_strategy,
-                isPointSafe);
+                graphIsPointSafe);
+    if(async_queries)
+    {
+        std::cout << "Coalescing safety queries: batches of up to " 
+            << async_batch_size << "\n";
+        safety_coalescer.reset(
+                new thread_tool::QueryCoalescer<grid::point, bool>(
+                    graphBatchIsPointSafe, async_batch_size, async_max_wait));
+        verification_engine = 
+            grid::DiscreteSearchVerificationEngine(
+                    discrete_search_attempt_threshold_func,
+                    all_valid_discretization_strategy,
+                    safety_coalescer->asyncFunction(),
+                    async_batch_size);
+    }
 
     // create the initial region from the initial activation
     // and the user provided radius
@@ -412,76 +1176,347 @@ int main(int argc, char* argv[])
 
     orig_region = grid::snapToDomainRange(orig_region, domain_range);
 
-    ARFramework arframework(
-            gm,
-            domain_range,
-            init_act_point,
-            granularity_parsed,
-            orig_region,
-            isPointSafe,
-            verification_engine,
-            abstraction_strategy,
-            refinement_strategy
-            );
-    shutdown_callback = [&](){ arframework.join(); };
-    auto handle = signal(SIGINT, shutdown_handler);
-    std::vector<std::thread> thread_pool;
-
-    for(auto i = 0u; i < num_threads; ++i)
-    {
-        thread_pool.emplace_back([&](){ arframework.run(); });
-    }
-
-    for(auto&& t : thread_pool)
-        t.join();
-
-    std::cout << "All threads joined\n";
-
-    auto now = std::chrono::system_clock::now();
-    auto now_c = std::chrono::system_clock::to_time_t(now);
-    auto now_tm = std::localtime(&now_c); 
-    const unsigned BUFFER_SIZE = 30u;
-    char buffer[BUFFER_SIZE];
-    strftime(buffer, BUFFER_SIZE, "%Y_%m_%d_%H_%M_%S", now_tm);
-    auto timestamp = std::string(buffer);
-    auto report_function = [&](grid::point const& adv_exp)
-    {
-        static unsigned index = 0;
-        std::vector<float> tmp(adv_exp.begin(), adv_exp.end());
-        std::vector<std::size_t> tmp_size(batch_input_shape.begin(),
-                batch_input_shape.end());
-        auto adv_exp_tensor_proto = tensorflow::tensor::CreateTensorProto(
-                tmp,
-                tmp_size);
-        auto classification = graph_tool::getClassOfClassificationVector(
-                gm.feedThroughModel(
-                    std::bind(graph_tool::makeFeedDict, 
-                        input_layer, adv_exp, batch_input_shape),
-                    &graph_tool::parseGraphOutToVector,
-                    {output_layer})
-                );
-        if(!gm.ok())
-            LOG(ERROR) << "GM: error in report function";
-        std::stringstream file_name;
-        file_name << timestamp 
-            << "_" << index << "_" << orig_class << "_" 
-            << classification << ".pb";
-        ++index;
-        auto file_path = tensorflow::io::JoinPath(output_dir, 
-                file_name.str());
-        auto write_status = 
-            WriteBinaryProto(
-                    tensorflow::Env::Default(), 
-                    file_path,
-                    adv_exp_tensor_proto);
-        if(!write_status.ok())
-        {
-            LOG(ERROR) << "Couldn't write file " << file_path;
+    auto fixed_refinement_strategy =
+        grid::HierarchicalDimensionRefinementStrategy(
+                dimension_selection_strategy,
+                2u,
+                2u);
+    grid::region_refinement_strategy_t refinement_strategy = 
+        fixed_refinement_strategy;
+    if(refinement_mode == "adaptive")
+    {
+        // the per-region overhead of the cost model is the cpu work of
+        // refining a region and generating the points of a child. the
+        // model queries of the abstraction are already priced by
+        // point_cost, so points are generated without a model, and
+        // the first (cold) sample is not timed
+        const auto num_region_cost_runs = 5;
+        auto sample_region_cost = [&]()
+        {
+            auto sample_subregions = fixed_refinement_strategy(orig_region);
+            if(sample_subregions.empty()) return;
+            auto sample_points = grid::RandomPointRegionAbstraction(
+                    std::max(1, num_abstractions))(*sample_subregions.begin());
+            for(auto&& pt : sample_points)
+                grid::enforceSnapDiscreteGridInPlace(
+                        pt, init_act_point, granularity_parsed);
+        };
+        sample_region_cost();
+        auto region_start = std::chrono::steady_clock::now();
+        for(auto i = 0; i < num_region_cost_runs; ++i)
+            sample_region_cost();
+        long double region_cost = 
+            std::chrono::duration<long double>(
+                    std::chrono::steady_clock::now() - region_start).count()
+            / num_region_cost_runs;
+        auto adaptive_refinement_strategy = 
+            grid::AdaptiveDimensionRefinementStrategy(
+                    dimension_selection_strategy,
+                    init_act_point,
+                    granularity_parsed,
+                    discrete_search_attempt_threshold - 1ull,
+                    max_refinement_children,
+                    {point_cost, region_cost});
+        auto first_choice = 
+            adaptive_refinement_strategy.chooseRefinement(orig_region);
+        std::cout << "Using adaptive refinement\n";
+        std::cout << "Point cost (s): " << point_cost 
+            << " Region cost (s): " << region_cost << "\n";
+        std::cout << "Max children per refinement: " 
+            << adaptive_refinement_strategy.maxChildren() << "\n";
+        std::cout << "Initial refinement: divisor " << first_choice.first
+            << " dimensions " << first_choice.second << "\n";
+        refinement_strategy = adaptive_refinement_strategy;
+    }
+
+    // everything after the construction of the framework, shared by
+    // the strategy instantiations below
+    auto run_framework = [&](auto& arframework)
+    {
+        arframework.set_frontier_partitions(gm.numSessions());
+        std::cout << "Sessions and frontier partitions: " 
+            << gm.numSessions() << " (" << session_pool << ")\n";
+        if(frontier_memory_cap_mb > 0u)
+        {
+            if(frontier_spill_file.empty())
+                frontier_spill_file = 
+                    tensorflow::io::JoinPath(output_dir, "frontier_spill.bin");
+            std::cout << "Frontier memory cap (MB): " << frontier_memory_cap_mb
+                << " spilling to " << frontier_spill_file << "\n";
+            arframework.set_frontier_memory_cap(
+                    frontier_memory_cap_mb * 1024ull * 1024ull,
+                    frontier_spill_file);
+        }
+        if(adaptive_abstraction)
+        {
+            auto adaptive = *adaptive_abstraction;
+            arframework.set_abstraction_feedback(
+                    [adaptive](
+                        grid::region const& refined,
+                        std::vector<grid::point> const& points,
+                        std::vector<bool> const& safe,
+                        std::set<grid::region, grid::region_less_compare> 
+                            const& siblings) mutable
+                    {
+                        adaptive.feedback(refined, points, safe, siblings);
+                    });
+        }
+        if(safe_point_filter_mb > 0u)
+        {
+            std::cout << "Safe point filter (MB): " 
+                << safe_point_filter_mb << "\n";
+            arframework.set_safe_point_filter(
+                    safe_point_filter_mb * 1024ull * 1024ull);
+        }
+        std::unique_ptr<AdversarialExampleStore> adv_example_store;
+        if(!adv_example_store_dir.empty())
+        {
+            adv_example_store.reset(new AdversarialExampleStore(
+                        adv_example_store_dir,
+                        AdversarialExampleStore::hashFile(graph_path),
+                        AdversarialExampleStore::hashPoint(init_act_point),
+                        init_act_point.size()));
+            // stored points may come from a run with another radius or
+            // granularity, keep the ones on this grid inside orig_region
+            std::set<grid::point> candidates;
+            for(auto&& pt : adv_example_store->load())
+            {
+                if(pt.size() != init_act_point.size()) continue;
+                auto snapped_pt = grid::enforceSnapDiscreteGrid(
+                        pt, init_act_point, granularity_parsed);
+                if(grid::isInDomainRange(snapped_pt, orig_region))
+                    candidates.insert(snapped_pt);
+            }
+            std::vector<grid::point> stored_points(
+                    candidates.begin(), candidates.end());
+            std::vector<grid::point> known_adv_examples;
+            // re-check the stored points with the graph (never the
+            // native model), in batches of the pipeline batch size, a
+            // batch that fails confirms none of its points
+            std::vector<grid::point> recheck_batch;
+            for(auto begin = 0u; begin < stored_points.size(); 
+                    begin += pipeline_config.batch_size)
+            {
+                auto end = std::min(stored_points.size(), 
+                        begin + pipeline_config.batch_size);
+                recheck_batch.assign(stored_points.begin() + begin,
+                        stored_points.begin() + end);
+                auto safe = graphBatchIsPointSafe(recheck_batch);
+                if(safe.size() != recheck_batch.size())
+                {
+                    LOG(ERROR) << "Could not re-check stored points " 
+                        << begin << " to " << end;
+                    continue;
+                }
+                for(auto i = 0u; i < safe.size(); ++i)
+                    if(!safe[i])
+                        known_adv_examples.push_back(recheck_batch[i]);
+            }
+            std::cout << "Adversarial example store: " 
+                << adv_example_store->path() << "\n";
+            std::cout << "Stored adversarial examples in region: " 
+                << stored_points.size() << " confirmed: " 
+                << known_adv_examples.size() << "\n";
+            arframework.seed_adversarial_examples(known_adv_examples);
+        }
+
+        auto setup_seconds = seconds_since(startup_start) 
+            - assets_seconds - warmup_seconds;
+        std::cout << "########## Startup ##########\n";
+        std::cout << "Graph load (s): " << graph_load_seconds << "\n";
+        std::cout << "Initial activation load (s): " 
+            << init_act_load_seconds << "\n";
+        if(hasLabelProto)
+            std::cout << "Label load (s): " << label_load_seconds << "\n";
+        if(needsAverages)
+            std::cout << "Class averages load (s): " 
+                << averages_load_seconds << "\n";
+        std::cout << "Assets loaded and checked (s): " 
+            << assets_seconds - autotune_seconds << "\n";
+        if(session_autotune)
+            std::cout << "Session autotune (s): " << autotune_seconds << "\n";
+        std::cout << "Warmup (s): " << warmup_seconds << " (" 
+            << warmup_runs << " runs per batch size)\n";
+        std::cout << "Strategy setup (s): " << setup_seconds << "\n";
+        std::cout << "Total startup (s): " 
+            << seconds_since(startup_start) << "\n";
+
+        shutdown_callback = [&](){ arframework.join(); };
+        auto handle = signal(SIGINT, shutdown_handler);
+        std::vector<std::thread> thread_pool;
+
+        if(pipeline)
+        {
+            std::cout << "Pipeline threads: selection " 
+                << pipeline_config.selection_threads
+                << " preparation " << pipeline_config.preparation_threads
+                << " inference " << pipeline_config.inference_threads
+                << " integration " << pipeline_config.integration_threads
+                << " batch size " << pipeline_config.batch_size << "\n";
+            arframework.set_batch_safety_predicate(batchIsPointSafe);
+            thread_pool.emplace_back([&]()
+                    {
+                        arframework.run_pipeline(pipeline_config);
+                    });
+        }
+        for(auto i = 0u; !pipeline && i < num_threads; ++i)
+        {
+            auto session = session_of_worker(i);
+            thread_pool.emplace_back([&, session]()
+                    {
+                        GraphManager::setThreadSession(session);
+                        arframework.run(session);
+                    });
+            auto pinned = true;
+            if(thread_affinity == "compact")
+                pinned = thread_tool::pinThreadToCores(thread_pool.back(), 
+                        {i % thread_tool::numCores()});
+            else if(thread_affinity == "numa")
+                pinned = thread_tool::pinThreadToCores(thread_pool.back(),
+                        numa_nodes[session_pool == "numa" 
+                            ? session : i % numa_nodes.size()]);
+            if(!pinned)
+                LOG(ERROR) << "Could not pin worker " << i;
+        }
+
+        for(auto&& t : thread_pool)
+            t.join();
+
+        std::cout << "All threads joined\n";
+        if(arframework.lost_regions() > 0u)
+            std::cout << "Search incomplete: " << arframework.lost_regions()
+                << " unverified regions could not be read back from the "
+                << "frontier spill file and were not verified\n";
+        else if(arframework.exhausted())
+            std::cout << "Search exhausted, every region was processed\n";
+        if(adaptive_abstraction)
+            for(auto&& arm : adaptive_abstraction->stats())
+                std::cout << "Abstraction " << arm.name << ": " 
+                    << arm.calls << " regions, " << arm.points 
+                    << " points classified, " << arm.unsafe << " unsafe\n";
+
+        auto now = std::chrono::system_clock::now();
+        auto now_c = std::chrono::system_clock::to_time_t(now);
+        auto now_tm = std::localtime(&now_c); 
+        const unsigned BUFFER_SIZE = 30u;
+        char buffer[BUFFER_SIZE];
+        strftime(buffer, BUFFER_SIZE, "%Y_%m_%d_%H_%M_%S", now_tm);
+        auto timestamp = std::string(buffer);
+        std::vector<grid::point> reported_adv_examples;
+        auto report_function = [&](grid::point const& adv_exp)
+        {
+            reported_adv_examples.push_back(adv_exp);
+            static unsigned index = 0;
+            std::vector<float> tmp(adv_exp.begin(), adv_exp.end());
+            std::vector<std::size_t> tmp_size(batch_input_shape.begin(),
+                    batch_input_shape.end());
+            auto adv_exp_tensor_proto = tensorflow::tensor::CreateTensorProto(
+                    tmp,
+                    tmp_size);
+            auto classification = graph_tool::getClassOfClassificationVector(
+                    gm.feedThroughModel(
+                        std::bind(graph_tool::makeFeedDict, 
+                            input_layer, adv_exp, batch_input_shape),
+                        &graph_tool::parseGraphOutToVector,
+                        {output_layer})
+                    );
+            if(!gm.ok())
+                LOG(ERROR) << "GM: error in report function";
+            std::stringstream file_name;
+            file_name << timestamp 
+                << "_" << index << "_" << orig_class << "_" 
+                << classification << ".pb";
+            ++index;
+            auto file_path = tensorflow::io::JoinPath(output_dir, 
+                    file_name.str());
+            auto write_status = 
+                WriteBinaryProto(
+                        tensorflow::Env::Default(), 
+                        file_path,
+                        adv_exp_tensor_proto);
+            if(!write_status.ok())
+            {
+                LOG(ERROR) << "Couldn't write file " << file_path;
+            }
+        };
+        std::cout << "reporting...\n";
+
+        arframework.report(report_function);
+
+        if(adv_example_store && 
+                !adv_example_store->save(reported_adv_examples))
+        {
+            LOG(ERROR) << "Could not update adversarial example store";
         }
     };
-    std::cout << "reporting...\n";
 
-    arframework.report(report_function);
+    // the default strategy combinations run with their concrete types
+    // so the worker loop calls them without type erasure
+    auto fixed_refinement = refinement_strategy
+        .target<grid::HierarchicalDimensionRefinementStrategy>();
+    auto discrete_search = verification_engine
+        .target<grid::DiscreteSearchVerificationEngine>();
+    auto fgsm_abstraction = abstraction_strategy
+        .target<grid::ModifiedFGSMWithFallbackRegionAbstraction>();
+    auto random_search_abstraction = abstraction_strategy
+        .target<grid::RandomSearchRegionAbstraction>();
+    auto static_dispatch = static_dispatch_str == "true" &&
+        fixed_refinement && discrete_search;
+    if(static_dispatch && fgsm_abstraction)
+    {
+        std::cout << "Static strategy dispatch: modified FGSM, fixed refinement\n";
+        BasicARFramework<
+            grid::ModifiedFGSMWithFallbackRegionAbstraction,
+            grid::HierarchicalDimensionRefinementStrategy,
+            grid::DiscreteSearchVerificationEngine,
+            decltype(isPointSafe)> arframework(
+                    gm,
+                    domain_range,
+                    init_act_point,
+                    granularity_parsed,
+                    orig_region,
+                    isPointSafe,
+                    *discrete_search,
+                    *fgsm_abstraction,
+                    *fixed_refinement
+                    );
+        run_framework(arframework);
+    }
+    else if(static_dispatch && random_search_abstraction)
+    {
+        std::cout << "Static strategy dispatch: random search, fixed refinement\n";
+        BasicARFramework<
+            grid::RandomSearchRegionAbstraction,
+            grid::HierarchicalDimensionRefinementStrategy,
+            grid::DiscreteSearchVerificationEngine,
+            decltype(isPointSafe)> arframework(
+                    gm,
+                    domain_range,
+                    init_act_point,
+                    granularity_parsed,
+                    orig_region,
+                    isPointSafe,
+                    *discrete_search,
+                    *random_search_abstraction,
+                    *fixed_refinement
+                    );
+        run_framework(arframework);
+    }
+    else
+    {
+        ARFramework arframework(
+                gm,
+                domain_range,
+                init_act_point,
+                granularity_parsed,
+                orig_region,
+                isPointSafe,
+                verification_engine,
+                abstraction_strategy,
+                refinement_strategy
+                );
+        run_framework(arframework);
+    }
 
     std::cout << "done\n";
     return 0;
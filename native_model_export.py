@@ -0,0 +1,123 @@
+'''
+Exports the weights of a frozen conv/pool/dense graph (such as the ones
+written by the mnist, cifar10 and gtsrb gradient models) into the binary
+format read by NativeModel.
+The chain of ops from the input placeholder to the output node is
+walked; Conv2D (SAME padding, stride 1), MaxPool (VALID, window equal to
+the stride), MatMul, BiasAdd, Relu, Reshape, Identity and Softmax are
+supported.
+'''
+
+import argparse
+import struct
+
+import numpy as np
+import tensorflow as tf
+from tensorflow.python.framework import tensor_util
+
+LAYER_CONV2D = 1
+LAYER_MAXPOOL = 2
+LAYER_DENSE = 3
+LAYER_SOFTMAX = 4
+
+def loadGraphDef(path):
+    graph_def = tf.GraphDef()
+    with open(path, 'rb') as f:
+        graph_def.ParseFromString(f.read())
+    return graph_def
+
+def nodeName(input_name):
+    return input_name.split(':')[0].lstrip('^')
+
+def constValue(nodes, name):
+    node = nodes[nodeName(name)]
+    while node.op == 'Identity':
+        node = nodes[nodeName(node.input[0])]
+    if node.op != 'Const':
+        raise ValueError('expected a constant for ' + name + ', got ' + node.op)
+    return tensor_util.MakeNdarray(node.attr['value'].tensor)
+
+def opChain(nodes, input_name, output_name):
+    '''data path from the output back to the input, in forward order'''
+    chain = []
+    name = nodeName(output_name)
+    while name != input_name:
+        node = nodes[name]
+        chain.append(node)
+        if not node.input:
+            raise ValueError('output does not depend on ' + input_name)
+        name = nodeName(node.input[0])
+    chain.reverse()
+    return chain
+
+def exportModel(graph_path, input_name, output_name, out_path):
+    graph_def = loadGraphDef(graph_path)
+    nodes = {node.name: node for node in graph_def.node}
+    shape = [d.size for d in nodes[input_name].attr['shape'].shape.dim][1:]
+    while len(shape) < 3:
+        shape = shape + [1]
+    if len(shape) == 3 and shape[1] == 1 and shape[2] == 1:
+        # flat input
+        shape = [1, 1, shape[0]]
+
+    layers = []
+    for node in opChain(nodes, input_name, output_name):
+        if node.op == 'Conv2D':
+            if node.attr['padding'].s != b'SAME' or \
+                    list(node.attr['strides'].list.i) != [1, 1, 1, 1]:
+                raise ValueError('only SAME stride 1 convolutions are supported')
+            kernel = constValue(nodes, node.input[1]).astype(np.float32)
+            layers.append({'type': LAYER_CONV2D, 'relu': 0,
+                'a': kernel.shape[0], 'b': kernel.shape[1], 'c': kernel.shape[3],
+                'weights': kernel, 'bias': np.zeros(kernel.shape[3], np.float32)})
+        elif node.op == 'MaxPool':
+            ksize = list(node.attr['ksize'].list.i)
+            strides = list(node.attr['strides'].list.i)
+            if node.attr['padding'].s != b'VALID' or ksize != strides or \
+                    ksize[1] != ksize[2]:
+                raise ValueError('only square VALID pooling with stride equal to the window is supported')
+            layers.append({'type': LAYER_MAXPOOL, 'relu': 0,
+                'a': ksize[1], 'b': 0, 'c': 0,
+                'weights': np.zeros(0, np.float32), 'bias': np.zeros(0, np.float32)})
+        elif node.op == 'MatMul':
+            if node.attr['transpose_a'].b or node.attr['transpose_b'].b:
+                raise ValueError('transposed MatMul is not supported')
+            weights = constValue(nodes, node.input[1]).astype(np.float32)
+            layers.append({'type': LAYER_DENSE, 'relu': 0,
+                'a': weights.shape[1], 'b': 0, 'c': 0,
+                'weights': weights, 'bias': np.zeros(weights.shape[1], np.float32)})
+        elif node.op in ('BiasAdd', 'Add', 'AddV2'):
+            layers[-1]['bias'] = layers[-1]['bias'] + \
+                constValue(nodes, node.input[1]).astype(np.float32).reshape(-1)
+        elif node.op == 'Relu':
+            layers[-1]['relu'] = 1
+        elif node.op == 'Softmax':
+            layers.append({'type': LAYER_SOFTMAX, 'relu': 0,
+                'a': 0, 'b': 0, 'c': 0,
+                'weights': np.zeros(0, np.float32), 'bias': np.zeros(0, np.float32)})
+        elif node.op in ('Reshape', 'Identity'):
+            # NHWC flattening matches the native layout
+            pass
+        else:
+            raise ValueError('unsupported op ' + node.op + ' (' + node.name + ')')
+
+    with open(out_path, 'wb') as f:
+        f.write(b'ARFNET01')
+        f.write(struct.pack('<IIII', shape[0], shape[1], shape[2], len(layers)))
+        for layer in layers:
+            f.write(struct.pack('<IIIII', layer['type'], layer['relu'],
+                layer['a'], layer['b'], layer['c']))
+            for values in (layer['weights'], layer['bias']):
+                flat = np.ascontiguousarray(values, dtype='<f4').reshape(-1)
+                f.write(struct.pack('<Q', flat.size))
+                f.write(flat.tobytes())
+    print('Exported', len(layers), 'layers to', out_path)
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--graph', required=True, help='frozen graph (.pb)')
+    parser.add_argument('--input_layer', required=True, help='input placeholder name')
+    parser.add_argument('--output_layer', required=True, help='output node name, e.g. probabilities_out')
+    parser.add_argument('--output', required=True, help='path of the exported model')
+    args = parser.parse_args()
+    exportModel(args.graph, args.input_layer, args.output_layer, args.output)
@@ -43,18 +43,16 @@ tensorflow::Tensor graph_tool::pointsToTensor(
     auto flattened = retVal.flat<float>();
     for(auto i = 0u; i < p.size(); ++i)
         for(auto j = 0u; j < p[i].size(); ++j)
-            flattened(i) = (float)p[i][j];
+            flattened(i*p[i].size() + j) = (float)p[i][j];
     return retVal;
 }
 
 grid::point graph_tool::tensorToPoint(
         tensorflow::Tensor const& t)
 {
-    grid::point retVal;
     auto flattened = t.flat<float>();
-    for(auto i = 0u; i < flattened.size(); ++i)
-        retVal.push_back(flattened(i));
-    return retVal;
+    return grid::point(flattened.data(), 
+            flattened.data() + flattened.size());
 }
 
 std::vector<grid::point> graph_tool::tensorToPoints(
@@ -65,14 +63,12 @@ std::vector<grid::point> graph_tool::tensorToPoints(
     auto pointLength = 1u;
     for(auto i = 1u; i < t.dims(); ++i)
         pointLength *= t.dim_size(i);
-    auto flattened = t.flat<float>();
+    auto data = t.flat<float>().data();
+    retVal.reserve(numPoints);
     for(auto i = 0u; i < numPoints; ++i)
-    {
-        grid::point tmp(pointLength);
-        for(auto j = 0u; j < pointLength; ++j)
-            tmp[j] = flattened(i*pointLength + j);
-        retVal.push_back(tmp);
-    }
+        retVal.emplace_back(
+                data + i*pointLength, 
+                data + (i + 1)*pointLength);
     return retVal;
 }
 
@@ -84,6 +80,122 @@ graph_tool::feed_dict_type_t graph_tool::makeFeedDict(
     return {{input_name, graph_tool::pointToTensor(p, shape)}};
 }
 
+graph_tool::feed_dict_type_t graph_tool::makeBatchFeedDict(
+        std::string const& input_name, 
+        std::vector<grid::point> const& p,
+        std::vector<tensorflow::int64> const& shapeOfEachPoint)
+{
+    return {{input_name, graph_tool::pointsToTensor(p, shapeOfEachPoint)}};
+}
+
+graph_tool::BatchFeed::BatchFeed(
+        std::string const& input_name,
+        std::vector<tensorflow::int64> const& shapeOfEachPoint,
+        std::size_t initial_capacity)
+    : capacity(std::max<std::size_t>(1u, initial_capacity)),
+    batch_size(0u),
+    inputs(),
+    feed()
+{
+    inputs.push_back({shapeOfEachPoint, 1u, tensorflow::Tensor(), {}});
+    feed.push_back({input_name, tensorflow::Tensor()});
+    allocate(inputs.back());
+}
+
+void graph_tool::BatchFeed::addRepeatedInput(
+        std::string const& input_name,
+        grid::point const& value,
+        std::vector<tensorflow::int64> const& shapeOfEachPoint)
+{
+    inputs.push_back({shapeOfEachPoint, 1u, tensorflow::Tensor(), value});
+    feed.push_back({input_name, tensorflow::Tensor()});
+    allocate(inputs.back());
+    batch_size = 0u;
+}
+
+void graph_tool::BatchFeed::allocate(input_buffer& input)
+{
+    std::vector<tensorflow::int64> shape = 
+        {static_cast<tensorflow::int64>(capacity)};
+    std::copy(input.shape.begin(), input.shape.end(),
+            std::back_inserter(shape));
+    input.size = 1u;
+    for(auto&& dim : input.shape)
+        input.size *= dim;
+    input.tensor = tensorflow::Tensor(tensorflow::DT_FLOAT,
+            tensorflow::TensorShape(shape));
+    // repeated inputs are written once per allocation
+    if(!input.repeated_value.empty())
+    {
+        auto data = input.tensor.flat<float>().data();
+        for(auto i = 0u; i < capacity; ++i)
+            std::copy(input.repeated_value.begin(), 
+                    input.repeated_value.end(),
+                    data + i*input.size);
+    }
+}
+
+void graph_tool::BatchFeed::reserve(std::size_t n)
+{
+    if(n <= capacity) return;
+    capacity = std::max(n, 2u*capacity);
+    for(auto&& input : inputs)
+        allocate(input);
+    batch_size = 0u;
+}
+
+void graph_tool::BatchFeed::sliceFeed(std::size_t n)
+{
+    // the feed tensors only share the buffers, so they are
+    // updated only when the batch size changes
+    if(n == batch_size) return;
+    for(auto i = 0u; i < inputs.size(); ++i)
+        feed[i].second = n == capacity 
+            ? inputs[i].tensor : inputs[i].tensor.Slice(0, n);
+    batch_size = n;
+}
+
+void graph_tool::BatchFeed::checkSize(grid::point const& p) const
+{
+    if(p.size() == inputs.front().size) return;
+    LOG(ERROR) << "Point of size " << p.size()
+        << " does not match the input layer " << feed.front().first
+        << " of size " << inputs.front().size;
+    std::abort();
+}
+
+graph_tool::feed_dict_type_t const& graph_tool::BatchFeed::pack(
+        std::vector<grid::point> const& p)
+{
+    for(auto&& point : p)
+        checkSize(point);
+    reserve(p.size());
+    auto data = inputs.front().tensor.flat<float>().data();
+    auto pointLength = inputs.front().size;
+    for(auto i = 0u; i < p.size(); ++i)
+        std::copy(p[i].begin(), p[i].end(), data + i*pointLength);
+    sliceFeed(p.size());
+    return feed;
+}
+
+graph_tool::feed_dict_type_t const& graph_tool::BatchFeed::pack(
+        grid::point const& p)
+{
+    checkSize(p);
+    auto data = inputs.front().tensor.flat<float>().data();
+    std::copy(p.begin(), p.end(), data);
+    sliceFeed(1u);
+    return feed;
+}
+
+std::vector<grid::point> graph_tool::parseGraphOutToVectors(
+        std::vector<tensorflow::Tensor> const& out)
+{
+    if(out.empty())
+        return {};
+    return graph_tool::tensorToPoints(out[0]);
+}
+
 grid::point graph_tool::parseGraphOutToVector(
         std::vector<tensorflow::Tensor> const& out)
 {
@@ -92,3 +204,23 @@ grid::point graph_tool::parseGraphOutToVector(
     return graph_tool::tensorToPoint(out[0]);
 }
 
+
+std::vector<std::pair<bool, float>> graph_tool::parseSafetyOut(
+        std::vector<tensorflow::Tensor> const& out)
+{
+    if(out.size() < 2u)
+        return {};
+    auto safe = out[0].flat<bool>();
+    std::vector<std::pair<bool, float>> retVal(safe.size());
+    if(out[1].dtype() == tensorflow::DT_DOUBLE)
+    {
+        auto margin = out[1].flat<double>();
+        for(auto i = 0u; i < retVal.size(); ++i)
+            retVal[i] = {safe(i), static_cast<float>(margin(i))};
+        return retVal;
+    }
+    auto margin = out[1].flat<float>();
+    for(auto i = 0u; i < retVal.size(); ++i)
+        retVal[i] = {safe(i), margin(i)};
+    return retVal;
+}
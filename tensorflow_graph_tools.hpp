@@ -2,6 +2,9 @@
 #define TENSORFLOW_GRAPH_TOOLS_INCLUDED
 
 #include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <functional>
 
 #include "tensorflow/core/framework/tensor.h"
 #include "tensorflow/core/framework/tensor.pb.h"
@@ -19,6 +22,17 @@ namespace graph_tool
         return std::distance(classes.begin(), max_elem);
     }
 
+    // difference of the two largest outputs, 0 for a single output
+    template <class T>
+    double getClassificationMargin(std::vector<T> const& classes)
+    {
+        if(classes.size() < 2u) return 0.0;
+        std::vector<T> top2(2u);
+        std::partial_sort_copy(classes.begin(), classes.end(),
+                top2.begin(), top2.end(), std::greater<T>());
+        return static_cast<double>(top2[0] - top2[1]);
+    }
+
     tensorflow::Tensor pointToTensor(
             grid::point const&,
             std::vector<tensorflow::int64> const&);
@@ -40,7 +54,66 @@ namespace graph_tool
             grid::point const&, 
             std::vector<tensorflow::int64> const&);
 
+    // feeds all points as a single batch, the shape excludes
+    // the batch dimension
+    feed_dict_type_t makeBatchFeedDict(
+            std::string const&, 
+            std::vector<grid::point> const&, 
+            std::vector<tensorflow::int64> const&);
+
+    // reusable feed dict for one input layer, points are written in
+    // place into a tensor of the largest batch packed so far and fed
+    // as a slice of it, so packing does not allocate once the buffer
+    // has grown; not thread safe, keep one per thread
+    class BatchFeed
+    {
+    public:
+        // the shape excludes the batch dimension
+        BatchFeed(
+                std::string const&,
+                std::vector<tensorflow::int64> const&,
+                std::size_t /* initial batch capacity */ = 1u);
+
+        // an extra input with the same value for every point of the
+        // batch (e.g. the label of a gradient layer), the shape
+        // excludes the batch dimension
+        void addRepeatedInput(
+                std::string const&,
+                grid::point const&,
+                std::vector<tensorflow::int64> const&);
+
+        // every point must have the size of the input layer
+        feed_dict_type_t const& pack(std::vector<grid::point> const&);
+        feed_dict_type_t const& pack(grid::point const&);
+    private:
+        struct input_buffer
+        {
+            std::vector<tensorflow::int64> shape;
+            std::size_t size;
+            tensorflow::Tensor tensor;
+            // the value of repeated inputs, empty for the points
+            grid::point repeated_value;
+        };
+        std::size_t capacity;
+        std::size_t batch_size;
+        std::vector<input_buffer> inputs;
+        feed_dict_type_t feed;
+
+        void reserve(std::size_t);
+        void allocate(input_buffer&);
+        void sliceFeed(std::size_t);
+        // aborts if the point does not have the size of the input layer
+        void checkSize(grid::point const&) const;
+    };
+
     grid::point parseGraphOutToVector(std::vector<tensorflow::Tensor> const&);
+    // one point per element of the batch dimension
+    std::vector<grid::point> parseGraphOutToVectors(
+            std::vector<tensorflow::Tensor> const&);
+    // (safe, margin) per element of the batch, from the outputs of
+    // GraphManager::safetyCheck
+    std::vector<std::pair<bool, float>> parseSafetyOut(
+            std::vector<tensorflow::Tensor> const&);
     
 }
 
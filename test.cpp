@@ -1,9 +1,15 @@
 #include "grid_tools.hpp"
+#include "NativeModel.hpp"
+#include "thread_tools.hpp"
 
 #include <cmath>
 #include <cassert>
 #include <iostream>
 #include <set>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <memory>
 
 
 int main()
@@ -137,6 +143,536 @@ int main()
         subreg_volume += grid::regionVolume(subregion);
     assert(subreg_volume == reg_volume);
 
+    grid::region reg_adaptive({{0,4},{0,4},{0,4}});
+    grid::point gran_adaptive({0.25, 0.25, 0.25});
+    grid::point valid_adaptive({0, 0, 0});
+    auto adaptive_refinement = grid::AdaptiveDimensionRefinementStrategy(
+            grid::largestDimFirst, valid_adaptive, gran_adaptive, 
+            100, 64, {0, 0});
+    auto adaptive_choice = adaptive_refinement.chooseRefinement(reg_adaptive);
+    assert(adaptive_choice.first == 4 && adaptive_choice.second == 3);
+    auto adaptive_subregions = adaptive_refinement(reg_adaptive);
+    assert(adaptive_subregions.size() == 64);
+    auto adaptive_volume = (long double)0;
+    for(auto&& subregion : adaptive_subregions)
+    {
+        adaptive_volume += grid::regionVolume(subregion);
+        assert(grid::AllValidDiscretizedPointsAbstraction
+                ::getNumberValidPoints(
+                    subregion, valid_adaptive, gran_adaptive) <= 100);
+    }
+    assert(adaptive_volume == grid::regionVolume(reg_adaptive));
+
+    // the estimate follows the order of the selection strategy and a
+    // dimension is split into no more parts than it has valid points
+    grid::region reg_narrow({{0,4},{0,0.5}});
+    auto narrow_refinement = grid::AdaptiveDimensionRefinementStrategy(
+            [](grid::region const&, std::size_t n)
+            {
+                grid::dim_selection_strategy_return_t dims{1, 0};
+                return grid::dim_selection_strategy_return_t(
+                        dims.begin(), dims.begin() + n);
+            },
+            {0, 0}, {0.25, 0.25}, 1, 64, {0, 0});
+    auto narrow_choice = narrow_refinement.chooseRefinement(reg_narrow);
+    assert(narrow_choice.first == 16 && narrow_choice.second == 2);
+    auto narrow_subregions = narrow_refinement(reg_narrow);
+    assert(narrow_subregions.size() == 32);
+    for(auto&& subregion : narrow_subregions)
+        assert(subregion[1].second - subregion[1].first == 0.25);
+
+    auto safe_store = grid::SafeRegionStore(valid_adaptive, gran_adaptive);
+    safe_store.addRefinement(reg_adaptive, adaptive_subregions);
+    auto last_subregion = *adaptive_subregions.rbegin();
+    auto nested_subregions = hd_refinement(last_subregion);
+    safe_store.addRefinement(last_subregion, nested_subregions);
+    for(auto&& subregion : adaptive_subregions)
+        if(subregion != last_subregion) safe_store.insert(subregion);
+    assert(safe_store.size() == adaptive_subregions.size() - 1);
+    for(auto&& subregion : nested_subregions)
+        safe_store.insert(subregion);
+    assert(safe_store.size() == 1);
+    assert(safe_store.safePoints() == 4096);
+    assert(safe_store.safePoints() == safe_store.latticePoints(reg_adaptive));
+    safe_store.forEach([&](grid::region const& r)
+            {
+                assert(r == reg_adaptive);
+            });
+
+    // an unsafe child keeps its safe siblings from merging, a child that
+    // went to disk and came back still completes its partition
+    auto blocked_store = grid::SafeRegionStore(valid_adaptive, gran_adaptive);
+    blocked_store.addRefinement(reg_adaptive, adaptive_subregions);
+    assert(blocked_store.pending() == adaptive_subregions.size());
+    blocked_store.remove(last_subregion);
+    for(auto&& subregion : adaptive_subregions)
+        if(subregion != last_subregion) blocked_store.insert(subregion);
+    assert(blocked_store.pending() == 0u);
+    assert(blocked_store.size() == adaptive_subregions.size() - 1);
+    auto spilled_store = grid::SafeRegionStore(valid_adaptive, gran_adaptive);
+    spilled_store.addRefinement(reg_adaptive, adaptive_subregions);
+    auto spilled_tag = spilled_store.detach(last_subregion);
+    assert(spilled_store.pending() == adaptive_subregions.size() - 1);
+    spilled_store.attach(last_subregion, spilled_tag);
+    for(auto&& subregion : adaptive_subregions)
+        spilled_store.insert(subregion);
+    assert(spilled_store.pending() == 0u);
+    assert(spilled_store.size() == 1);
+
+    auto batch_calls = 0u;
+    auto pgd = grid::ProjectedGradientRegionAbstraction(
+            8, 5,
+            [&](std::vector<grid::point> const& pts)
+            {
+                ++batch_calls;
+                return std::vector<grid::point>(
+                        pts.size(), grid::point(pts[0].size(), 1.0));
+            },
+            valid_point, granularity, 0.25);
+    auto pgd_points = pgd(reg);
+    assert(batch_calls == 5);
+    assert(pgd_points.size() == 8);
+    for(auto&& pt : pgd_points)
+    {
+        assert(grid::pointIsInRegion(reg, pt));
+        // ascending a constant gradient ends on the last valid point
+        for(auto i = 0u; i < pt.size(); ++i)
+            assert(pt[i] + granularity[i] >= reg[i].second);
+    }
+
+    // toy model: class 1 once the sum of the coordinates exceeds 10
+    auto random_search = grid::RandomSearchRegionAbstraction(
+            4, 10,
+            [](std::vector<grid::point> const& pts)
+            {
+                std::vector<grid::point> logits;
+                for(auto&& pt : pts)
+                {
+                    auto sum = std::accumulate(pt.begin(), pt.end(), 
+                            (long double)0);
+                    logits.push_back({10 - sum, sum - 10});
+                }
+                return logits;
+            },
+            0, valid_point, granularity, 0.5);
+    auto search_points = random_search(reg);
+    assert(search_points.size() >= 4);
+    auto found_adversarial = false;
+    for(auto&& pt : search_points)
+    {
+        assert(grid::pointIsInRegion(reg, pt));
+        auto sum = std::accumulate(pt.begin(), pt.end(), (long double)0);
+        found_adversarial = found_adversarial || sum > 10;
+    }
+    assert(found_adversarial);
+
+    // random streams only depend on the seed and the region, so the
+    // same region gives the same points in any thread and any order
+    auto random_points = grid::RandomPointRegionAbstraction(8);
+    auto first_draw = random_points(reg);
+    std::vector<grid::abstraction_strategy_return_t> thread_draws(4);
+    {
+        std::vector<std::thread> drawers;
+        for(auto i = 0u; i < thread_draws.size(); ++i)
+            drawers.emplace_back([&, i]()
+                    {
+                        thread_draws[i] = 
+                            grid::RandomPointRegionAbstraction(8)(reg);
+                    });
+        for(auto&& t : drawers)
+            t.join();
+    }
+    for(auto&& draw : thread_draws)
+        assert(draw == first_draw);
+    assert(random_points(reg1) != random_points(reg2));
+    assert(grid::randomDimSelection(reg, 2) == 
+            grid::randomDimSelection(reg, 2));
+    grid::setRandomSeed(1u);
+    assert(random_points(reg) != first_draw);
+    grid::setRandomSeed(0u);
+    assert(random_points(reg) == first_draw);
+    assert(pgd(reg) == pgd_points);
+    assert(random_search(reg) == search_points);
+
+    // adaptive abstraction: the arm whose points are unsafe is preferred
+    // and the margins and results of earlier points scale their number
+    {
+        grid::AdaptiveAbstractionStrategy adaptive(
+                {{"low", [](grid::region const& r, std::size_t n)
+                    {
+                        return grid::abstraction_strategy_return_t(
+                                n, grid::point(r.size(), 0));
+                    }},
+                 {"high", [](grid::region const& r, std::size_t n)
+                    {
+                        return grid::abstraction_strategy_return_t(
+                                n, grid::point(r.size(), 1));
+                    }}},
+                4u, 1.0,
+                {0, 0}, {1, 1});
+        grid::region square{{0, 2}, {0, 2}};
+        std::set<grid::region, grid::region_less_compare> no_siblings;
+        for(auto i = 0; i < 50; ++i)
+        {
+            auto generated = adaptive(square);
+            assert(generated.size() == 4u);
+            // points at 1 are unsafe
+            std::vector<bool> safe;
+            for(auto&& pt : generated)
+                safe.push_back(pt[0] != 1);
+            adaptive.feedback(square, generated, safe, no_siblings);
+        }
+        auto arm_stats = adaptive.stats();
+        assert(arm_stats.size() == 2u);
+        assert(arm_stats[1].name == "high");
+        assert(arm_stats[1].calls > arm_stats[0].calls);
+        assert(arm_stats[1].unsafe == arm_stats[1].points);
+        assert(arm_stats[0].unsafe == 0u);
+
+        // siblings of a region with an unsafe point get the full budget
+        grid::region left{{0, 1}, {0, 2}};
+        grid::region right{{1, 2}, {0, 2}};
+        adaptive.feedback(square, {{0.5, 1}}, {false}, {right});
+        assert(adaptive.budgetFor(right) == 4u *
+                grid::AdaptiveAbstractionStrategy::maxFactor);
+        assert(adaptive.budgetFor(right) == 4u);
+
+        // the children of an all safe region get fewer points the larger
+        // the smallest margin of its points, at least one and at most
+        // maxFactor times the base
+        auto classify_square = [&](double margin)
+        {
+            auto generated = adaptive(square);
+            adaptive.recordMargins(generated,
+                    std::vector<double>(generated.size(), margin));
+            adaptive.feedback(square, generated,
+                    std::vector<bool>(generated.size(), true), {left, right});
+        };
+        classify_square(1.0);
+        assert(adaptive.budgetFor(left) == 1u);
+        classify_square(0.25);
+        assert(adaptive.budgetFor(left) == 4u);
+        assert(adaptive.budgetFor(right) == 4u);
+        classify_square(0.05);
+        assert(adaptive.budgetFor(left) == 16u);
+        classify_square(100.0);
+        assert(adaptive.budgetFor(left) == 1u);
+        assert(adaptive(left).size() == 1u);
+        // the margin is dropped once the region itself is refined
+        adaptive.feedback(left, {}, {}, no_siblings);
+        assert(adaptive.budgetFor(left) == 4u);
+    }
+
+    // native model: conv -> maxpool -> dense -> softmax on a 4x4x1 input
+    std::mt19937 weight_gen(7);
+    std::uniform_real_distribution<float> weight_dist(-1.0f, 1.0f);
+    auto random_weights = [&](std::size_t n)
+    {
+        std::vector<float> w(n);
+        for(auto&& v : w) v = weight_dist(weight_gen);
+        return w;
+    };
+    std::vector<NativeModel::Layer> native_layers(4);
+    native_layers[0].type = NativeModel::LayerType::CONV2D;
+    native_layers[0].relu = true;
+    native_layers[0].a = 3; native_layers[0].b = 3; native_layers[0].c = 2;
+    native_layers[0].weights = random_weights(3*3*1*2);
+    native_layers[0].bias = random_weights(2);
+    native_layers[1].type = NativeModel::LayerType::MAXPOOL;
+    native_layers[1].a = 2;
+    native_layers[2].type = NativeModel::LayerType::DENSE;
+    native_layers[2].a = 3;
+    native_layers[2].weights = random_weights(2*2*2*3);
+    native_layers[2].bias = random_weights(3);
+    native_layers[3].type = NativeModel::LayerType::SOFTMAX;
+    NativeModel native_model(4, 4, 1, native_layers);
+    assert(native_model.ok());
+    assert(native_model.inputSize() == 16);
+    assert(native_model.outputSize() == 3);
+    std::vector<grid::point> native_inputs;
+    for(auto i = 0; i < 3; ++i)
+    {
+        auto w = random_weights(16);
+        native_inputs.emplace_back(w.begin(), w.end());
+    }
+    auto native_out = native_model.classify(native_inputs);
+    assert(native_out.size() == 3);
+    for(auto&& out : native_out)
+    {
+        assert(out.size() == 3);
+        auto sum = std::accumulate(out.begin(), out.end(), (long double)0);
+        assert(std::fabs(sum - 1) < 1e-5);
+    }
+    // a batch gives the same outputs as single points
+    auto single_out = native_model.classify({native_inputs[1]});
+    for(auto j = 0u; j < 3; ++j)
+        assert(std::fabs(single_out[0][j] - native_out[1][j]) < 1e-6);
+    assert(native_model.save("/tmp/arframework_test_model.bin"));
+    NativeModel loaded_model("/tmp/arframework_test_model.bin");
+    assert(loaded_model.ok());
+    auto loaded_out = loaded_model.classify(native_inputs);
+    for(auto i = 0u; i < 3; ++i)
+        for(auto j = 0u; j < 3; ++j)
+            assert(loaded_out[i][j] == native_out[i][j]);
+    // neighbours evaluated incrementally from a base point
+    assert(native_model.supportsIncremental());
+    std::vector<grid::point> neighbours(4, native_inputs[0]);
+    neighbours[1][5] += 0.5;
+    neighbours[2][0] -= 0.25;
+    neighbours[2][15] += 0.75;
+    neighbours[3] = native_inputs[2];
+    auto full_out = native_model.classify(neighbours);
+    auto incremental_out = native_model.classifyIncremental(neighbours);
+    assert(incremental_out.size() == 4);
+    for(auto i = 0u; i < 4; ++i)
+        for(auto j = 0u; j < 3; ++j)
+            assert(std::fabs(incremental_out[i][j] - full_out[i][j]) < 1e-5);
+
+    // gradient of the cross entropy agrees with central differences
+    grid::point native_label = {0, 1, 0};
+    auto native_grad = native_model.gradient(native_inputs, native_label);
+    assert(native_grad.size() == 3 && native_grad[0].size() == 16);
+    auto cross_entropy = [&](grid::point const& x)
+    {
+        return -std::log(native_model.classify({x})[0][1]);
+    };
+    for(auto i = 0u; i < 16; ++i)
+    {
+        const long double eps = 1e-3;
+        auto x_plus = native_inputs[0], x_minus = native_inputs[0];
+        x_plus[i] += eps;
+        x_minus[i] -= eps;
+        auto numeric = 
+            (cross_entropy(x_plus) - cross_entropy(x_minus)) / (2*eps);
+        assert(std::fabs(numeric - native_grad[0][i]) < 1e-2);
+    }
+
+    // bounded queue between pipeline stages
+    thread_tool::BoundedQueue<int> stage_queue(2);
+    int queued = 1;
+    assert(stage_queue.push(queued, std::chrono::milliseconds(0)));
+    queued = 2;
+    assert(stage_queue.push(queued, std::chrono::milliseconds(0)));
+    queued = 3;
+    assert(!stage_queue.push(queued, std::chrono::milliseconds(1)));
+    assert(queued == 3);
+    int dequeued = 0;
+    assert(stage_queue.pop(dequeued, std::chrono::milliseconds(0)));
+    assert(dequeued == 1);
+    assert(stage_queue.pop(dequeued, std::chrono::milliseconds(0)));
+    assert(dequeued == 2);
+    assert(!stage_queue.pop(dequeued, std::chrono::milliseconds(1)));
+
+    // coalesced async queries, answered in batches of at most 4
+    {
+        std::size_t largest_batch = 0u;
+        thread_tool::QueryCoalescer<grid::point, bool> positive(
+                [&](std::vector<grid::point> const& pts)
+                {
+                    largest_batch = std::max(largest_batch, pts.size());
+                    std::vector<bool> retVal;
+                    for(auto&& p : pts)
+                        retVal.push_back(p[0] > 0);
+                    return retVal;
+                }, 4u, std::chrono::microseconds(1000));
+        std::vector<grid::point> queries;
+        for(auto i = -5; i < 5; ++i)
+            queries.push_back({static_cast<grid::numeric_type_t>(i)});
+        auto answers = positive.submit(queries);
+        for(auto i = 0u; i < answers.size(); ++i)
+            assert(answers[i].get() == (queries[i][0] > 0));
+        assert(largest_batch == 4u);
+        assert(positive.batchesRun() >= 3u);
+
+        grid::DiscreteSearchVerificationEngine async_search(
+                [](grid::region const&){ return true; },
+                [](grid::region const& r) -> grid::abstraction_strategy_return_t
+                { return {{r[0].first}, {r[0].second}}; },
+                positive.asyncFunction());
+        assert(async_search({{1, 2}}).first ==
+                grid::VERIFICATION_RETURN::SAFE);
+        auto async_unsafe = async_search({{-1, 2}});
+        assert(async_unsafe.first == grid::VERIFICATION_RETURN::UNSAFE);
+        assert(async_unsafe.second == grid::point{-1});
+
+        // a short batch fails the unanswered queries instead of
+        // answering them, the search then does not decide the region
+        thread_tool::QueryCoalescer<grid::point, bool> failing(
+                [](std::vector<grid::point> const& pts)
+                {
+                    return std::vector<bool>(pts.size() / 2u, true);
+                }, 4u, std::chrono::microseconds(1000));
+        auto partial = failing.submit(
+                std::vector<grid::point>{{1}, {2}, {3}, {4}});
+        assert(partial[0].get());
+        auto threw = false;
+        try { partial[3].get(); } catch(std::runtime_error const&) 
+        { threw = true; }
+        assert(threw);
+        std::size_t issued = 0u;
+        grid::DiscreteSearchVerificationEngine chunked_search(
+                [](grid::region const&){ return true; },
+                [](grid::region const& r) -> grid::abstraction_strategy_return_t
+                { 
+                    grid::abstraction_strategy_return_t pts;
+                    for(auto x = r[0].first; x <= r[0].second; x += 1)
+                        pts.push_back({x});
+                    return pts;
+                },
+                [&](grid::point const& p)
+                {
+                    ++issued;
+                    return failing.submit(p);
+                }, 2u);
+        assert(chunked_search({{1, 8}}).first ==
+                grid::VERIFICATION_RETURN::UNKNOWN);
+        assert(issued == 2u);
+    }
+
+    // results recorded concurrently, keyed by their lattice coordinates
+    {
+        grid::LatticeHash lattice_hash({0, 0}, {0.5, 0.5});
+        assert(lattice_hash(grid::point{1, 2}) ==
+                lattice_hash(grid::point{1.0001, 2}));
+        assert(lattice_hash(grid::point{1, 2}) !=
+                lattice_hash(grid::point{2, 1}));
+        assert(lattice_hash(grid::region{{0, 1}, {1, 2}}) !=
+                lattice_hash(grid::region{{0, 1}, {1, 1.5}}));
+
+        // a single bucket forces every insert through the full key check
+        thread_tool::ConcurrentHashSet<grid::point> colliding(1u);
+        assert(colliding.insert(1u, {1, 2}));
+        assert(colliding.insert(1u, {2, 1}));
+        assert(!colliding.insert(1u, {1, 2}));
+        assert(colliding.contains(1u, {2, 1}));
+        assert(!colliding.contains(2u, {2, 1}));
+        assert(colliding.size() == 2u);
+
+        thread_tool::ConcurrentBloomFilter no_filter;
+        assert(!no_filter.insert(lattice_hash(grid::point{1, 2})));
+        assert(!no_filter.mayContain(lattice_hash(grid::point{1, 2})));
+        thread_tool::ConcurrentBloomFilter known_safe(1u << 16);
+        {
+            std::vector<std::thread> inserters;
+            for(auto t = 0; t < 4; ++t)
+                inserters.emplace_back([&, t]()
+                        {
+                            for(auto i = t; i < 400; i += 4)
+                                known_safe.insert(lattice_hash(
+                                            grid::point{i*0.5, 0}));
+                        });
+            for(auto&& inserter : inserters)
+                inserter.join();
+        }
+        auto false_positives = 0u;
+        for(auto i = 0; i < 400; ++i)
+        {
+            assert(known_safe.mayContain(lattice_hash(grid::point{i*0.5, 0})));
+            if(known_safe.mayContain(lattice_hash(grid::point{i*0.5, 1})))
+                ++false_positives;
+        }
+        assert(false_positives < 10u);
+        assert(!known_safe.insert(lattice_hash(grid::point{0, 0})));
+
+        thread_tool::ConcurrentHashMap<grid::region, grid::point>
+            recorded(16u);
+        std::vector<std::thread> recorders;
+        for(auto t = 0; t < 4; ++t)
+            recorders.emplace_back([&]()
+                    {
+                        // every thread records the same 100 regions
+                        for(auto i = 0; i < 100; ++i)
+                        {
+                            grid::region r{{i*0.5, i*0.5 + 0.5}};
+                            recorded.insert(lattice_hash(r), r, {i*0.5});
+                        }
+                    });
+        for(auto&& recorder : recorders)
+            recorder.join();
+        assert(recorded.size() == 100u);
+        std::vector<std::vector<grid::point>> popped(4);
+        recorders.clear();
+        for(auto t = 0; t < 4; ++t)
+            recorders.emplace_back([&, t]()
+                    {
+                        grid::region r;
+                        grid::point p;
+                        for(auto i = 0; i < 10 && recorded.pop(r, p); ++i)
+                        {
+                            assert(grid::pointIsInRegion(r, p));
+                            popped[t].push_back(p);
+                        }
+                    });
+        for(auto&& recorder : recorders)
+            recorder.join();
+        std::set<grid::point> popped_once;
+        for(auto&& thread_popped : popped)
+            for(auto&& p : thread_popped)
+                assert(popped_once.insert(p).second);
+        assert(popped_once.size() == 40u);
+        assert(recorded.size() == 60u);
+        std::size_t remaining = 0u;
+        recorded.forEach([&](grid::region const& r, grid::point const& p)
+                {
+                    assert(grid::pointIsInRegion(r, p));
+                    assert(popped_once.count(p) == 0u);
+                    ++remaining;
+                });
+        assert(remaining == 60u);
+        grid::region popped_region;
+        grid::point popped_point;
+        while(recorded.pop(popped_region, popped_point)) {}
+        assert(recorded.empty());
+
+        // popped entries are unlinked and freed, a single bucket stays
+        // as short as its live entries
+        thread_tool::ConcurrentHashMap<grid::point, std::shared_ptr<int>>
+            churn(1u);
+        auto tracked = std::make_shared<int>(0);
+        for(auto round = 0; round < 100; ++round)
+        {
+            for(auto i = 0; i < 10; ++i)
+                assert(churn.insert(i, {(long double)i}, tracked));
+            grid::point p;
+            std::shared_ptr<int> v;
+            while(churn.pop(p, v)) {}
+            v.reset();
+        }
+        assert(churn.empty());
+        assert(tracked.use_count() == 1);
+        assert(churn.insert(3u, {3}, tracked));
+        assert(churn.contains(3u, {3}));
+    }
+
+    // kernels specialized for a registered input size agree with the
+    // generic ones
+    {
+        assert(grid::kernelsFor(784u).dims == 784u);
+        assert(grid::kernelsFor(785u).dims == 0u);
+        std::mt19937 kernel_gen(5);
+        std::uniform_real_distribution<double> coordinate(-0.5, 1.5);
+        grid::point p(784u), ref(784u, 0.1), gran(784u, 0.25);
+        grid::region range(784u, {0, 1});
+        for(auto&& x : p) x = coordinate(kernel_gen);
+        auto generic = grid::enforceSnapDiscreteGrid(p, ref, gran);
+        auto generic_in_range = grid::isInDomainRange(p, range);
+        auto specialized_785 = grid::useKernelsFor(785u);
+        assert(!specialized_785);
+        auto specialized_784 = grid::useKernelsFor(784u);
+        assert(specialized_784);
+        assert(grid::activeKernels(784u).dims == 784u);
+        assert(grid::activeKernels(3u).dims == 0u);
+        assert(grid::enforceSnapDiscreteGrid(p, ref, gran) == generic);
+        assert(grid::isInDomainRange(p, range) == generic_in_range);
+        auto snapped = grid::snapToDomainRange(p, range);
+        assert(grid::isInDomainRange(snapped, range));
+        grid::region open_range(784u, {0, 2});
+        assert(grid::pointIsInRegion(open_range, snapped));
+        snapped[7] = 2;
+        assert(!grid::pointIsInRegion(open_range, snapped));
+        grid::useKernelsFor(0u);
+    }
+
     // TODO: test IntelliFGSM with real model
     return 0;
 }
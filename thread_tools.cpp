@@ -0,0 +1,111 @@
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "thread_tools.hpp"
+
+unsigned thread_tool::numCores()
+{
+    auto cores = std::thread::hardware_concurrency();
+    return cores == 0u ? 1u : cores;
+}
+
+namespace
+{
+    // parses a sysfs cpu list such as "0-3,8-11"
+    std::vector<unsigned> parseCpuList(std::string const& list)
+    {
+        std::vector<unsigned> retVal;
+        std::stringstream list_stream(list);
+        std::string range;
+        while(std::getline(list_stream, range, ','))
+        {
+            if(range.empty()) continue;
+            auto dash = range.find('-');
+            auto first = std::stoul(range.substr(0, dash));
+            auto last = dash == std::string::npos 
+                ? first : std::stoul(range.substr(dash + 1));
+            for(auto core = first; core <= last; ++core)
+                retVal.push_back(static_cast<unsigned>(core));
+        }
+        return retVal;
+    }
+}
+
+std::vector<std::vector<unsigned>> thread_tool::numaNodeCores()
+{
+    std::vector<std::vector<unsigned>> retVal;
+    for(auto node = 0u; ; ++node)
+    {
+        std::ifstream cpulist("/sys/devices/system/node/node" 
+                + std::to_string(node) + "/cpulist");
+        if(!cpulist) break;
+        std::string list;
+        std::getline(cpulist, list);
+        try
+        {
+            auto cores = parseCpuList(list);
+            if(!cores.empty()) retVal.push_back(cores);
+        }
+        catch(std::exception const&)
+        {
+            break;
+        }
+    }
+    if(retVal.empty())
+    {
+        std::vector<unsigned> all_cores(numCores());
+        for(auto i = 0u; i < all_cores.size(); ++i)
+            all_cores[i] = i;
+        retVal.push_back(all_cores);
+    }
+    return retVal;
+}
+
+#ifdef __linux__
+namespace
+{
+    bool pinNativeHandle(
+            pthread_t handle, 
+            std::vector<unsigned> const& cores)
+    {
+        if(cores.empty()) return false;
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        for(auto&& core : cores)
+            if(core < CPU_SETSIZE) CPU_SET(core, &cpu_set);
+        return pthread_setaffinity_np(
+                handle, sizeof(cpu_set_t), &cpu_set) == 0;
+    }
+}
+
+bool thread_tool::pinThreadToCores(
+        std::thread& t, 
+        std::vector<unsigned> const& cores)
+{
+    return pinNativeHandle(t.native_handle(), cores);
+}
+
+bool thread_tool::pinCurrentThreadToCores(std::vector<unsigned> const& cores)
+{
+    return pinNativeHandle(pthread_self(), cores);
+}
+#else
+bool thread_tool::pinThreadToCores(
+        std::thread&, 
+        std::vector<unsigned> const&)
+{
+    return false;
+}
+
+bool thread_tool::pinCurrentThreadToCores(std::vector<unsigned> const&)
+{
+    return false;
+}
+#endif
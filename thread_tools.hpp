@@ -0,0 +1,541 @@
+#ifndef THREAD_TOOLS_INCLUDED
+#define THREAD_TOOLS_INCLUDED
+
+#include <thread>
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <exception>
+#include <stdexcept>
+#include <atomic>
+#include <cstdint>
+
+namespace thread_tool
+{
+    // number of logical cores available to the process
+    unsigned numCores();
+
+    // restricts a thread to the given logical cores
+    // returns false if affinity is not supported or the call failed
+    bool pinThreadToCores(std::thread&, std::vector<unsigned> const&);
+    bool pinCurrentThreadToCores(std::vector<unsigned> const&);
+
+    // logical cores of each NUMA node, read from sysfs
+    // a machine without NUMA information is a single node with all cores
+    std::vector<std::vector<unsigned>> numaNodeCores();
+
+    // fixed capacity multi producer multi consumer queue
+    // push and pop give up after the timeout so callers can check
+    // whether they should stop
+    template <class T>
+    class BoundedQueue
+    {
+    public:
+        explicit BoundedQueue(std::size_t cap)
+            : capacity(cap == 0u ? 1u : cap), items(), mutex(),
+            not_empty(), not_full() {}
+
+        // the value is moved from only if it was queued
+        template <class Rep, class Period>
+        bool push(T& value, std::chrono::duration<Rep, Period> timeout)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if(!not_full.wait_for(lock, timeout, 
+                        [this](){ return items.size() < capacity; }))
+                return false;
+            items.push_back(std::move(value));
+            lock.unlock();
+            not_empty.notify_one();
+            return true;
+        }
+
+        template <class Rep, class Period>
+        bool pop(T& value, std::chrono::duration<Rep, Period> timeout)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if(!not_empty.wait_for(lock, timeout, 
+                        [this](){ return !items.empty(); }))
+                return false;
+            value = std::move(items.front());
+            items.pop_front();
+            lock.unlock();
+            not_full.notify_one();
+            return true;
+        }
+
+        std::size_t size() 
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return items.size();
+        }
+    private:
+        std::size_t capacity;
+        std::deque<T> items;
+        std::mutex mutex;
+        std::condition_variable not_empty;
+        std::condition_variable not_full;
+    };
+
+    // answers single queries submitted from any number of threads with
+    // batched calls of a batch function on a dispatcher thread
+    // a query returns a future right away, so a caller can issue all of
+    // its independent queries before waiting on any of them
+    // a batch is run as soon as max_batch queries are pending or the
+    // oldest pending query waited max_wait; if the batch function throws
+    // or returns fewer results than queries, the unanswered futures hold
+    // an exception (a failed run is never given a default answer)
+    template <class Query, class Result>
+    class QueryCoalescer
+    {
+    public:
+        using batch_function_t = 
+            std::function<std::vector<Result>(std::vector<Query> const&)>;
+
+        QueryCoalescer(
+                batch_function_t const& fn, 
+                std::size_t max_batch, 
+                std::chrono::microseconds max_wait)
+            : batch_function(fn), 
+            max_batch_size(max_batch == 0u ? 1u : max_batch),
+            max_wait_time(max_wait), pending(), mutex(), 
+            query_available(), stopping(false), batches_run(0u),
+            dispatcher(&QueryCoalescer::dispatch, this) {}
+
+        QueryCoalescer(QueryCoalescer const&) = delete;
+        QueryCoalescer& operator=(QueryCoalescer const&) = delete;
+
+        // pending queries are answered before the dispatcher stops
+        ~QueryCoalescer()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            query_available.notify_one();
+            dispatcher.join();
+        }
+
+        std::future<Result> submit(Query const& q)
+        {
+            pending_query pq{q, std::promise<Result>(), 
+                std::chrono::steady_clock::now()};
+            auto retVal = pq.result.get_future();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending.push_back(std::move(pq));
+            }
+            query_available.notify_one();
+            return retVal;
+        }
+
+        std::vector<std::future<Result>> submit(std::vector<Query> const& qs)
+        {
+            std::vector<std::future<Result>> retVal;
+            retVal.reserve(qs.size());
+            auto now = std::chrono::steady_clock::now();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for(auto&& q : qs)
+                {
+                    pending.push_back({q, std::promise<Result>(), now});
+                    retVal.push_back(pending.back().result.get_future());
+                }
+            }
+            query_available.notify_one();
+            return retVal;
+        }
+
+        // submit as a callable for the strategies taking async queries
+        std::function<std::future<Result>(Query const&)> asyncFunction()
+        {
+            return [this](Query const& q){ return submit(q); };
+        }
+
+        std::size_t batchesRun() 
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return batches_run;
+        }
+    private:
+        struct pending_query
+        {
+            Query query;
+            std::promise<Result> result;
+            std::chrono::steady_clock::time_point submitted;
+        };
+
+        void dispatch()
+        {
+            std::vector<pending_query> batch;
+            std::vector<Query> queries;
+            while(true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    query_available.wait(lock, 
+                            [this](){ return stopping || !pending.empty(); });
+                    if(pending.empty())
+                        return;
+                    query_available.wait_until(lock, 
+                            pending.front().submitted + max_wait_time,
+                            [this](){ 
+                                return stopping || 
+                                    pending.size() >= max_batch_size; 
+                            });
+                    auto count = std::min(max_batch_size, pending.size());
+                    batch.clear();
+                    for(auto i = 0u; i < count; ++i)
+                    {
+                        batch.push_back(std::move(pending.front()));
+                        pending.pop_front();
+                    }
+                    ++batches_run;
+                }
+                queries.clear();
+                for(auto&& pq : batch)
+                    queries.push_back(std::move(pq.query));
+                std::vector<Result> results;
+                try
+                {
+                    results = batch_function(queries);
+                }
+                catch(...)
+                {
+                    for(auto&& pq : batch)
+                        pq.result.set_exception(std::current_exception());
+                    continue;
+                }
+                for(auto i = 0u; i < batch.size(); ++i)
+                {
+                    if(i < results.size())
+                        batch[i].result.set_value(
+                                static_cast<Result>(results[i]));
+                    else
+                        batch[i].result.set_exception(
+                                std::make_exception_ptr(std::runtime_error(
+                                        "batch query returned too few "
+                                        "results")));
+                }
+            }
+        }
+
+        batch_function_t batch_function;
+        std::size_t max_batch_size;
+        std::chrono::microseconds max_wait_time;
+        std::deque<pending_query> pending;
+        std::mutex mutex;
+        std::condition_variable query_available;
+        bool stopping;
+        std::size_t batches_run;
+        std::thread dispatcher;
+    };
+
+    // hash map for entries recorded by many threads at once. inserts
+    // and lookups are lock-free: each bucket is a list that only grows
+    // at its head (compare and swap) and keys are compared only when
+    // their precomputed 64 bit hashes are equal. pop removes an
+    // arbitrary entry from a lock-free stack of the inserted entries
+    // and unlinks it from its bucket (unlinks of the same bucket are
+    // serialized, inserts and lookups never wait for them). unlinked
+    // entries are freed once no operation is in progress
+    // the hash of a key must not depend on the thread computing it
+    template <class Key, class Value>
+    class ConcurrentHashMap
+    {
+    public:
+        explicit ConcurrentHashMap(std::size_t bucket_count = 1u << 12)
+            : buckets(), unlinking(), mask(0u), entries(0u), readers(0u),
+            live_head(nullptr), retired_head(nullptr), reclaiming(false),
+            unreclaimed()
+        {
+            std::size_t count = 1u;
+            while(count < bucket_count) count <<= 1;
+            buckets = std::vector<std::atomic<node*>>(count);
+            unlinking = std::vector<std::atomic<bool>>(count);
+            for(auto&& b : buckets) b.store(nullptr);
+            for(auto&& u : unlinking) u.store(false);
+            mask = count - 1u;
+        }
+
+        ConcurrentHashMap(ConcurrentHashMap const&) = delete;
+        ConcurrentHashMap& operator=(ConcurrentHashMap const&) = delete;
+
+        ~ConcurrentHashMap()
+        {
+            for(auto&& b : buckets)
+                deleteList(b.load(), &node::next);
+            deleteList(retired_head.load(), &node::next_retired);
+            for(auto n : unreclaimed) delete n;
+        }
+
+        // false if an entry with an equal key is already present
+        bool insert(std::uint64_t hash, Key const& key, Value const& value)
+        {
+            reader_guard guard(readers);
+            auto& bucket = buckets[hash & mask];
+            auto head = bucket.load();
+            node* checked_until = nullptr;
+            node* inserted = nullptr;
+            while(true)
+            {
+                if(find(head, checked_until, hash, key))
+                {
+                    delete inserted;
+                    return false;
+                }
+                if(!inserted)
+                    inserted = new node(hash, key, value);
+                inserted->next.store(head);
+                if(bucket.compare_exchange_weak(head, inserted))
+                    break;
+                // only the entries inserted since the last attempt
+                // need to be checked
+                checked_until = inserted->next.load();
+            }
+            ++entries;
+            inserted->next_live = live_head.load();
+            while(!live_head.compare_exchange_weak(
+                        inserted->next_live, inserted)) {}
+            return true;
+        }
+
+        bool contains(std::uint64_t hash, Key const& key)
+        {
+            reader_guard guard(readers);
+            return find(buckets[hash & mask].load(), nullptr, hash, key);
+        }
+
+        // removes an arbitrary entry, false if the map is empty
+        bool pop(Key& key, Value& value)
+        {
+            {
+                reader_guard guard(readers);
+                // entries are pushed onto the live stack once and are not
+                // freed while an operation is in progress, so the stack
+                // has no ABA
+                auto n = live_head.load();
+                while(n && !live_head.compare_exchange_weak(n, n->next_live)) {}
+                if(!n) return false;
+                n->taken.store(true);
+                --entries;
+                key = n->key;
+                value = std::move(n->value);
+                unlink(n);
+                n->next_retired = retired_head.load();
+                while(!retired_head.compare_exchange_weak(
+                            n->next_retired, n)) {}
+            }
+            releaseRetired();
+            return true;
+        }
+
+        std::size_t size() const { return entries.load(); }
+        bool empty() const { return entries.load() == 0u; }
+
+        // must not run concurrently with pop
+        template <class CallbackFunc>
+        void forEach(CallbackFunc&& cb) const
+        {
+            for(auto&& b : buckets)
+                for(auto n = b.load(); n; n = n->next.load())
+                    if(!n->taken.load()) cb(n->key, n->value);
+        }
+    private:
+        struct node
+        {
+            node(std::uint64_t h, Key const& k, Value const& v)
+                : hash(h), key(k), value(v), taken(false), next(nullptr),
+                next_live(nullptr), next_retired(nullptr) {}
+            const std::uint64_t hash;
+            Key key;
+            Value value;
+            std::atomic<bool> taken;
+            std::atomic<node*> next;
+            node* next_live;
+            node* next_retired;
+        };
+
+        struct reader_guard
+        {
+            explicit reader_guard(std::atomic<std::size_t>& r) : count(r) 
+            { ++count; }
+            ~reader_guard() { --count; }
+            std::atomic<std::size_t>& count;
+        };
+
+        static bool find(node* first, node* last, 
+                std::uint64_t hash, Key const& key)
+        {
+            // last may have been unlinked, the walk then ends at the tail
+            for(auto n = first; n && n != last; n = n->next.load())
+                if(n->hash == hash && !n->taken.load() && n->key == key)
+                    return true;
+            return false;
+        }
+
+        template <class Link>
+        static void deleteList(node* n, Link link)
+        {
+            while(n)
+            {
+                auto next = n->*link;
+                delete n;
+                n = next;
+            }
+        }
+        static void deleteList(node* n, std::atomic<node*> node::* link)
+        {
+            while(n)
+            {
+                auto next = (n->*link).load();
+                delete n;
+                n = next;
+            }
+        }
+
+        // inserts only replace the head of a bucket, so only unlinks
+        // change the link of an entry already in the list. an unlinked
+        // entry keeps its link so a lookup standing on it carries on
+        void unlink(node* n)
+        {
+            auto index = n->hash & mask;
+            auto& busy = unlinking[index];
+            while(busy.exchange(true, std::memory_order_acquire))
+                std::this_thread::yield();
+            auto next = n->next.load();
+            auto head = n;
+            if(!buckets[index].compare_exchange_strong(head, next))
+            {
+                auto pred = head;
+                while(pred->next.load() != n) pred = pred->next.load();
+                pred->next.store(next);
+            }
+            busy.store(false, std::memory_order_release);
+        }
+
+        // retired entries are unlinked before they are retired, so an
+        // operation that starts afterwards cannot reach them and they
+        // can be freed once no operation is in progress. each retired
+        // entry is moved to the unreclaimed list once
+        void releaseRetired()
+        {
+            if(reclaiming.exchange(true, std::memory_order_acquire)) return;
+            for(auto n = retired_head.exchange(nullptr); n; n = n->next_retired)
+                unreclaimed.push_back(n);
+            if(readers.load() == 0u)
+            {
+                for(auto n : unreclaimed) delete n;
+                unreclaimed.clear();
+            }
+            reclaiming.store(false, std::memory_order_release);
+        }
+
+        std::vector<std::atomic<node*>> buckets;
+        // set while an entry of the bucket is being unlinked
+        std::vector<std::atomic<bool>> unlinking;
+        std::size_t mask;
+        std::atomic<std::size_t> entries;
+        std::atomic<std::size_t> readers;
+        std::atomic<node*> live_head;
+        std::atomic<node*> retired_head;
+        // owned by the thread that set reclaiming
+        std::atomic<bool> reclaiming;
+        std::vector<node*> unreclaimed;
+    };
+
+    // insert only set on top of ConcurrentHashMap
+    template <class Key>
+    class ConcurrentHashSet
+    {
+    public:
+        explicit ConcurrentHashSet(std::size_t bucket_count = 1u << 12)
+            : map(bucket_count) {}
+
+        bool insert(std::uint64_t hash, Key const& key)
+        { return map.insert(hash, key, true); }
+        bool contains(std::uint64_t hash, Key const& key)
+        { return map.contains(hash, key); }
+        std::size_t size() const { return map.size(); }
+
+        template <class CallbackFunc>
+        void forEach(CallbackFunc&& cb) const
+        { map.forEach([&](Key const& key, bool){ cb(key); }); }
+    private:
+        ConcurrentHashMap<Key, bool> map;
+    };
+
+    // approximate set of 64 bit hashes: no false negatives, the false
+    // positive rate depends on the number of bits per inserted hash.
+    // bits are only ever set, so an insert or a lookup is one relaxed
+    // atomic access per probe
+    class ConcurrentBloomFilter
+    {
+    public:
+        // a filter without bits contains nothing
+        explicit ConcurrentBloomFilter(
+                std::size_t bit_count = 0u, unsigned hash_count = 4u)
+            : words((bit_count + 63u) / 64u),
+            hashes(std::max(1u, hash_count)),
+            inserted(0u)
+        {
+            for(auto&& word : words)
+                word.store(0u, std::memory_order_relaxed);
+        }
+
+        // false if the hash was (probably) already contained
+        bool insert(std::uint64_t hash)
+        {
+            if(words.empty()) return false;
+            auto h2 = probeStep(hash);
+            auto added = false;
+            for(auto i = 0u; i < hashes; ++i, hash += h2)
+            {
+                auto bit = hash % (words.size() * 64u);
+                auto mask = std::uint64_t(1u) << (bit % 64u);
+                if(!(words[bit / 64u].fetch_or(
+                                mask, std::memory_order_relaxed) & mask))
+                    added = true;
+            }
+            if(added) inserted.fetch_add(1u, std::memory_order_relaxed);
+            return added;
+        }
+
+        bool mayContain(std::uint64_t hash) const
+        {
+            if(words.empty()) return false;
+            auto h2 = probeStep(hash);
+            for(auto i = 0u; i < hashes; ++i, hash += h2)
+            {
+                auto bit = hash % (words.size() * 64u);
+                auto mask = std::uint64_t(1u) << (bit % 64u);
+                if(!(words[bit / 64u].load(std::memory_order_relaxed) & mask))
+                    return false;
+            }
+            return true;
+        }
+
+        std::size_t bits() const { return words.size() * 64u; }
+        // hashes that set at least one new bit
+        std::size_t size() const
+        { return inserted.load(std::memory_order_relaxed); }
+    private:
+        // odd step of the double hashing probe sequence
+        static std::uint64_t probeStep(std::uint64_t h)
+        {
+            h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdull;
+            h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ull;
+            return (h ^ (h >> 33)) | 1u;
+        }
+
+        std::vector<std::atomic<std::uint64_t>> words;
+        const unsigned hashes;
+        std::atomic<std::size_t> inserted;
+    };
+}
+
+#endif